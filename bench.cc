@@ -0,0 +1,1127 @@
+// Benchmarks for the filesystem's data structures.  Build with
+// "make bench" and run "./bench" for all of them or "./bench <name>"
+// for one.  Times are wall-clock; each figure is the mean over the
+// operations performed.
+
+#include <chrono>
+#include <random>
+#include <ftw.h>
+#include <thread>
+#include <atomic>
+#include "filesystem.h"
+
+using namespace filesystem;
+
+double now() {
+  return chrono::duration<double>( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// Names shuffled so that inserts don't arrive in sorted order.
+vector<string> names( size_t n ) {
+  vector<string> v;
+  for ( size_t i = 0; i < n; ++i ) v.push_back( "entry" + T2a(i) );
+  shuffle( v.begin(), v.end(), mt19937(179) );
+  return v;
+}
+
+// Inserts, looks up and erases n names in a fresh container of type M,
+// and reports ns per operation for each phase.
+template< typename M >
+void dirPhases( const char* label, const vector<string>& v ) {
+  InodeBase* x = reinterpret_cast<InodeBase*>( &x );
+  size_t n = v.size();
+  size_t rounds = max( size_t(1), size_t(1000000) / n );
+  double ins = 0, look = 0, era = 0;
+  size_t found = 0;
+  for ( size_t r = 0; r < rounds; ++r ) {
+    M* m = new M;
+    double t0 = now();
+    for ( auto& s : v ) (*m)[s] = x;
+    double t1 = now();
+    for ( auto& s : v ) found += m->find(s) != m->end();
+    double t2 = now();
+    for ( auto& s : v ) m->erase(s);
+    double t3 = now();
+    ins += t1 - t0;  look += t2 - t1;  era += t3 - t2;
+    delete m;
+  }
+  double ops = double(rounds) * n / 1e9;
+  cout << "  " << left << setw(10) << label << right << setw(9) << n
+       << fixed << setprecision(1)
+       << setw(10) << ins / ops << setw(10) << look / ops << setw(10) << era / ops
+       << ( found == rounds * n ? "" : "  LOOKUP MISMATCH" ) << endl;
+}
+
+void benchDir() {
+  cout << "dir: ns per operation          insert    lookup     erase\n";
+  size_t sizes[] = { 10, 1000, 1000000 };
+  for ( auto n : sizes ) {
+    vector<string> v = names(n);
+    dirPhases< map<string, InodeBase*> >( "std::map", v );
+    dirPhases< DirIndex<InodeBase*> >( "DirIndex", v );
+  }
+}
+
+// Sets up / with /bin and /dev, once, in a scratch directory so that
+// FSInit finds no snapshot or journal of ours and starts its journal
+// there.
+char scratch[] = "/tmp/fsbenchXXXXXX";
+void init() {
+  if ( root->file->current ) return;
+  if ( ! mkdtemp( scratch ) || chdir( scratch ) != 0 ) scratch[0] = 0;
+  FSInit( "/dev/null" );
+}
+
+// A tree of dirs x files inodes under /big, built directly through
+// Directory::mk rather than the apps.
+Inode<Directory>* bigTree( size_t dirs, size_t files ) {
+  init();
+  root->file->mk( "big", new Directory );
+  Inode<Directory>* big = static_cast<Inode<Directory>*>( lookup( root, "big" ) );
+  for ( size_t i = 0; i < dirs; ++i ) {
+    big->file->mk( "d" + T2a(i), new Directory );
+    Inode<Directory>* d = static_cast<Inode<Directory>*>( lookup( big, "d" + T2a(i) ) );
+    for ( size_t j = 0; j < files; ++j ) d->file->mk( "f" + T2a(j), new File );
+  }
+  return big;
+}
+
+// Counts the directories and file bytes under d, telling inodes apart
+// either the old way (a type string compared, then dynamic_cast) or
+// by kind tag and static_cast.
+long walkOld( Inode<Directory>* d ) {
+  long n = 0;
+  for ( auto it = d->file->theMap.begin(); it != d->file->theMap.end(); ++it ) {
+    InodeBase* b = it->second;
+    if ( string( kindName(b->kind) ) == "dir" ) n += 1 + walkOld( dynamic_cast<Inode<Directory>*>(b) );
+    else if ( string( kindName(b->kind) ) == "file" ) n += dynamic_cast<Inode<File>*>(b)->file->size();
+  }
+  return n;
+}
+long walkKind( Inode<Directory>* d ) {
+  long n = 0;
+  for ( auto it = d->file->theMap.begin(); it != d->file->theMap.end(); ++it ) {
+    InodeBase* b = it->second;
+    if ( b->kind == Kind::dir ) n += 1 + walkKind( static_cast<Inode<Directory>*>(b) );
+    else if ( b->kind == Kind::file ) n += static_cast<Inode<File>*>(b)->file->size();
+  }
+  return n;
+}
+
+// Walks a 1M-inode tree the way tree and save do, with tree's output
+// thrown away and save's going to /dev/null, then times the dispatch
+// on its own.
+void benchWalk() {
+  Inode<Directory>* big = bigTree( 1000, 1000 );
+  cout << "walk: " << big->subtreeEntries << " inodes\n";
+  streambuf* old = cout.rdbuf();
+  ostream null( 0 );
+  double t0 = now();
+  cout.rdbuf( null.rdbuf() );
+  TreeDFS( big, "" );
+  cout.rdbuf( old );
+  double t1 = now();
+  ofstream store( "/dev/null" );
+  preserveRecursive( big, "/big", store );
+  double t2 = now();
+  long a = walkOld( big );
+  double t3 = now();
+  long b = walkKind( big );
+  double t4 = now();
+  cout << right << fixed << setprecision(3)
+       << "  tree            " << setw(8) << t1 - t0 << " s\n"
+       << "  save            " << setw(8) << t2 - t1 << " s\n"
+       << "  string+dynamic  " << setw(8) << t3 - t2 << " s\n"
+       << "  kind+static     " << setw(8) << t4 - t3 << " s"
+       << ( a == b ? "" : "  MISMATCH" ) << endl;
+}
+
+// Tree walk for the query benchmark: files modified at or after since.
+long walkModified( Inode<Directory>* d, time_t since ) {
+  long n = 0;
+  for ( auto it = d->file->theMap.begin(); it != d->file->theMap.end(); ++it ) {
+    InodeBase* b = it->second;
+    if ( b->kind == Kind::dir ) n += walkModified( static_cast<Inode<Directory>*>(b), since );
+    else if ( b->kind == Kind::file && b->mTime() >= since ) ++n;
+  }
+  return n;
+}
+
+// "Files modified in the last day" and "ten largest files" over 1M
+// inodes, by walking the tree and by scanning inodeTable's columns.
+void benchQuery() {
+  Inode<Directory>* big = bigTree( 1000, 1000 );
+  mt19937 rng( 179 );
+  time_t today = time(0);
+  for ( auto it = big->file->theMap.begin(); it != big->file->theMap.end(); ++it ) {
+    Inode<Directory>* d = static_cast<Inode<Directory>*>( it->second );
+    for ( auto jt = d->file->theMap.begin(); jt != d->file->theMap.end(); ++jt ) {
+      Inode<File>* f = static_cast<Inode<File>*>( jt->second );
+      time_t m = today - rng() % ( 30 * 86400 );
+      f->updateTime( m, m, m );
+      f->truncate( rng() % 100000 );              // a hole; no blocks.
+    }
+  }
+  cout << "query: " << big->subtreeEntries << " inodes\n";
+  time_t since = today - 86400;
+  InodeTable& t = inodeTable;
+
+  double t0 = now();
+  long walked = walkModified( big, since );
+  double t1 = now();
+  InodeTable::Selection sel = t.select();
+  t.whereKind( sel, (unsigned char)Kind::file );
+  t.whereBetween( sel, t.mTime, InodeTable::Time(since), InodeTable::Time(INT64_MAX) );
+  long scanned = t.count( sel );
+  double t2 = now();
+
+  vector<pair<Offset, InodeBase*>> all;
+  vector<Inode<Directory>*> stack( 1, big );
+  while ( stack.size() ) {
+    Inode<Directory>* d = stack.back();
+    stack.pop_back();
+    for ( auto it = d->file->theMap.begin(); it != d->file->theMap.end(); ++it )
+      if ( it->second->kind == Kind::dir ) stack.push_back( static_cast<Inode<Directory>*>( it->second ) );
+      else all.push_back( make_pair( it->second->getbytes(), it->second ) );
+  }
+  partial_sort( all.begin(), all.begin() + 10, all.end(),
+                []( const pair<Offset, InodeBase*>& a, const pair<Offset, InodeBase*>& b ) { return a.first > b.first; } );
+  double t3 = now();
+  sel = t.select();
+  t.whereKind( sel, (unsigned char)Kind::file );
+  vector<int32_t> ids = t.ids( sel );
+  partial_sort( ids.begin(), ids.begin() + 10, ids.end(),
+                [&t]( int32_t a, int32_t b ) { return t.size[a] > t.size[b]; } );
+  double t4 = now();
+
+  cout << right << fixed << setprecision(1)
+       << "  modified in 1d   walk " << setw(7) << ( t1 - t0 ) * 1e3 << " ms   columns " << setw(7) << ( t2 - t1 ) * 1e3 << " ms"
+       << ( walked == scanned ? "" : "  MISMATCH" ) << endl
+       << "  10 largest       walk " << setw(7) << ( t3 - t2 ) * 1e3 << " ms   columns " << setw(7) << ( t4 - t3 ) * 1e3 << " ms"
+       << ( all[0].first == t.size[ids[0]] ? "" : "  MISMATCH" ) << endl;
+}
+
+long fileBytes( const string& f ) {
+  ifstream in( f, ios::binary | ios::ate );
+  return in ? long( in.tellg() ) : -1;
+}
+
+// Saves and reloads a 1M-entry tree (one file in a hundred has a few
+// bytes in it) as a binary snapshot and in the text format.  Runs in
+// a scratch directory since preserve() always writes ./info.txt.
+void benchSnap() {
+  init();
+  char dir[] = "/tmp/fsbenchXXXXXX";
+  if ( ! mkdtemp( dir ) || chdir( dir ) != 0 ) return;
+  Inode<Directory>* big = bigTree( 1000, 1000 );
+  long n = 0;
+  for ( auto it = big->file->theMap.begin(); it != big->file->theMap.end(); ++it ) {
+    Inode<Directory>* d = static_cast<Inode<Directory>*>( it->second );
+    for ( auto jt = d->file->theMap.begin(); jt != d->file->theMap.end(); ++jt )
+      if ( n++ % 100 == 0 ) static_cast<Inode<File>*>( jt->second )->append( "some text " + T2a(n) );
+  }
+  long entries = big->subtreeEntries;
+  cout << "snap: " << entries << " entries\n";
+
+  double t0 = now();
+  saveSnapshot( "info.snap" );
+  double t1 = now();
+  preserve( root, "" );
+  double t2 = now();
+  root->file->rm( "big" );
+  double t3 = now();
+  loadSnapshot( "info.snap" );
+  double t4 = now();
+  long loaded = static_cast<Inode<Directory>*>( lookup( root, "big" ) )->subtreeEntries;
+  root->file->rm( "big" );
+  double t5 = now();
+  importText( "info.txt" );
+  double t6 = now();
+  long imported = static_cast<Inode<Directory>*>( lookup( root, "big" ) )->subtreeEntries;
+
+  cout << right << fixed << setprecision(2)
+       << "           save s   load s    MB\n"
+       << "  binary " << setw(8) << t1 - t0 << setw(9) << t4 - t3 << setw(7) << fileBytes( "info.snap" ) / 1e6
+       << ( loaded == entries ? "" : "  MISMATCH" ) << endl
+       << "  text   " << setw(8) << t2 - t1 << setw(9) << t6 - t5 << setw(7) << fileBytes( "info.txt" ) / 1e6
+       << ( imported == loaded ? "" : "  MISMATCH" ) << endl;
+  unlink( "info.snap" );
+  unlink( "info.txt" );
+  if ( chdir( "/" ) == 0 ) rmdir( dir );
+  if ( scratch[0] && chdir( scratch ) != 0 ) scratch[0] = 0;
+}
+
+// Writes and reloads an image of 100k files of repetitive text under
+// long shared paths, as text and compressed, and times the codec on
+// its own over the same bytes.
+void benchZip() {
+  init();
+  root->file->mk( "usr", new Directory );
+  Inode<Directory>* usr = static_cast<Inode<Directory>*>( lookup( root, "usr" ) );
+  usr->file->mk( "mtran", new Directory );
+  Inode<Directory>* home = static_cast<Inode<Directory>*>( lookup( usr, "mtran" ) );
+  const char* words[] = { "the", "inode", "directory", "of", "file", "is", "a", "block", "written", "to" };
+  mt19937 rng( 179 );
+  for ( int i = 0; i < 100; ++i ) {
+    home->file->mk( "project" + T2a(i), new Directory );
+    Inode<Directory>* d = static_cast<Inode<Directory>*>( lookup( home, "project" + T2a(i) ) );
+    for ( int j = 0; j < 1000; ++j ) {
+      string text;
+      for ( int k = rng() % 40; k >= 0; --k ) text += string( words[ rng() % 10 ] ) + ( k % 8 ? " " : ". " );
+      File* f = new File;
+      f->append( text );
+      d->file->mk( "notes" + T2a(j) + ".txt", f );
+    }
+  }
+  long entries = usr->subtreeEntries;
+  preserve( root, "" );
+  long text = fileBytes( "info.txt" );
+  double t0 = now();
+  streambuf* old = cout.rdbuf( 0 );
+  preserve( root, "", true );
+  cout.rdbuf( old );
+  double t1 = now();
+  long packed = fileBytes( "info.txt" );
+  root->file->rm( "usr" );
+  double t2 = now();
+  importText( "info.txt" );
+  double t3 = now();
+  bool same = lookup( root, "usr" ) && static_cast<Inode<Directory>*>( lookup( root, "usr" ) )->subtreeEntries == entries;
+
+  // The codec alone, over the uncompressed record stream.
+  ifstream in( "info.txt", ios::binary );
+  LZReader::sniff( in );
+  LZReader z( in );
+  string raw, block;
+  while ( z.next( block ) ) raw += block;
+  string out, back( LZ_BLOCK, 0 );
+  double c0 = now();
+  vector<size_t> ends;
+  for ( size_t at = 0; at < raw.size(); at += LZ_BLOCK ) {
+    lzCompress( raw.data() + at, min( LZ_BLOCK, raw.size() - at ), out );
+    ends.push_back( out.size() );
+  }
+  double c1 = now();
+  size_t from = 0;
+  for ( size_t b = 0; b < ends.size(); ++b ) {
+    size_t n = min( LZ_BLOCK, raw.size() - b * LZ_BLOCK );
+    if ( ! lzDecompress( out.data() + from, ends[b] - from, &back[0], n ) ) same = false;
+    from = ends[b];
+  }
+  double c2 = now();
+  cout << "zip: 100k files; text image " << text / 1000 << " KB, compressed " << packed / 1000
+       << " KB (" << fixed << setprecision(1) << double( text ) / packed << ":1 vs text, "
+       << double( raw.size() ) / out.size() << ":1 codec)\n"
+       << "  save " << setprecision(0) << ( t1 - t0 ) * 1e3 << " ms, load " << ( t3 - t2 ) * 1e3 << " ms"
+       << ( same ? "" : "  MISMATCH" ) << endl
+       << "  codec: compress " << raw.size() / ( c1 - c0 ) / 1e6 << " MB/s, decompress "
+       << raw.size() / ( c2 - c1 ) / 1e6 << " MB/s\n";
+  root->file->rm( "usr" );
+  unlink( "info.txt" );
+}
+
+// Copies a 10k-file, 160 MB tree with cp, whose copies share their
+// contents, and block by block as cp used to; then writes to one
+// file in ten of the shared copy.
+void benchCow() {
+  init();
+  root->file->mk( "tmpl", new Directory );
+  Inode<Directory>* t = static_cast<Inode<Directory>*>( lookup( root, "tmpl" ) );
+  string body( 16 * 1024, 'x' );
+  for ( int i = 0; i < 100; ++i ) {
+    t->file->mk( "d" + T2a(i), new Directory );
+    Inode<Directory>* d = static_cast<Inode<Directory>*>( lookup( t, "d" + T2a(i) ) );
+    for ( int j = 0; j < 100; ++j ) {
+      File* f = new File;
+      f->append( body );
+      d->file->mk( "f" + T2a(j), f );
+    }
+  }
+  BlockNo b0 = blocks.inUse;
+  double t0 = now();
+  cp( Args{ "cp", "/tmpl", "/shared" } );
+  double t1 = now();
+  BlockNo b1 = blocks.inUse;
+  root->file->mk( "deep", new Directory );
+  Inode<Directory>* deep = static_cast<Inode<Directory>*>( lookup( root, "deep" ) );
+  for ( auto it = t->file->theMap.begin(); it != t->file->theMap.end(); ++it ) {
+    deep->file->mk( it->first, new Directory );
+    Inode<Directory>* d = static_cast<Inode<Directory>*>( lookup( deep, it->first ) );
+    Directory* from = static_cast<Inode<Directory>*>( it->second )->file;
+    for ( auto jt = from->theMap.begin(); jt != from->theMap.end(); ++jt ) {
+      File* f = new File;
+      f->assign( *static_cast<Inode<File>*>( jt->second )->file );
+      d->file->mk( jt->first, f );
+    }
+  }
+  double t2 = now();
+  BlockNo b2 = blocks.inUse;
+  Inode<Directory>* shared = static_cast<Inode<Directory>*>( lookup( root, "shared" ) );
+  for ( int i = 0; i < 100; ++i ) {
+    Inode<Directory>* d = static_cast<Inode<Directory>*>( lookup( shared, "d" + T2a(i) ) );
+    for ( int j = 0; j < 100; j += 10 ) as<File>( lookup( d, "f" + T2a(j) ) )->pwrite( "y", 1, 0 );
+  }
+  double t3 = now();
+  cout << "cow: cp of 10k files, 160 MB\n" << fixed << setprecision(1)
+       << "  shared      " << setw(8) << ( t1 - t0 ) * 1e3 << " ms " << setw(8) << ( b1 - b0 ) * BLOCK_SIZE / 1e6 << " MB new\n"
+       << "  copied      " << setw(8) << ( t2 - t1 ) * 1e3 << " ms " << setw(8) << ( b2 - b1 ) * BLOCK_SIZE / 1e6 << " MB new\n"
+       << "  1k writes   " << setw(8) << ( t3 - t2 ) * 1e3 << " ms " << setw(8) << ( blocks.inUse - b2 ) * BLOCK_SIZE / 1e6
+       << " MB new, as each copied file unshares\n";
+  root->file->rm( "tmpl" );
+  root->file->rm( "shared" );
+  root->file->rm( "deep" );
+}
+
+// cp -r of a 100k-file tree (1000 directories of 100 files) with the
+// clone engine at several thread counts.
+void benchClone() {
+  init();
+  root->file->mk( "src", new Directory );
+  Inode<Directory>* src = static_cast<Inode<Directory>*>( lookup( root, "src" ) );
+  for ( int i = 0; i < 1000; ++i ) {
+    src->file->mk( "d" + T2a(i), new Directory );
+    Inode<Directory>* d = static_cast<Inode<Directory>*>( lookup( src, "d" + T2a(i) ) );
+    for ( int j = 0; j < 100; ++j ) {
+      File* f = new File;
+      f->append( "file " + T2a(j) );
+      d->file->mk( "f" + T2a(j), f );
+    }
+  }
+  cout << "clone: cp -r of " << src->subtreeEntries << " entries\n  threads      ms   with -p\n";
+  int threads = cloneThreads;
+  for ( int t : { 1, 2, 4, 8 } ) {
+    cloneThreads = t;
+    double best[2] = { 1e9, 1e9 };
+    for ( int p = 0; p < 2; ++p )
+      for ( int rep = 0; rep < 3; ++rep ) {
+        double t0 = now();
+        cp( p ? Args{ "cp", "-p", "/src", "/copy" } : Args{ "cp", "-r", "/src", "/copy" } );
+        best[p] = min( best[p], now() - t0 );
+        root->file->rm( "copy" );
+      }
+    cout << setw(9) << t << fixed << setprecision(1) << setw(8) << best[0] * 1e3 << setw(10) << best[1] * 1e3 << endl;
+  }
+  cloneThreads = threads;
+  root->file->rm( "src" );
+}
+
+// Journals 2000 writes in each durability mode, against checkpointing
+// a 100k-entry image, which save and exit used to do every time.
+void benchJournal() {
+  init();
+  bigTree( 100, 1000 );
+  App* write = apps["write"];
+  const char* modes[] = { "none", "fsync", "group" };
+  cout << "journal:        us/op   fsyncs\n";
+  for ( int m : { Journal::NONE, Journal::GROUP, Journal::FSYNC } ) {
+    journal.mode = Journal::Mode(m);
+    uint64_t syncs = journal.syncs;
+    streambuf* old = cout.rdbuf( 0 );          // write echoes the file.
+    double t0 = now();
+    for ( int i = 0; i < 2000; ++i ) write( Args{ "write", "/big/d0/f" + T2a( i % 1000 ), "some text" } );
+    double t1 = now();
+    cout.rdbuf( old );
+    cout << "  " << left << setw(10) << modes[m] << right << fixed << setprecision(1)
+         << setw(9) << ( t1 - t0 ) / 2000 * 1e6 << setw(9) << journal.syncs - syncs << endl;
+  }
+  double t0 = now();
+  checkpoint();
+  double t1 = now();
+  cout << "  checkpoint " << setprecision(0) << ( t1 - t0 ) * 1e6 << " us, journal now "
+       << journal.size() << " bytes\n";
+  journal.mode = Journal::GROUP;
+  root->file->rm( "big" );
+}
+
+// Saves a 1M-entry tree in full, then after changing k files spread
+// over as many directories, for growing k.  An incremental save
+// should cost in proportion to k, not to the size of the tree.
+void benchIncr() {
+  Inode<Directory>* big = bigTree( 1000, 1000 );
+  double t0 = now();
+  saveSnapshot( "info.snap" );
+  double t1 = now();
+  saveSegments( true );
+  double t2 = now();
+  cout << "incr: 1M entries; snapshot " << fixed << setprecision(0) << ( t1 - t0 ) * 1e3
+       << " ms, full segment save " << ( t2 - t1 ) * 1e3 << " ms, " << segments.written / 1000 << " KB\n"
+       << "  changed     ms        KB\n";
+  unlink( "info.snap" );
+  mt19937 rng( 179 );
+  for ( int k : { 0, 1, 10, 100, 1000 } ) {
+    for ( int i = 0; i < k; ++i ) {
+      Inode<Directory>* d = static_cast<Inode<Directory>*>( lookup( big, "d" + T2a( rng() % 1000 ) ) );
+      as<File>( lookup( d, "f" + T2a( rng() % 1000 ) ) )->append( "changed" );
+    }
+    double t0 = now();
+    saveSegments();
+    double t1 = now();
+    cout << setw(9) << k << setw(7) << setprecision(1) << ( t1 - t0 ) * 1e3
+         << setw(10) << segments.written / 1000 << endl;
+  }
+  root->file->rm( "big" );
+}
+
+// Per-command latency of writes into a 1M-entry tree while it is
+// saved every 2000 commands: never, in the foreground, or in the
+// background with only the freeze and the finish in the command path.
+void benchLatency() {
+  bigTree( 1000, 1000 );
+  journal.mode = Journal::NONE;
+  saveSegments( true );
+  string text( 1000, 'x' );
+  cout << "latency: 1M entries, 20000 writes of 1 KB, a save every 2000\n"
+       << "  saves         p50 us   p99 us   max ms   total s\n";
+  const char* modes[] = { "none", "foreground", "background" };
+  for ( int m = 0; m < 3; ++m ) {
+    mt19937 rng( 179 );
+    vector<double> lat;
+    Save* sv = 0;
+    thread writer;
+    atomic<bool> done( false );
+    streambuf* old = cout.rdbuf( 0 );          // write echoes the file.
+    double t0 = now();
+    for ( int i = 1; i <= 20000; ++i ) {
+      double a = now();
+      write( Args{ "write", "/big/d" + T2a( rng() % 1000 ) + "/f" + T2a( rng() % 1000 ), text } );
+      if ( sv && done ) {
+        writer.join();
+        finishSave( sv );
+        sv = 0;
+      }
+      if ( i % 2000 == 0 && m == 1 ) saveSegments();
+      if ( i % 2000 == 0 && m == 2 && ! sv && ( sv = freezeSave() ) ) {
+        done = false;
+        writer = thread( [&]() { encodeSave( *sv ); writeSave( *sv ); done = true; } );
+      }
+      lat.push_back( now() - a );
+    }
+    if ( sv ) {
+      writer.join();
+      finishSave( sv );
+    }
+    double t1 = now();
+    cout.rdbuf( old );
+    sort( lat.begin(), lat.end() );
+    cout << "  " << left << setw(12) << modes[m] << right << fixed << setprecision(1)
+         << setw(9) << lat[ lat.size() / 2 ] * 1e6 << setw(9) << lat[ lat.size() * 99 / 100 ] * 1e6
+         << setw(9) << lat.back() * 1e3 << setw(10) << setprecision(2) << t1 - t0 << endl;
+  }
+  journal.mode = Journal::GROUP;
+  root->file->rm( "big" );
+}
+
+// Creates and removes 100k small files and 1k directories per round;
+// with reclamation the reserved memory stays flat after the first.
+void benchChurn() {
+  init();
+  root->file->mk( "churn", new Directory );
+  Inode<Directory>* c = static_cast<Inode<Directory>*>( lookup( root, "churn" ) );
+  vector<string> v = names( 100000 );
+  cout << "churn: round  ns/op   inodes KB   payload KB   blocks KB\n";
+  for ( int r = 1; r <= 5; ++r ) {
+    double t0 = now();
+    for ( size_t i = 0; i < v.size(); ++i ) {
+      File* f = new File;
+      f->append( v[i] );
+      c->file->mk( v[i], f );
+      if ( i % 100 == 0 ) c->file->mk( "d" + v[i], new Directory );
+    }
+    for ( size_t i = 0; i < v.size(); ++i ) {
+      c->file->rm( v[i] );
+      if ( i % 100 == 0 ) c->file->rm( "d" + v[i] );
+    }
+    double t1 = now();
+    size_t inodes = slab< Inode<File> >().reservedBytes() + slab< Inode<Directory> >().reservedBytes();
+    size_t payload = slab<File>().reservedBytes() + slab<Directory>().reservedBytes();
+    cout << right << setw(12) << r << setw(8) << fixed << setprecision(0) << ( t1 - t0 ) / ( 2.02 * v.size() ) * 1e9
+         << setw(12) << inodes / 1024 << setw(13) << payload / 1024 << setw(12) << blocks.reservedBytes() / 1024 << endl;
+  }
+}
+
+// 20k journaled appends of a line to a file six directories down, by
+// path (pwrite, which resolves the path every time) and then through
+// one open descriptor.
+void benchFd() {
+  init();
+  mkdir( Args{ "mkdir", "/fdb" } );
+  string dir = "/fdb";
+  for ( const char* s : { "a", "b", "c", "d", "e" } ) {
+    dir += string("/") + s;
+    mkdir( Args{ "mkdir", dir } );
+  }
+  string path = dir + "/log";
+  touch( Args{ "touch", path } );
+  const int n = 20000;
+  string line = "a line of about forty bytes of log text";
+  Offset off = 0;
+  double t0 = now();
+  for ( int i = 0; i < n; ++i ) {
+    journaled<pwrite>( Args{ "pwrite", path, T2a( off ), line } );
+    off += line.size();
+  }
+  double t1 = now();
+  streambuf* out = cout.rdbuf( 0 );
+  openApp( Args{ "open", path, "a" } );
+  cout.rdbuf( out );
+  int fd = 0;
+  while ( fdTable().fd[fd].inode == 0 ) ++fd;
+  string fds = T2a( fd );
+  double t2 = now();
+  for ( int i = 0; i < n; ++i ) writeFd( fd, Args{ "write", fds, line } );
+  double t3 = now();
+  closeApp( Args{ "close", fds } );
+  cout << "fd: " << n << " appends " << path << "\n" << fixed << setprecision(2)
+       << "  by path   " << setw(8) << ( t1 - t0 ) / n * 1e6 << " us/op\n"
+       << "  by fd     " << setw(8) << ( t3 - t2 ) / n * 1e6 << " us/op\n";
+  root->file->rm( "fdb" );
+}
+
+// cat of a 256 MB file of 64-byte lines with standard output on
+// /dev/null: the file copied into a string and sent through cout as
+// cat used to, then streamed from its blocks, then with -n.
+void benchCat() {
+  init();
+  const Offset size = 256 << 20;
+  string line( 63, 'x' );
+  line += '\n';
+  string chunk;
+  while ( chunk.size() < ( 1 << 20 ) ) chunk += line;
+  root->file->mk( "big.txt", new File );
+  Inode<File>* f = as<File>( lookup( root, "big.txt" ) );
+  for ( Offset n = 0; n < size; n += chunk.size() ) f->append( chunk );
+  fflush( stdout );
+  cout.flush();
+  int saved = dup( STDOUT_FILENO );
+  int null = ::open( "/dev/null", O_WRONLY );
+  dup2( null, STDOUT_FILENO );
+  ::close( null );
+  const int rounds = 4;
+  double t0 = now();
+  for ( int i = 0; i < rounds; ++i ) cout << f->file->contents() << endl;
+  double t1 = now();
+  for ( int i = 0; i < rounds; ++i ) cat( Args{ "cat", "/big.txt" } );
+  double t2 = now();
+  for ( int i = 0; i < rounds; ++i ) cat( Args{ "cat", "-n", "/big.txt" } );
+  double t3 = now();
+  dup2( saved, STDOUT_FILENO );
+  ::close( saved );
+  double gb = double( size ) * rounds / 1e9;
+  cout << "cat: 256 MB to /dev/null\n" << fixed << setprecision(2)
+       << "  string+cout " << setw(8) << gb / ( t1 - t0 ) << " GB/s\n"
+       << "  streamed    " << setw(8) << gb / ( t2 - t1 ) << " GB/s\n"
+       << "  cat -n      " << setw(8) << gb / ( t3 - t2 ) << " GB/s\n";
+  root->file->rm( "big.txt" );
+}
+
+// wc's old loop, which took a copy of the file and counted spaces as
+// words.
+long wcOld( File* f ) {
+  string s = f->contents();
+  int wCount = 0, nLineCount = 0, charCount = 0;
+  for ( unsigned int i = 0; i < s.length(); i++ ) {
+    if ( ( s.at(i) == ' ' ) && ( s.at(i) + 1 != '\0' ) ) wCount++;
+    if ( s.at(i) == '\n' ) nLineCount++;
+    if ( ( s.at(i) != ' ' && s.at(i) != '\n' && s.at(i) != '\t' ) ) charCount++;
+  }
+  return wCount + nLineCount + charCount;
+}
+
+// Counting text files of 1 KB to 1 GB: the old loop, each kernel on
+// one thread, and countFile() as wc runs it, in GB/s.
+void benchWc() {
+  init();
+  CountImpl impl[3];
+  int nimpl = countImpls( impl );
+  string text;
+  mt19937 r( 7 );
+  while ( text.size() < ( 1 << 20 ) ) {
+    text += string( 1 + r() % 9, 'a' + r() % 26 );
+    text += r() % 12 ? ' ' : '\n';
+  }
+  text.resize( 1 << 20 );
+  cout << "wc: GB/s, " << wcThreads << " threads for countFile\n" << setw(10) << "size" << setw(10) << "old";
+  for ( int k = 0; k < nimpl; ++k ) cout << setw(10) << impl[k].name;
+  cout << setw(12) << "countFile" << endl;
+  for ( Offset size : { Offset(1) << 10, Offset(64) << 10, Offset(1) << 20, Offset(64) << 20, Offset(1) << 30 } ) {
+    File* f = new File;
+    for ( Offset n = 0; n < size; n += text.size() ) f->append( text.substr( 0, min( Offset( text.size() ), size - n ) ) );
+    int rounds = max( Offset(1), ( Offset(256) << 20 ) / size );
+    long sink = 0;
+    double t0 = now();
+    for ( int i = 0; i < rounds; ++i ) sink += wcOld( f );
+    double old = now() - t0;
+    cout << setw(9) << ( size < ( 1 << 20 ) ? T2a( size >> 10 ) + "K" : size < ( 1 << 30 ) ? T2a( size >> 20 ) + "M" : "1G" )
+         << fixed << setprecision(2) << setw(10) << double( size ) * rounds / old / 1e9;
+    Counts want;
+    for ( int k = 0; k < nimpl; ++k ) {
+      Counts c;
+      double t1 = now();
+      for ( int i = 0; i < rounds; ++i ) {
+        c = Counts();
+        f->spans( 0, size, [&]( const char* p, Offset n ) { countBytes( p, n, c, impl[k] ); } );
+      }
+      double t = now() - t1;
+      if ( k == 0 ) want = c;
+      bool same = c.lines == want.lines && c.words == want.words && c.chars == want.chars && c.bytes == want.bytes;
+      cout << setw(10) << double( size ) * rounds / t / 1e9 << ( same ? "" : "!" );
+    }
+    double t2 = now();
+    for ( int i = 0; i < rounds; ++i ) sink += countFile( f ).words;
+    cout << setw(12) << double( size ) * rounds / ( now() - t2 ) / 1e9 << ( sink ? "" : " " ) << endl;
+    f->release();
+  }
+}
+
+// Searches of a 1M-inode tree (1000 directories of 1000 files, a few
+// of them 4 KB) with standard output on /dev/null: tree captured and
+// grepped, against find; then find down a chain 20k directories deep.
+void benchFind() {
+  Inode<Directory>* big = bigTree( 1000, 1000 );
+  string body( 4096, 'x' );
+  for ( int i = 0; i < 1000; i += 100 )
+    as<File>( lookup( as<Directory>( lookup( big, "d" + T2a(i) ) ), "f0" ) )->append( body );
+  fflush( stdout );
+  cout.flush();
+  int saved = dup( STDOUT_FILENO );
+  int null = ::open( "/dev/null", O_WRONLY );
+  dup2( null, STDOUT_FILENO );
+  ::close( null );
+  double t0 = now();
+  stringstream all;
+  streambuf* old = cout.rdbuf( all.rdbuf() );
+  TreeDFS( big, "" );
+  cout.rdbuf( old );
+  long hits = 0;
+  string line;
+  while ( getline( all, line ) ) hits += line.find( "f999 " ) != string::npos;
+  double t1 = now();
+  find( Args{ "find", "/big", "-name", "f999" } );
+  double t2 = now();
+  find( Args{ "find", "/big", "-name", "f99*", "-type", "f" } );
+  double t3 = now();
+  find( Args{ "find", "/big", "-type", "f", "-size", "+1k" } );
+  double t4 = now();
+  root->file->mk( "deep", new Directory );
+  Inode<Directory>* d = as<Directory>( lookup( root, "deep" ) );
+  for ( int i = 0; i < 20000; ++i ) {
+    d->file->mk( "d", new Directory );
+    d = as<Directory>( lookup( d, "d" ) );
+  }
+  double t5 = now();
+  find( Args{ "find", "/deep", "-name", "nothing" } );
+  double t6 = now();
+  dup2( saved, STDOUT_FILENO );
+  ::close( saved );
+  cout << "find: 1M inodes, " << hits << " lines from tree\n" << right << fixed << setprecision(1)
+       << "  tree | grep f999        " << setw(8) << ( t1 - t0 ) * 1e3 << " ms\n"
+       << "  find -name f999         " << setw(8) << ( t2 - t1 ) * 1e3 << " ms\n"
+       << "  find -name f99* -type f " << setw(8) << ( t3 - t2 ) * 1e3 << " ms\n"
+       << "  find -type f -size +1k  " << setw(8) << ( t4 - t3 ) * 1e3 << " ms, small subtrees pruned\n"
+       << "  find, 20k levels deep   " << setw(8) << ( t6 - t5 ) * 1e3 << " ms\n";
+  root->file->rm( "big" );
+  root->file->rm( "deep" );
+}
+
+// grep over 1 GB in 10k files of 100 KB (10 GB would not fit in this
+// machine's memory): building the index, then queries through it and
+// by scanning every file.  The text is Zipf-distributed words from a
+// 50k vocabulary, and each file also holds one word of its own.
+void benchGrep() {
+  init();
+  mt19937 r( 3 );
+  vector<string> vocab;
+  for ( int i = 0; i < 50000; ++i ) {
+    string w;
+    for ( int k = 3 + r() % 8; k; --k ) w += 'a' + r() % 26;
+    vocab.push_back( w );
+  }
+  vector<double> weight;
+  for ( int i = 0; i < 50000; ++i ) weight.push_back( 1.0 / ( i + 1 ) );
+  discrete_distribution<int> zipf( weight.begin(), weight.end() );
+  vector<string> pages( 32 );
+  for ( auto& p : pages )
+    while ( p.size() < ( 1 << 20 ) ) p += vocab[ zipf(r) ] + ( r() % 10 ? " " : "\n" );
+  const int files = 10000, size = 100 * 1024;
+  root->file->mk( "text", new Directory );
+  Inode<Directory>* text = as<Directory>( lookup( root, "text" ) );
+  for ( int i = 0; i < files; ++i ) {
+    File* f = new File;
+    const string& p = pages[ i % pages.size() ];
+    size_t at = r() % ( p.size() - size );
+    f->append( p.substr( at, size / 2 ) + " only" + T2a(i) + " " + p.substr( at + size / 2, size / 2 ) );
+    text->file->mk( "f" + T2a(i), f );
+  }
+  double t0 = now();
+  syncTextIndex();
+  double t1 = now();
+  size_t g, w;
+  size_t mem = textIndex.memory( g, w );
+  cout << "grep: " << files << " files, " << text->subtreeBytes / ( 1 << 20 ) << " MB\n" << right << fixed << setprecision(1)
+       << "  index built in " << ( t1 - t0 ) << " s: " << g << " trigrams, " << w << " words, "
+       << mem / ( 1 << 20 ) << " MB\n"
+       << "  query                      hits   index ms    scan ms\n";
+  streambuf* out = cout.rdbuf( 0 );
+  for ( auto q : { Args{ "only4242" }, Args{ "-w", "only4242" }, Args{ "-w", vocab[0] }, Args{ "-w", vocab[20000] },
+                   Args{ vocab[30000] }, Args{ "qqqzzz" } } ) {
+    Args a{ "grep", "-c" };
+    a.insert( a.end(), q.begin(), q.end() );
+    a.push_back( "/text" );
+    Args b = a;
+    b.insert( b.begin() + 1, "-s" );
+    stringstream hits;
+    cout.rdbuf( hits.rdbuf() );
+    double t2 = now();
+    grep( a );
+    double t3 = now();
+    cout.rdbuf( 0 );
+    grep( b );
+    double t4 = now();
+    cout.rdbuf( out );
+    string label = join( q, " " );
+    int n = atoi( hits.str().c_str() );
+    cout << "  " << left << setw(24) << label << right << setw(8) << n << setw(11) << ( t3 - t2 ) * 1e3 << setw(11) << ( t4 - t3 ) * 1e3 << endl;
+    cout.rdbuf( 0 );
+  }
+  cout.rdbuf( out );
+  for ( int i = 0; i < 100; ++i ) as<File>( lookup( text, "f" + T2a(i) ) )->append( " appended" );
+  double t5 = now();
+  syncTextIndex();
+  cout << "  100 files appended to: index caught up in " << ( now() - t5 ) * 1e3 << " ms\n";
+  root->file->rm( "text" );
+}
+
+// tree, the text image and a recount of the totals over a 1M-inode
+// tree on 1, 4 and 16 threads, and a recount down a 20k-deep chain,
+// which the old recursive walkers took a stack frame per level for.
+void benchTraverse() {
+  Inode<Directory>* big = bigTree( 1000, 1000 );
+  for ( int i = 0; i < 1000; ++i )
+    as<File>( lookup( as<Directory>( lookup( big, "d" + T2a(i) ) ), "f" + T2a(i) ) )->append( "some text" );
+  cout << "traverse: " << big->subtreeEntries << " inodes\n  threads    tree s    save s recount ms\n";
+  int threads = walkThreads;
+  ostream null( 0 );
+  ofstream store( "/dev/null" );
+  for ( int t : { 1, 4, 16 } ) {
+    walkThreads = t;
+    streambuf* old = cout.rdbuf( null.rdbuf() );
+    double t0 = now();
+    TreeDFS( big, "" );
+    double t1 = now();
+    cout.rdbuf( old );
+    preserveRecursive( big, "/big", store );
+    double t2 = now();
+    long wrong = recount( big, t );
+    double t3 = now();
+    cout << right << setw(9) << t << fixed << setprecision(3) << setw(10) << t1 - t0 << setw(10) << t2 - t1
+         << setprecision(1) << setw(11) << ( t3 - t2 ) * 1e3 << ( wrong ? "  TOTALS WRONG" : "" ) << endl;
+  }
+  walkThreads = threads;
+  root->file->mk( "deep", new Directory );
+  Inode<Directory>* d = as<Directory>( lookup( root, "deep" ) );
+  for ( int i = 0; i < 20000; ++i ) {
+    d->file->mk( "d", new Directory );
+    d = as<Directory>( lookup( d, "d" ) );
+  }
+  double t4 = now();
+  long wrong = recount( as<Directory>( lookup( root, "deep" ) ) );
+  cout << "  recount, 20k levels deep  " << fixed << setprecision(1) << ( now() - t4 ) * 1e3 << " ms"
+       << ( wrong ? "  TOTALS WRONG" : "" ) << endl;
+  root->file->rm( "big" );
+  root->file->rm( "deep" );
+}
+
+// tree's lines as they were put together before, through show().
+struct ShowLines {
+  string prefix;
+  vector<size_t> at;
+  ShowLines() : at( 1, 0 ) {}
+  WalkNext pre( const WalkStep& s, string& out ) {
+    ostringstream line;
+    line << prefix.substr( 0, at[s.depth] ) << ( s.last ? "└── " : "├── " )
+         << ( s.x->kind == Kind::file ? "\033[0;32m" : "" ) << left << setw(10) << *s.name << setw(0) << " " << s.x->show()
+         << ( s.x->kind == Kind::file ? "\033[0;30m" : "" );
+    out += line.str();
+    if ( s.x->kind != Kind::dir ) return WalkNext::over;
+    prefix.resize( at[s.depth] );
+    prefix += s.last ? "    " : "│   ";
+    at.resize( s.depth + 2 );
+    at[s.depth + 1] = prefix.size();
+    return WalkNext::into;
+  }
+  void post( const WalkStep&, string& ) {}
+};
+
+// tree over a 1M-inode tree into /dev/null, with lines built through
+// show() and cout, and built in place, in color or not, and with -L.
+void benchRender() {
+  Inode<Directory>* big = bigTree( 1000, 1000 );
+  fflush( stdout );
+  cout.flush();
+  int saved = dup( STDOUT_FILENO );
+  int null = ::open( "/dev/null", O_WRONLY );
+  dup2( null, STDOUT_FILENO );
+  ::close( null );
+  double t0 = now();
+  ShowLines old;
+  string out;
+  walkEntries( big, 0, old, out, &cout );
+  cout.flush();
+  double t1 = now();
+  int threads = walkThreads;
+  walkThreads = 1;
+  TreeDFS( big, "" );
+  double t2 = now();
+  TreeDFS( big, "", INT_MAX, false );
+  double t3 = now();
+  TreeDFS( big, "", 1 );
+  double t4 = now();
+  walkThreads = threads;
+  dup2( saved, STDOUT_FILENO );
+  ::close( saved );
+  cout << "render: tree of " << big->subtreeEntries << " inodes to /dev/null, 1 thread\n" << right << fixed << setprecision(3)
+       << "  show() and cout     " << setw(8) << t1 - t0 << " s\n"
+       << "  in place, color     " << setw(8) << t2 - t1 << " s\n"
+       << "  in place, -n        " << setw(8) << t3 - t2 << " s\n"
+       << "  -L 1                " << setw(8) << t4 - t3 << " s\n";
+  root->file->rm( "big" );
+}
+
+// Checks that the tree under d hangs together: each entry's parent and
+// name, its row's parent, each directory's link count and totals.
+// Returns the number of faults and adds the inodes seen to seen.
+long faults( Inode<Directory>* d, long& seen ) {
+  long bad = 0;
+  Offset bytes = 0;
+  long entries = 0;
+  ++seen;
+  for ( auto it = d->file->theMap.begin(); it != d->file->theMap.end(); ++it ) {
+    InodeBase* x = it->second;
+    bad += x->parent != d || x->name != it->first || inodeTable.parent[x->idnum] != d->idnum;
+    if ( Inode<Directory>* sub = as<Directory>( x ) ) {
+      bad += faults( sub, seen );
+      bytes += sub->getbytes();
+      entries += 1 + sub->entries();
+    }
+    else {
+      ++seen;
+      bad += x->links() != 1;
+      bytes += x->getbytes();
+      ++entries;
+    }
+  }
+  bad += d->links() != long( d->file->theMap.size() ) + 1;
+  bad += bytes != d->getbytes() || entries != d->entries();
+  return bad;
+}
+
+// Commands on several threads at once, through runCommand().  Each
+// thread works in a subtree of its own, /st/t<i>, writing, making and
+// removing files, and moves and copies files into the others' while
+// listing, printing, counting and finding in all of them; now and then
+// it moves or removes a directory, which has the tree to itself.
+// Afterwards the tree must hang together and every live inode be in it.
+void benchStress() {
+  init();
+  const int OPS = 4000, DIRS = 8, FILES = 16;
+  struct Discard : streambuf {
+    int overflow( int c ) { return c; }
+    streamsize xsputn( const char*, streamsize n ) { return n; }
+  } discard;
+  cout << "stress: " << OPS << " commands per thread, about a third of them changes\n"
+       << "  threads  commands/s  alone  faults\n";
+  for ( int threads : { 1, 2, 4, 8 } ) {
+    runCommand( apps["mkdir"], Args{ "mkdir", "/st" } );
+    for ( int t = 0; t < threads; ++t ) {
+      string top = "/st/t" + T2a( t + 1 );
+      runCommand( apps["mkdir"], Args{ "mkdir", top } );
+      for ( int d = 0; d < DIRS; ++d ) {
+        runCommand( apps["mkdir"], Args{ "mkdir", top + "/d" + T2a( d + 1 ) } );
+        for ( int f = 0; f < FILES; ++f )
+          runCommand( apps["write"], Args{ "write", "-q", top + "/d" + T2a( d + 1 ) + "/f" + T2a(f), "text", T2a(f) } );
+      }
+    }
+    atomic<long> alone( 0 );
+    auto work = [&]( int me ) {
+      mt19937 rng( 17 + me );
+      auto pick = [&]( int n ) { return int( rng() % n ); };
+      auto one = [&]( int n ) { return T2a( pick( n ) + 1 ); };   // mkdir takes no 0s.
+      string mine = "/st/t" + T2a( me + 1 );
+      for ( int i = 0; i < OPS; ++i ) {
+        string any = "/st/t" + one( threads );
+        string dir = any + "/d" + one( DIRS );
+        string file = dir + "/f" + T2a( pick( FILES ) );
+        string own = mine + "/d" + one( DIRS );
+        string ownFile = own + "/f" + T2a( pick( FILES ) );
+        Args tok;
+        switch ( pick( 24 ) ) {
+        case 0: case 1: case 2: tok = Args{ "ls", dir }; break;
+        case 3: case 4: tok = Args{ "cat", file }; break;
+        case 5: tok = Args{ "wc", file, ownFile }; break;
+        case 6: tok = Args{ "du", any }; break;
+        case 7: tok = Args{ "tree", "-n", dir }; break;
+        case 8: tok = Args{ "find", any, "-name", "f1*" }; break;
+        case 9: case 10: tok = Args{ "pread", file, "0", "8" }; break;
+        case 11: tok = Args{ "ls", any }; break;
+        case 12: tok = Args{ "tree", "-L", "1", any }; break;
+        case 13: case 14: tok = Args{ "write", "-q", ownFile, "more", "text" }; break;
+        case 15: tok = Args{ "pwrite", ownFile, T2a( pick( 9000 ) ), "x" }; break;
+        case 16: tok = Args{ "truncate", ownFile, T2a( pick( 100 ) ) }; break;
+        case 17: tok = Args{ "touch", own + "/g" + T2a( pick( FILES ) ) }; break;
+        case 18: tok = Args{ "rm", "-f", ownFile }; break;
+        case 19: tok = Args{ "mv", ownFile, dir }; break;
+        case 20: tok = Args{ "cp", ownFile, dir + "/c" + T2a( pick( FILES ) ) }; break;
+        case 21: tok = Args{ "mkdir", own + "/s" + one( 4 ) }; break;
+        case 22: tok = Args{ "mv", file, own }; break;
+        default:
+          if ( pick( 2 ) ) tok = Args{ "rmdir", own + "/s" + one( 4 ) };
+          else tok = Args{ "mv", own + "/s" + one( 4 ), mine + "/d" + one( DIRS ) };
+          ++alone;
+        }
+        runCommand( apps[tok[0]], tok );
+      }
+    };
+    streambuf* out = cout.rdbuf( &discard );
+    streambuf* err = cerr.rdbuf( &discard );
+    double t0 = now();
+    vector<thread> pool;
+    for ( int t = 0; t < threads; ++t ) pool.push_back( thread( work, t ) );
+    for ( auto& t : pool ) t.join();
+    double t1 = now();
+    cout.rdbuf( out );
+    cerr.rdbuf( err );
+    epochs.reclaim();
+    long seen = 0;
+    long bad = faults( root, seen ) + recount( root );
+    bad += seen != long( inodeTable.live );
+    cout << right << setw(9) << threads << setw(12) << long( threads * OPS / ( t1 - t0 ) )
+         << setw(7) << alone << setw(8) << bad << ( bad ? "  TREE INCONSISTENT" : "" ) << endl;
+    root->file->rm( "st" );
+  }
+}
+
+// Resolves a path one lookup at a time from the root, as planPath()
+// does: with lookup(), taking no lock, or taking each directory's lock
+// shared around its theMap, as planning did before lookups went
+// lock-free.
+InodeBase* resolve( const vector<string>& segs, bool locked ) {
+  InodeBase* b = root;
+  for ( auto& seg : segs ) {
+    Inode<Directory>* d = as<Directory>( b );
+    if ( ! d ) return 0;
+    if ( ! locked ) b = lookup( d, seg );
+    else {
+      d->file->lock.lockShared();
+      auto it = d->file->theMap.find( seg );
+      b = ( it == d->file->theMap.end() ? 0 : it->second );
+      d->file->lock.unlock();
+    }
+  }
+  return b;
+}
+
+// Path lookups on 1 to 8 threads, with and without locks, while a
+// writer makes and removes files in the directories they go through,
+// its commands retiring what the readers may still be looking at.
+void benchReadScale() {
+  init();
+  const int FAN = 4, DEPTH = 5, LOOKUPS = 200000;
+  vector<vector<string>> paths;
+  vector<string> leaves;
+  runCommand( apps["mkdir"], Args{ "mkdir", "/rs" } );
+  function<void( const string&, vector<string>, int )> build = [&]( const string& at, vector<string> segs, int depth ) {
+    if ( depth == DEPTH ) {
+      leaves.push_back( at );
+      for ( int f = 1; f <= FAN; ++f ) {
+        runCommand( apps["touch"], Args{ "touch", at + "/f" + T2a(f) } );
+        paths.push_back( segs );
+        paths.back().push_back( "f" + T2a(f) );
+      }
+      return;
+    }
+    for ( int i = 1; i <= FAN; ++i ) {
+      string name = "d" + T2a(i);
+      runCommand( apps["mkdir"], Args{ "mkdir", at + "/" + name } );
+      vector<string> next = segs;
+      next.push_back( name );
+      build( at + "/" + name, next, depth + 1 );
+    }
+  };
+  build( "/rs", vector<string>{ "rs" }, 0 );
+  cout << "readscale: " << LOOKUPS << " lookups of " << DEPTH + 2 << "-segment paths per thread, "
+       << thread::hardware_concurrency() << " cpus\n"
+       << "  threads   lock-free/s      locked/s  writer commands\n";
+  for ( int threads : { 1, 2, 4, 8 } ) {
+    double rate[2];
+    long written = 0;
+    for ( int locked = 0; locked < 2; ++locked ) {
+      atomic<bool> done( false );
+      atomic<long> missed( 0 );
+      thread writer( [&]() {
+        mt19937 rng( 7 );
+        while ( ! done ) {
+          string f = leaves[ rng() % leaves.size() ] + "/w" + T2a( rng() % 8 + 1 );
+          runCommand( apps["touch"], Args{ "touch", f } );
+          runCommand( apps["rm"], Args{ "rm", "-f", f } );
+          written += 2;
+        }
+      } );
+      auto work = [&]( int me ) {
+        mt19937 rng( 31 + me );
+        long miss = 0;
+        for ( int i = 0; i < LOOKUPS; ++i ) {
+          EpochGuard g;
+          InodeBase* b = resolve( paths[ rng() % paths.size() ], locked );
+          miss += ! b || b->kind != Kind::file;
+        }
+        missed += miss;
+      };
+      double t0 = now();
+      vector<thread> pool;
+      for ( int t = 0; t < threads; ++t ) pool.push_back( thread( work, t ) );
+      for ( auto& t : pool ) t.join();
+      rate[locked] = threads * LOOKUPS / ( now() - t0 );
+      done = true;
+      writer.join();
+      if ( missed ) cout << "  " << missed << " lookups went wrong\n";
+    }
+    cout << right << setw(9) << threads << setw(14) << long( rate[0] ) << setw(14) << long( rate[1] )
+         << setw(17) << written << endl;
+  }
+  epochs.reclaim();
+  root->file->rm( "rs" );
+}
+
+int main( int argc, char* argv[] ) {
+  map<string, void(*)()> benches = {
+    pair<const string, void(*)()>( "dir", benchDir ),
+    pair<const string, void(*)()>( "walk", benchWalk ),
+    pair<const string, void(*)()>( "churn", benchChurn ),
+    pair<const string, void(*)()>( "query", benchQuery ),
+    pair<const string, void(*)()>( "snap", benchSnap ),
+    pair<const string, void(*)()>( "journal", benchJournal ),
+    pair<const string, void(*)()>( "incr", benchIncr ),
+    pair<const string, void(*)()>( "latency", benchLatency ),
+    pair<const string, void(*)()>( "zip", benchZip ),
+    pair<const string, void(*)()>( "cow", benchCow ),
+    pair<const string, void(*)()>( "clone", benchClone ),
+    pair<const string, void(*)()>( "fd", benchFd ),
+    pair<const string, void(*)()>( "cat", benchCat ),
+    pair<const string, void(*)()>( "wc", benchWc ),
+    pair<const string, void(*)()>( "find", benchFind ),
+    pair<const string, void(*)()>( "grep", benchGrep ),
+    pair<const string, void(*)()>( "traverse", benchTraverse ),
+    pair<const string, void(*)()>( "render", benchRender ),
+    pair<const string, void(*)()>( "stress", benchStress ),
+    pair<const string, void(*)()>( "readscale", benchReadScale ),
+  };
+  for ( auto& it : benches )
+    if ( argc < 2 || it.first == argv[1] ) it.second();
+  epochs.reclaim();
+  if ( scratch[0] ) {
+    journal.close();
+    nftw( scratch, []( const char* p, const struct stat*, int, struct FTW* ) { return remove( p ); },
+          16, FTW_DEPTH | FTW_PHYS );
+  }
+  return 0;
+}
@@ -0,0 +1,274 @@
+// Block storage for regular files.  File contents live in fixed-size
+// blocks handed out by a single BlockAllocator.  Each file keeps an
+// extent map from file block numbers to runs of allocator blocks, so
+// writing in the middle of a file touches only the blocks involved,
+// appends cost O(bytes appended), and unwritten ranges (holes) take
+// no space at all and read back as zeros.
+
+#ifndef FILESYSTEM_BLOCKS_H
+#define FILESYSTEM_BLOCKS_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <mutex>
+
+using namespace std;
+namespace filesystem {
+
+typedef int64_t Offset;           // byte offsets and file sizes.
+typedef uint32_t BlockNo;         // names a block in the allocator.
+
+const Offset BLOCK_SIZE = 4096;
+
+class BlockAllocator {
+  // Blocks are carved from 1 MB chunks that are never moved or
+  // returned, so a block's address is stable for as long as it is
+  // allocated.  Freed blocks go onto a free list and are reused
+  // before any new chunk is grabbed.  The chunk table is reserved up
+  // front and never moves either, so a background save can read
+  // blocks while commands allocate new ones.  Commands running side
+  // by side allocate and release under a mutex.
+  static const BlockNo CHUNK_BLOCKS = 256;
+  vector<char*> chunks;
+  vector<BlockNo> freeList;
+  BlockNo next = 0;              // first block number never handed out.
+  mutex m;
+public:
+  BlockNo inUse = 0;                       // blocks currently allocated.
+
+  BlockAllocator() { chunks.reserve( 1 << 16 ); }          // 64 GB.
+
+  char* data( BlockNo b ) {
+    return chunks[b / CHUNK_BLOCKS] + (b % CHUNK_BLOCKS) * BLOCK_SIZE;
+  }
+  // How many blocks from b on lie next to each other in memory.
+  BlockNo adjacent( BlockNo b ) { return CHUNK_BLOCKS - b % CHUNK_BLOCKS; }
+
+  // Allocates up to want blocks with consecutive numbers, zeroed, and
+  // returns the first.  got is set to the length of the run, which is
+  // at least one.
+  BlockNo allocate( BlockNo want, BlockNo& got ) {
+    assert( want > 0 );
+    BlockNo b;
+    {
+      lock_guard<mutex> hold( m );
+      if ( freeList.size() ) {
+        b = freeList.back();
+        freeList.pop_back();
+        got = 1;
+      } else {
+        if ( next % CHUNK_BLOCKS == 0 ) chunks.push_back( new char[CHUNK_BLOCKS * BLOCK_SIZE] );
+        b = next;
+        got = min( want, CHUNK_BLOCKS - next % CHUNK_BLOCKS );  // stay in this chunk.
+        next += got;
+      }
+      inUse += got;
+    }
+    for ( BlockNo i = 0; i < got; ++i ) memset( data(b+i), 0, BLOCK_SIZE );
+    return b;
+  }
+
+  void release( BlockNo b ) {
+    lock_guard<mutex> hold( m );
+    assert( b < next && inUse > 0 );
+    freeList.push_back(b);
+    --inUse;
+  }
+
+  Offset reservedBytes() { return Offset(chunks.size()) * CHUNK_BLOCKS * BLOCK_SIZE; }
+};
+
+BlockAllocator blocks;           // single instance shared by all files.
+
+
+class BlockFile {
+  // The storage behind one regular file.  extents maps the first file
+  // block of each run to the run; runs never overlap, and adjacent
+  // runs are merged when they are contiguous in the allocator too.
+  struct Extent {
+    Offset fileBlock;            // first file block covered.
+    BlockNo start;               // first allocator block.
+    BlockNo count;               // length of the run.
+  };
+  map<Offset, Extent> extents;
+  Offset length = 0;
+
+  // Returns the allocator block holding file block fb, or 0 with
+  // found == false if fb is in a hole.
+  BlockNo lookup( Offset fb, bool& found ) {
+    found = false;
+    auto it = extents.upper_bound(fb);
+    if ( it == extents.begin() ) return 0;
+    --it;
+    if ( fb >= it->first + it->second.count ) return 0;
+    found = true;
+    return it->second.start + BlockNo(fb - it->first);
+  }
+
+  // Makes sure file blocks [fb, fb+n) are backed, filling holes with
+  // new runs.  Returns the allocator block for fb.
+  BlockNo backBlocks( Offset fb, Offset n ) {
+    bool found;
+    Offset b = fb;
+    while ( b < fb + n ) {
+      BlockNo blk = lookup( b, found );
+      if ( found ) { ++b; continue; }
+      // b begins a hole; find how far it reaches within the range.
+      auto nextIt = extents.upper_bound(b);
+      Offset holeEnd = fb + n;
+      if ( nextIt != extents.end() && nextIt->first < holeEnd ) holeEnd = nextIt->first;
+      BlockNo got;
+      blk = blocks.allocate( BlockNo(holeEnd - b), got );
+      auto prev = extents.lower_bound(b);
+      if ( prev != extents.begin() ) {
+        --prev;
+        Extent& e = prev->second;
+        if ( e.fileBlock + e.count == b && e.start + e.count == blk ) {
+          e.count += got;                 // grows the previous run.
+          b += got;
+          continue;
+        }
+      }
+      Extent e = { b, blk, got };
+      extents[b] = e;
+      b += got;
+    }
+    return lookup( fb, found );
+  }
+
+public:
+  BlockFile() {}
+  BlockFile( const BlockFile& other ) { assign(other); }
+  BlockFile& operator=( const BlockFile& other ) { if ( this != &other ) assign(other); return *this; }
+  ~BlockFile() { truncate(0); }
+
+  Offset size() const { return length; }
+
+  Offset pread( char* buf, Offset n, Offset off ) {
+    if ( off >= length || n <= 0 ) return 0;
+    if ( n > length - off ) n = length - off;
+    Offset done = 0;
+    while ( done < n ) {
+      Offset pos = off + done;
+      Offset inBlock = pos % BLOCK_SIZE;
+      Offset chunk = min( n - done, BLOCK_SIZE - inBlock );
+      bool found;
+      BlockNo blk = lookup( pos / BLOCK_SIZE, found );
+      if ( found ) memcpy( buf + done, blocks.data(blk) + inBlock, chunk );
+      else memset( buf + done, 0, chunk );                      // a hole.
+      done += chunk;
+    }
+    return n;
+  }
+
+  // Calls f( p, len ) on the bytes of [off, off+n) in order, in place:
+  // a run goes on as long as the blocks behind it are adjacent in
+  // memory, and a hole reads from a block of zeros.
+  template< typename F > void spans( Offset off, Offset n, F f ) {
+    static const char zeros[BLOCK_SIZE] = {};
+    if ( off >= length || n <= 0 ) return;
+    if ( n > length - off ) n = length - off;
+    Offset end = off + n;
+    while ( off < end ) {
+      Offset fb = off / BLOCK_SIZE, inBlock = off % BLOCK_SIZE;
+      auto it = extents.upper_bound( fb );
+      if ( it != extents.begin() && fb < prev(it)->first + prev(it)->second.count ) {
+        const Extent& e = prev(it)->second;
+        BlockNo b = e.start + BlockNo( fb - e.fileBlock );
+        Offset run = min( Offset( e.fileBlock + e.count - fb ), Offset( blocks.adjacent( b ) ) );
+        Offset runEnd = min( end, ( fb + run ) * BLOCK_SIZE );
+        f( (const char*)blocks.data( b ) + inBlock, runEnd - off );
+        off = runEnd;
+      }
+      else {
+        Offset len = min( end - off, BLOCK_SIZE - inBlock );
+        f( zeros + inBlock, len );
+        off += len;
+      }
+    }
+  }
+
+  Offset pwrite( const char* buf, Offset n, Offset off ) {
+    if ( n <= 0 ) return 0;
+    Offset firstBlock = off / BLOCK_SIZE;
+    Offset lastBlock = (off + n - 1) / BLOCK_SIZE;
+    backBlocks( firstBlock, lastBlock - firstBlock + 1 );
+    Offset done = 0;
+    while ( done < n ) {
+      Offset pos = off + done;
+      Offset inBlock = pos % BLOCK_SIZE;
+      Offset chunk = min( n - done, BLOCK_SIZE - inBlock );
+      bool found;
+      BlockNo blk = lookup( pos / BLOCK_SIZE, found );
+      assert( found );
+      memcpy( blocks.data(blk) + inBlock, buf + done, chunk );
+      done += chunk;
+    }
+    if ( off + n > length ) length = off + n;
+    return n;
+  }
+
+  Offset append( const string& s ) { return pwrite( s.data(), s.size(), length ); }
+
+  // Shrinks or extends the file to len bytes.  Extending leaves a hole.
+  void truncate( Offset len ) {
+    assert( len >= 0 );
+    if ( len < length ) {
+      Offset keep = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;    // blocks kept.
+      auto it = extents.lower_bound(keep);
+      while ( it != extents.end() ) {
+        for ( BlockNo i = 0; i < it->second.count; ++i ) blocks.release( it->second.start + i );
+        it = extents.erase(it);
+      }
+      if ( extents.size() ) {                 // a run straddling the cut.
+        Extent& e = (--extents.end())->second;
+        while ( e.count && e.fileBlock + e.count > keep ) {
+          --e.count;
+          blocks.release( e.start + e.count );
+        }
+        if ( ! e.count ) extents.erase( e.fileBlock );
+      }
+      // Zero the tail of a partial last block so that a later
+      // extension reads zeros there.
+      bool found;
+      BlockNo blk = lookup( len / BLOCK_SIZE, found );
+      if ( found && len % BLOCK_SIZE )
+        memset( blocks.data(blk) + len % BLOCK_SIZE, 0, BLOCK_SIZE - len % BLOCK_SIZE );
+    }
+    length = len;
+  }
+
+  void assign( const BlockFile& other ) {
+    truncate(0);
+    length = other.length;
+    for ( auto& it : other.extents ) {
+      const Extent& e = it.second;
+      backBlocks( e.fileBlock, e.count );
+      for ( BlockNo i = 0; i < e.count; ++i ) {
+        bool found;
+        BlockNo b = lookup( e.fileBlock + i, found );
+        memcpy( blocks.data(b), blocks.data(e.start + i), BLOCK_SIZE );
+      }
+    }
+  }
+
+  string contents() {
+    string s( length, '\0' );
+    if ( length ) pread( &s[0], length, 0 );
+    return s;
+  }
+
+  Offset allocatedBytes() const {
+    Offset n = 0;
+    for ( auto& it : extents ) n += it.second.count;
+    return n * BLOCK_SIZE;
+  }
+};
+
+}
+
+#endif
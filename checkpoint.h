@@ -0,0 +1,143 @@
+// Background saves for the shell.  Commands and the savers take turns
+// at the tree through treeGate; a save holds it only while it freezes
+// what changed and while it takes in the result (see Save in
+// filesystem.h).  In between it encodes the records, giving the CPU
+// back every megabyte or so, and writes them with the CPU released,
+// so commands go on running while a save is on its way to the disk.
+//
+// Needs thread.h and filesystem.h included first.
+
+#ifndef FILESYSTEM_CHECKPOINT_H
+#define FILESYSTEM_CHECKPOINT_H
+
+namespace filesystem {
+
+class TreeGate : Monitor {
+  bool busy = false;
+  Condition free;
+public:
+  TreeGate() : free(this) {}
+  void enter() {
+    EXCLUSION
+    while ( busy ) free.wait();
+    busy = true;
+  }
+  void leave() {
+    EXCLUSION
+    busy = false;
+    free.signal();
+  }
+} treeGate;
+
+void yieldCPU() { CPU.defer(); }
+
+// Runs the saves asked for by save -b and autosave, one at a time.
+class Saver : public Thread, Monitor {
+  bool asked = false, askedAll = false;
+  Condition work;
+
+  void action() {
+    for (;;) {
+      bool all;
+      {
+        EXCLUSION
+        while ( ! asked ) work.wait();
+        all = askedAll;
+        asked = askedAll = false;
+      }
+      treeGate.enter();
+      Save* sv = freezeSave( all );
+      treeGate.leave();
+      if ( ! sv ) continue;
+      encodeSave( *sv, yieldCPU );
+      CPU.release();
+      writeSave( *sv );
+      CPU.acquire();
+      treeGate.enter();
+      if ( finishSave( sv ) >= 0 ) {
+        ++saves;
+        lastWritten = segments.written;
+      }
+      treeGate.leave();
+    }
+  }
+
+public:
+  long saves = 0;
+  uint64_t lastWritten = 0;
+
+  Saver() : Thread( "saver" ), work(this) { detach(); }
+
+  void ask( bool all = false ) {
+    EXCLUSION
+    asked = true;
+    askedAll = askedAll || all;
+    work.signal();
+  }
+};
+
+Saver* saver = 0;
+
+void saveInBackground( bool all = false ) {
+  if ( ! saver ) saver = new Saver;
+  saver->ask( all );
+}
+
+// Starts a save every so often when the tree has changed.
+int autosaveTicks = 0;                        // 0 is off; a tick is 400 ms.
+
+class Autosaver : public Thread {
+  void action() {
+    for (;;) {
+      dispatcher.wakeme_in( autosaveTicks ? autosaveTicks : 5 );
+      if ( ! autosaveTicks || segments.busy() ) continue;
+      treeGate.enter();
+      bool changed = inodeTable.dirty[ root->idnum ];
+      treeGate.leave();
+      if ( changed ) saveInBackground();
+    }
+  }
+public:
+  Autosaver() : Thread( "autosaver" ) { detach(); }
+};
+
+Autosaver* autosaver = 0;
+
+int backgroundSave( Args tok ) {
+  // save -b [-c]: as save, but writes in the background while
+  // commands go on.
+  if ( tok.size() < 2 || tok[1] != "-b" ) return save( tok );
+  if ( segments.busy() ) {
+    cerr << "save: a background save is still running\n";
+    return -1;
+  }
+  saveInBackground( tok.size() > 2 && tok[2] == "-c" );
+  cout << "Saving in the background.\n";
+  return 0;
+}
+
+int autosave( Args tok ) {
+  // autosave [seconds | 0]: saves in the background every so many
+  // seconds when anything changed; 0 turns it off.  With no argument
+  // reports the interval and the background saves so far.
+  if ( tok.size() == 1 ) {
+    if ( autosaveTicks ) cout << "every " << autosaveTicks * 0.4 << " s";
+    else cout << "off";
+    cout << "  background saves " << ( saver ? saver->saves : 0 )
+         << "  last " << ( saver ? saver->lastWritten : 0 ) << " bytes"
+         << ( segments.busy() ? "  (saving)" : "" ) << endl;
+    return 0;
+  }
+  double s = atof( tok[1].c_str() );
+  if ( s < 0 ) {
+    cerr << "autosave: usage: autosave [seconds | 0]\n";
+    return -1;
+  }
+  autosaveTicks = s ? max( 1, int( s / 0.4 + 0.5 ) ) : 0;
+  if ( autosaveTicks && ! autosaver ) autosaver = new Autosaver;
+  return 0;
+}
+
+}
+
+#endif
@@ -0,0 +1,143 @@
+// Counting for wc: lines, words, bytes and characters of a buffer, 64
+// bytes at a time.  The bytes of a block are turned into three 64-bit
+// masks, newlines, white space and UTF-8 continuation bytes, which are
+// then counted with popcount.  A word starts at a byte that is not
+// white space where the byte before it is, so words are the bits of
+// ~space & ( space << 1 | carry ), carry being whether the block
+// before ended in white space.  The masks come from AVX2, SSE2 or a
+// plain loop, whichever the CPU has, picked once at startup.
+//
+// White space is POSIX's in the C locale: space, \t \n \v \f \r.  A
+// character is any byte but a UTF-8 continuation byte.
+
+#ifndef FILESYSTEM_COUNT_H
+#define FILESYSTEM_COUNT_H
+
+#include <cstdint>
+#include <cstddef>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace filesystem {
+
+struct Counts {
+  uint64_t lines = 0, words = 0, bytes = 0, chars = 0;
+  bool space = true;                 // the last byte seen was white space.
+
+  Counts& operator+=( const Counts& c ) {
+    lines += c.lines;
+    words += c.words;
+    bytes += c.bytes;
+    chars += c.chars;
+    space = c.space;
+    return *this;
+  }
+};
+
+inline bool isBlank( unsigned char b ) { return b == ' ' || ( b >= '\t' && b <= '\r' ); }
+
+// The masks for one 64-byte block.
+struct Masks { uint64_t newline, space, cont; };
+
+inline void countMasks( const Masks& m, Counts& c ) {
+  c.lines += __builtin_popcountll( m.newline );
+  c.chars += 64 - __builtin_popcountll( m.cont );
+  c.words += __builtin_popcountll( ~m.space & ( m.space << 1 | uint64_t( c.space ) ) );
+  c.space = m.space >> 63;
+  c.bytes += 64;
+}
+
+// Any length, a byte at a time; also does the tails of the others.
+inline void countScalar( const unsigned char* p, size_t n, Counts& c ) {
+  for ( const unsigned char* end = p + n; p < end; ++p ) {
+    bool s = isBlank( *p );
+    c.lines += *p == '\n';
+    c.chars += ( *p & 0xc0 ) != 0x80;
+    c.words += c.space && ! s;
+    c.space = s;
+  }
+  c.bytes += n;
+}
+
+inline void countBlocksScalar( const unsigned char* p, size_t blocks, Counts& c ) {
+  countScalar( p, blocks * 64, c );
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+inline void countBlocksSSE2( const unsigned char* p, size_t blocks, Counts& c ) {
+  const __m128i nl = _mm_set1_epi8( '\n' ), sp = _mm_set1_epi8( ' ' );
+  const __m128i tab = _mm_set1_epi8( '\t' ), four = _mm_set1_epi8( 4 ), cont = _mm_set1_epi8( -64 );
+  for ( ; blocks; --blocks, p += 64 ) {
+    Masks m = { 0, 0, 0 };
+    for ( int i = 0; i < 4; ++i ) {
+      __m128i v = _mm_loadu_si128( (const __m128i*)( p + 16 * i ) );
+      __m128i d = _mm_sub_epi8( v, tab );        // \t..\r become 0..4.
+      __m128i s = _mm_or_si128( _mm_cmpeq_epi8( v, sp ), _mm_cmpeq_epi8( _mm_min_epu8( d, four ), d ) );
+      m.newline |= uint64_t( uint16_t( _mm_movemask_epi8( _mm_cmpeq_epi8( v, nl ) ) ) ) << ( 16 * i );
+      m.space |= uint64_t( uint16_t( _mm_movemask_epi8( s ) ) ) << ( 16 * i );
+      m.cont |= uint64_t( uint16_t( _mm_movemask_epi8( _mm_cmplt_epi8( v, cont ) ) ) ) << ( 16 * i );
+    }
+    countMasks( m, c );
+  }
+}
+
+__attribute__((target("avx2,popcnt")))
+inline void countBlocksAVX2( const unsigned char* p, size_t blocks, Counts& c ) {
+  const __m256i nl = _mm256_set1_epi8( '\n' ), sp = _mm256_set1_epi8( ' ' );
+  const __m256i tab = _mm256_set1_epi8( '\t' ), four = _mm256_set1_epi8( 4 ), cont = _mm256_set1_epi8( -64 );
+  for ( ; blocks; --blocks, p += 64 ) {
+    Masks m = { 0, 0, 0 };
+    for ( int i = 0; i < 2; ++i ) {
+      __m256i v = _mm256_loadu_si256( (const __m256i*)( p + 32 * i ) );
+      __m256i d = _mm256_sub_epi8( v, tab );
+      __m256i s = _mm256_or_si256( _mm256_cmpeq_epi8( v, sp ), _mm256_cmpeq_epi8( _mm256_min_epu8( d, four ), d ) );
+      m.newline |= uint64_t( uint32_t( _mm256_movemask_epi8( _mm256_cmpeq_epi8( v, nl ) ) ) ) << ( 32 * i );
+      m.space |= uint64_t( uint32_t( _mm256_movemask_epi8( s ) ) ) << ( 32 * i );
+      m.cont |= uint64_t( uint32_t( _mm256_movemask_epi8( _mm256_cmpgt_epi8( cont, v ) ) ) ) << ( 32 * i );
+    }
+    countMasks( m, c );                      // inlined, with popcnt.
+  }
+}
+
+#endif
+
+typedef void CountKernel( const unsigned char*, size_t, Counts& );
+
+struct CountImpl {
+  const char* name;
+  CountKernel* blocks;
+};
+
+// The kernels this CPU can run, best first.
+inline int countImpls( CountImpl* out ) {
+  int n = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "popcnt" ) ) out[n++] = { "avx2", countBlocksAVX2 };
+  if ( __builtin_cpu_supports( "sse2" ) ) out[n++] = { "sse2", countBlocksSSE2 };
+#endif
+  out[n++] = { "scalar", countBlocksScalar };
+  return n;
+}
+
+inline CountImpl bestCount() {
+  CountImpl v[3];
+  countImpls( v );
+  return v[0];
+}
+
+CountImpl countImpl = bestCount();
+
+// Adds the counts of p[0, n) to c, going on from where c left off.
+inline void countBytes( const char* p, size_t n, Counts& c, CountImpl impl = countImpl ) {
+  const unsigned char* u = (const unsigned char*)p;
+  impl.blocks( u, n / 64, c );
+  countScalar( u + n / 64 * 64, n % 64, c );
+}
+
+}
+
+#endif
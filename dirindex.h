@@ -0,0 +1,270 @@
+// The index behind each Directory.  It offers the part of std::map's
+// interface that the filesystem uses (find, operator[], erase, size,
+// and iteration in name order) but changes representation as the
+// directory grows:
+//
+//   small  up to SMALL_MAX entries in an array inside the object,
+//          kept sorted; no heap allocation beyond the names.
+//   flat   a sorted vector searched by binary search.
+//   hash   an open-addressing table with linear probing.  Iteration
+//          goes through a sorted view of the slots that is built the
+//          first time it is needed after a change.
+//
+// Iterators returned by begin() walk the entries in name order.  In
+// hash mode an iterator returned by find() can be dereferenced and
+// compared but not advanced.
+//
+// Readers that share a directory's lock may call begin() at the same
+// time, so the sorted view is built under a mutex of its own.
+
+#ifndef FILESYSTEM_DIRINDEX_H
+#define FILESYSTEM_DIRINDEX_H
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <cassert>
+#include <mutex>
+
+using namespace std;
+namespace filesystem {
+
+template< typename V >
+class DirIndex {
+public:
+  typedef pair<string, V> Entry;
+
+  static const size_t SMALL_MAX = 8;
+  static const size_t FLAT_MAX = 256;
+
+private:
+  enum Mode { SMALL, FLAT, HASH };
+  Mode mode = SMALL;
+  size_t n = 0;                       // number of entries.
+
+  Entry small[SMALL_MAX];
+  vector<Entry> flat;
+
+  // Hash mode.  hashes[i] is 0 for an empty slot, 1 for a tombstone,
+  // and otherwise the (adjusted) hash of the name in slots[i].
+  vector<Entry> slots;
+  vector<size_t> hashes;
+  size_t tombs = 0;
+  vector<size_t> order;              // sorted view: slot numbers.
+  bool orderValid = false;
+  mutex viewLock;
+
+  static size_t hashOf( const string& s ) {
+    size_t h = std::hash<string>()(s);
+    return h < 2 ? h + 2 : h;
+  }
+
+  static bool nameLess( const Entry& a, const string& s ) { return a.first < s; }
+
+  // Position of s in a sorted array, or of where it would go.
+  static size_t lowerBound( const Entry* a, size_t len, const string& s ) {
+    return lower_bound( a, a + len, s, nameLess ) - a;
+  }
+
+  // Slot holding s, or slots.size() if absent.
+  size_t probe( const string& s ) const {
+    size_t mask = slots.size() - 1;
+    size_t h = hashOf(s);
+    for ( size_t i = h & mask; ; i = (i+1) & mask ) {
+      if ( hashes[i] == 0 ) return slots.size();
+      if ( hashes[i] == h && slots[i].first == s ) return i;
+    }
+  }
+
+  // Places an entry known to be absent; the table must have room.
+  Entry& place( Entry e, size_t h ) {
+    size_t mask = slots.size() - 1;
+    size_t i = h & mask;
+    while ( hashes[i] > 1 ) i = (i+1) & mask;
+    if ( hashes[i] == 1 ) --tombs;
+    hashes[i] = h;
+    slots[i] = std::move(e);
+    orderValid = false;
+    return slots[i];
+  }
+
+  void rehash( size_t capacity ) {
+    vector<Entry> oldSlots;
+    vector<size_t> oldHashes;
+    oldSlots.swap( slots );
+    oldHashes.swap( hashes );
+    slots.resize( capacity );
+    hashes.assign( capacity, 0 );
+    tombs = 0;
+    for ( size_t i = 0; i < oldSlots.size(); ++i )
+      if ( oldHashes[i] > 1 ) place( std::move(oldSlots[i]), oldHashes[i] );
+    orderValid = false;
+  }
+
+  void toFlat() {
+    if ( mode == SMALL ) {
+      flat.reserve( 2 * SMALL_MAX );
+      for ( size_t i = 0; i < n; ++i ) flat.push_back( std::move(small[i]) );
+      for ( size_t i = 0; i < n; ++i ) small[i] = Entry();
+    } else {
+      sortedView();
+      flat.reserve( n );
+      for ( auto i : order ) flat.push_back( std::move(slots[i]) );
+      vector<Entry>().swap( slots );
+      vector<size_t>().swap( hashes );
+      vector<size_t>().swap( order );
+      tombs = 0;
+    }
+    mode = FLAT;
+  }
+
+  void toHash() {
+    size_t capacity = 16;
+    while ( capacity < 2 * n ) capacity *= 2;
+    slots.resize( capacity );
+    hashes.assign( capacity, 0 );
+    for ( auto& e : flat ) {
+      size_t h = hashOf( e.first );
+      place( std::move(e), h );
+    }
+    vector<Entry>().swap( flat );
+    mode = HASH;
+  }
+
+  void toSmall() {
+    for ( size_t i = 0; i < n; ++i ) small[i] = std::move( flat[i] );
+    vector<Entry>().swap( flat );
+    mode = SMALL;
+  }
+
+  void sortedView() {
+    if ( orderValid ) return;
+    order.clear();
+    order.reserve( n );
+    for ( size_t i = 0; i < slots.size(); ++i ) if ( hashes[i] > 1 ) order.push_back(i);
+    sort( order.begin(), order.end(),
+          [this]( size_t a, size_t b ) { return slots[a].first < slots[b].first; } );
+    orderValid = true;
+  }
+
+  // The pos-th entry in name order.
+  Entry* at( size_t pos ) {
+    if ( pos >= n ) return 0;
+    if ( mode == SMALL ) return &small[pos];
+    if ( mode == FLAT ) return &flat[pos];
+    return &slots[order[pos]];
+  }
+
+public:
+  class iterator {
+    friend class DirIndex;
+    DirIndex* d;
+    size_t pos;                    // position in name order, or npos.
+    Entry* p;                                 // 0 marks the end.
+    iterator( DirIndex* d, size_t pos, Entry* p ) : d(d), pos(pos), p(p) {}
+  public:
+    iterator() : d(0), pos(0), p(0) {}
+    Entry& operator*() const { return *p; }
+    Entry* operator->() const { return p; }
+    iterator& operator++() {
+      assert( pos != string::npos );   // find() results don't advance.
+      p = d->at( ++pos );
+      return *this;
+    }
+    bool operator==( const iterator& o ) const { return p == o.p; }
+    bool operator!=( const iterator& o ) const { return p != o.p; }
+  };
+
+  DirIndex() {}
+  DirIndex( const DirIndex& ) = delete;
+  DirIndex& operator=( const DirIndex& ) = delete;
+
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+
+  void clear() {
+    for ( size_t i = 0; i < SMALL_MAX; ++i ) small[i] = Entry();
+    vector<Entry>().swap( flat );
+    vector<Entry>().swap( slots );
+    vector<size_t>().swap( hashes );
+    vector<size_t>().swap( order );
+    tombs = n = 0;
+    mode = SMALL;
+  }
+
+  iterator begin() {
+    if ( mode == HASH ) {
+      lock_guard<mutex> hold( viewLock );
+      sortedView();
+    }
+    return iterator( this, 0, at(0) );
+  }
+  iterator end() { return iterator( this, n, 0 ); }
+
+  iterator find( const string& s ) {
+    if ( mode == HASH ) {
+      size_t i = probe(s);
+      return i == slots.size() ? end() : iterator( this, string::npos, &slots[i] );
+    }
+    Entry* a = ( mode == SMALL ? small : flat.data() );
+    size_t i = lowerBound( a, n, s );
+    return i < n && a[i].first == s ? iterator( this, i, &a[i] ) : end();
+  }
+
+  size_t count( const string& s ) { return find(s) != end(); }
+
+  V& operator[]( const string& s ) {
+    iterator it = find(s);
+    if ( it != end() ) return it->second;
+    if ( mode == SMALL && n == SMALL_MAX ) toFlat();
+    if ( mode == FLAT && n == FLAT_MAX ) toHash();
+    ++n;
+    if ( mode == HASH ) {
+      if ( 10 * (n + tombs) > 7 * slots.size() ) rehash( 10 * n > 5 * slots.size() ? 2 * slots.size() : slots.size() );
+      return place( Entry( s, V() ), hashOf(s) ).second;
+    }
+    if ( mode == SMALL ) {
+      size_t i = lowerBound( small, n-1, s );
+      for ( size_t j = n-1; j > i; --j ) small[j] = std::move( small[j-1] );
+      small[i] = Entry( s, V() );
+      return small[i].second;
+    }
+    size_t i = lowerBound( flat.data(), n-1, s );
+    flat.insert( flat.begin() + i, Entry( s, V() ) );
+    return flat[i].second;
+  }
+
+  size_t erase( const string& s ) {
+    if ( mode == HASH ) {
+      size_t i = probe(s);
+      if ( i == slots.size() ) return 0;
+      hashes[i] = 1;
+      slots[i] = Entry();
+      ++tombs;
+      --n;
+      orderValid = false;
+      if ( n < FLAT_MAX / 4 ) toFlat();
+      return 1;
+    }
+    Entry* a = ( mode == SMALL ? small : flat.data() );
+    size_t i = lowerBound( a, n, s );
+    if ( i == n || a[i].first != s ) return 0;
+    if ( mode == SMALL ) {
+      for ( size_t j = i; j+1 < n; ++j ) small[j] = std::move( small[j+1] );
+      small[n-1] = Entry();
+    } else {
+      flat.erase( flat.begin() + i );
+    }
+    --n;
+    if ( mode == FLAT && n < SMALL_MAX / 2 ) toSmall();
+    return 1;
+  }
+
+  const char* modeName() const { return mode == SMALL ? "small" : mode == FLAT ? "flat" : "hash"; }
+};
+
+}
+
+#endif
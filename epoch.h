@@ -0,0 +1,265 @@
+// Lookups with no lock.  A reader enters an EpochGuard and may then
+// follow pointers that a writer on another thread is taking out of
+// the tree: a writer never frees what it takes out, it retire()s it,
+// and it is freed only once every reader that might still be looking
+// at it has left its guard.
+//
+// Epochs count up.  A reader records the epoch it entered in; the
+// epoch moves on only when every reader inside a guard has seen the
+// current one, so something retired in epoch e can be freed once the
+// epoch is e + 2, as no reader is left that entered before it was
+// taken out.  Readers write only their own record, so they don't slow
+// each other down.
+//
+// RcuMap, at the end, is a hash table built on this: readers search it
+// under a guard with no lock while one writer at a time changes it.
+
+#ifndef FILESYSTEM_EPOCH_H
+#define FILESYSTEM_EPOCH_H
+
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+using namespace std;
+namespace filesystem {
+
+class Epochs {
+  // One for each thread that has entered a guard.  Records are never
+  // freed; one whose thread has gone is taken up by the next new one.
+  struct Reader {
+    uint64_t state = 0;           // epoch << 1 | 1 inside a guard, else 0.
+    bool taken = true;
+    Reader* next = 0;
+  };
+  struct Local {
+    Reader* r = 0;
+    int depth = 0;                // guards are nested.
+    ~Local() {
+      if ( ! r ) return;
+      __atomic_store_n( &r->state, uint64_t(0), __ATOMIC_RELEASE );
+      __atomic_store_n( &r->taken, false, __ATOMIC_RELEASE );
+    }
+  };
+  struct Garbage {
+    uint64_t epoch;
+    void* p;
+    void (*free)( void* );
+  };
+
+  Reader* readers = 0;
+  uint64_t epoch = 0;
+  deque<Garbage> garbage;         // in the order retired, so by epoch.
+  mutex garbageLock;
+  static const size_t PENDING = 4096;   // reclaim() when this much is waiting.
+
+  Local& local() {
+    static thread_local Local l;
+    return l;
+  }
+
+  Reader* join() {
+    for ( Reader* r = __atomic_load_n( &readers, __ATOMIC_ACQUIRE ); r; r = r->next ) {
+      bool no = false;
+      if ( ! __atomic_load_n( &r->taken, __ATOMIC_RELAXED ) &&
+           __atomic_compare_exchange_n( &r->taken, &no, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+        return r;
+    }
+    Reader* r = new Reader;
+    r->next = __atomic_load_n( &readers, __ATOMIC_RELAXED );
+    while ( ! __atomic_compare_exchange_n( &readers, &r->next, r, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) ) {}
+    return r;
+  }
+
+  // Moves the epoch on if every reader inside a guard is in it.
+  bool advance() {
+    uint64_t e = __atomic_load_n( &epoch, __ATOMIC_SEQ_CST );
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    for ( Reader* r = __atomic_load_n( &readers, __ATOMIC_ACQUIRE ); r; r = r->next ) {
+      uint64_t s = __atomic_load_n( &r->state, __ATOMIC_SEQ_CST );
+      if ( ( s & 1 ) && s >> 1 != e ) return false;
+    }
+    __atomic_compare_exchange_n( &epoch, &e, e + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+    return true;
+  }
+
+public:
+  void enter() {
+    Local& l = local();
+    if ( l.depth++ ) return;
+    if ( ! l.r ) l.r = join();
+    __atomic_store_n( &l.r->state, __atomic_load_n( &epoch, __ATOMIC_SEQ_CST ) << 1 | 1, __ATOMIC_SEQ_CST );
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  }
+
+  void exit() {
+    Local& l = local();
+    if ( --l.depth ) return;
+    __atomic_store_n( &l.r->state, uint64_t(0), __ATOMIC_RELEASE );
+  }
+
+  // Frees p with free(p) once no reader can be looking at it.  The
+  // caller has already made it unreachable.  Now and then this frees
+  // what was retired before, there and then, so free must not take a
+  // lock that a caller of retire() may be holding.
+  void retire( void* p, void (*free)( void* ) ) {
+    size_t n;
+    {
+      lock_guard<mutex> hold( garbageLock );
+      garbage.push_back( Garbage{ __atomic_load_n( &epoch, __ATOMIC_SEQ_CST ), p, free } );
+      n = garbage.size();
+    }
+    if ( n >= PENDING && ! ( n % PENDING ) ) reclaim();
+  }
+
+  // Frees what no reader can be looking at any more.  With no reader
+  // inside a guard, that is everything retired so far.
+  void reclaim() {
+    advance() && advance();
+    vector<Garbage> done;
+    {
+      lock_guard<mutex> hold( garbageLock );
+      uint64_t e = __atomic_load_n( &epoch, __ATOMIC_SEQ_CST );
+      while ( garbage.size() && garbage.front().epoch + 2 <= e ) {
+        done.push_back( garbage.front() );
+        garbage.pop_front();
+      }
+    }
+    for ( auto& g : done ) g.free( g.p );
+  }
+
+  size_t pending() {
+    lock_guard<mutex> hold( garbageLock );
+    return garbage.size();
+  }
+};
+
+Epochs epochs;                    // single instance for the whole tree.
+
+class EpochGuard {
+public:
+  EpochGuard() { epochs.enter(); }
+  ~EpochGuard() { epochs.exit(); }
+  EpochGuard( const EpochGuard& ) = delete;
+  EpochGuard& operator=( const EpochGuard& ) = delete;
+};
+
+template< typename T > void retire( T* p ) {
+  epochs.retire( p, []( void* q ) { delete static_cast<T*>(q); } );
+}
+
+// A hash table of K -> V that readers search with find() inside an
+// EpochGuard, taking no lock, while one writer at a time (the caller
+// sees to that) inserts and erases.  A node, once readers can reach
+// it, never changes: replacing a value puts in a new node, and growing
+// the table builds a new one and swaps it in whole.  What is taken out
+// is retired.  Empty until the first insert.
+template< typename K, typename V, typename H = std::hash<K> >
+class RcuMap {
+  struct Node {
+    K key;
+    V value;
+    size_t hash;
+    Node* next;
+  };
+  struct Table {
+    size_t mask;
+    Node** heads;
+    explicit Table( size_t n ) : mask( n - 1 ), heads( new Node*[n]() ) {}
+    ~Table() {
+      for ( size_t i = 0; i <= mask; ++i )
+        for ( Node* x = heads[i]; x; ) {
+          Node* next = x->next;
+          delete x;
+          x = next;
+        }
+      delete[] heads;
+    }
+  };
+  Table* table = 0;
+  size_t count = 0;
+
+  static void publish( Node*& link, Node* x ) { __atomic_store_n( &link, x, __ATOMIC_RELEASE ); }
+
+  // The link that points at k's node, or the null one that ends its
+  // chain.  For the writer.
+  Node** place( const K& k, size_t h ) {
+    Node** p = &table->heads[h & table->mask];
+    while ( *p && ! ( (*p)->hash == h && (*p)->key == k ) ) p = &(*p)->next;
+    return p;
+  }
+
+  void grow() {
+    Table* t = new Table( table ? 2 * ( table->mask + 1 ) : 4 );
+    for ( size_t i = 0; table && i <= table->mask; ++i )
+      for ( Node* x = table->heads[i]; x; x = x->next ) {
+        Node*& head = t->heads[x->hash & t->mask];
+        head = new Node{ x->key, x->value, x->hash, head };
+      }
+    Table* old = table;
+    __atomic_store_n( &table, t, __ATOMIC_RELEASE );
+    if ( old ) retire( old );
+  }
+
+public:
+  RcuMap() {}
+  ~RcuMap() { delete table; }     // no reader can be left by now.
+  RcuMap( const RcuMap& ) = delete;
+  RcuMap& operator=( const RcuMap& ) = delete;
+
+  size_t size() const { return count; }
+
+  // Sets v and returns true if k is in the table.
+  bool find( const K& k, V& v ) const {
+    Table* t = __atomic_load_n( &table, __ATOMIC_ACQUIRE );
+    if ( ! t ) return false;
+    size_t h = H()( k );
+    for ( Node* x = __atomic_load_n( &t->heads[h & t->mask], __ATOMIC_ACQUIRE ); x;
+          x = __atomic_load_n( &x->next, __ATOMIC_ACQUIRE ) )
+      if ( x->hash == h && x->key == k ) {
+        v = x->value;
+        return true;
+      }
+    return false;
+  }
+
+  void insert( const K& k, const V& v ) {
+    size_t h = H()( k );
+    if ( table ) {
+      Node** p = place( k, h );
+      if ( Node* old = *p ) {
+        publish( *p, new Node{ k, v, h, old->next } );
+        retire( old );
+        return;
+      }
+    }
+    if ( ! table || count > table->mask ) grow();
+    Node*& head = table->heads[h & table->mask];
+    publish( head, new Node{ k, v, h, head } );
+    ++count;
+  }
+
+  bool erase( const K& k ) {
+    if ( ! table ) return false;
+    Node** p = place( k, H()( k ) );
+    Node* old = *p;
+    if ( ! old ) return false;
+    publish( *p, old->next );
+    retire( old );
+    --count;
+    return true;
+  }
+
+  void clear() {
+    Table* old = table;
+    __atomic_store_n( &table, (Table*)0, __ATOMIC_RELEASE );
+    count = 0;
+    if ( old ) retire( old );
+  }
+};
+
+}
+
+#endif
@@ -15,20 +15,20 @@ int main( int argc, char* argv[] ) {
     if ( args.size() == 0 ) continue;
     string cmd = args[0];
     if ( cmd == "" ) continue;
-    Inode<App>* junk = static_cast<Inode<App>*>((dynamic_cast<Inode<Directory>*>(root->file->theMap["bin"])->file->theMap)[cmd] ); //Update to put apps in a directory
+    Inode<App>* junk = static_cast<Inode<App>*>( lookup( as<Directory>(lookup(root, "bin")), cmd ) ); //Update to put apps in a directory
     if ( ! junk ) {
-	  (dynamic_cast<Inode<Directory>*>(root->file->theMap["bin"])->file->theMap).erase(cmd);
       cerr << "shell: " << cmd << " command not found\n";
       continue;
     }
     App* thisApp = static_cast<App*>(junk->file);
     if ( thisApp != 0 ) {
-      thisApp(args);          // if possible, apply cmd to its args.
+      runCommand( thisApp, args );  // if possible, apply cmd to its args.
     } else { 
       cerr << "Instruction " << cmd << " not implemented.\n";
     }
   }
-  preserve(root, "");	
+  if ( journal.isOpen() ) journal.sync();
+  else checkpoint();
 
   cout << "exit" << endl;
   return 0;                                                  // exit.
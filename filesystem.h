@@ -19,8 +19,30 @@
 #include <vector>
 #include <cassert>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cerrno>
+#include <fnmatch.h>
 #include <ctime>
 #include <iomanip>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "rwlock.h"
+#include "epoch.h"
+#include "blocks.h"
+#include "slab.h"
+#include "inodetable.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "segments.h"
+#include "lz.h"
+#include "dirindex.h"
+#include "count.h"
+#include "textindex.h"
 
 using namespace std;
 namespace filesystem {
@@ -72,6 +94,15 @@ template< typename T > string T2a( T x ) {
   return ss.str();
 }
 
+// Appends n in decimal, as to_chars() would, without a stream.
+inline void appendDecimal( string& out, long long n ) {
+  char buf[24], *p = buf + sizeof buf;
+  unsigned long long u = n < 0 ? 0ull - n : n;
+  do *--p = char( '0' + u % 10 ); while ( u /= 10 );
+  if ( n < 0 ) *--p = '-';
+  out.append( p, buf + sizeof buf - p );
+}
+
 template< typename T > T a2T( string x ) {
   // A simple utility to turn strings into things of type T
   // Must be tagged with the desired type, e.g., a2T<float>(35)
@@ -89,57 +120,284 @@ typedef int App(Args);  // apps take a vector of strings and return an int.
 // some forward declarations
 class Device;
 class Directory;
+template< typename T > class Inode;
 
+// What an inode describes.  Each Inode<T> specialization passes its
+// KIND to InodeBase, so asking what an inode is costs one compare.
+enum class Kind : unsigned char { file, dir, app };
+
+const char* kindName( Kind k ) {
+  return k == Kind::file ? "file" : k == Kind::dir ? "dir" : "app";
+}
 
 class InodeBase {
 public: 
-  virtual string type() = 0;
+  const Kind kind;
+  string type() { return kindName(kind); }
   virtual string show() = 0;
-  virtual int getbytes() = 0;
+  virtual Offset getbytes() = 0;
   virtual void ls() = 0;
   
-  static int count;
-  time_t a_time = time(0);
-  time_t c_time = time(0);
-  time_t m_time = time(0);
   int openCount = 0;
   int linkCount = 1;
   bool readable, writeable;
-  InodeBase() { idnum = count ++; }  
+  Inode<Directory>* parent = NULL;  // the directory whose entry this is,
+  string name;                      // and that entry's name.
+  InodeBase( Kind k ) : kind(k) { idnum = inodeTable.add( (unsigned char)k, this ); }  
+  virtual ~InodeBase() { inodeTable.remove( idnum ); }
   int idnum;
+
+  // Times, like size and parent, are kept in row idnum of inodeTable.
+  // They are read without a lock, even as a reader on another thread
+  // sets the access time, so they go through relaxed atomics.
+  time_t aTime() { return loadRelaxed( inodeTable.aTime[idnum] ); }
+  time_t cTime() { return loadRelaxed( inodeTable.cTime[idnum] ); }
+  time_t mTime() { return loadRelaxed( inodeTable.mTime[idnum] ); }
+  void setATime( time_t t ) { storeRelaxed( inodeTable.aTime[idnum], InodeTable::Time(t) ); touched(); }
+  void setMTime( time_t t ) { storeRelaxed( inodeTable.mTime[idnum], InodeTable::Time(t) ); touched(); }
+  int links() { return loadRelaxed( linkCount ); }
+  // Marks the record that holds this inode's times and contents, its
+  // parent's, for the next incremental save.
+  void touched();
   
+  // Drops one link; returns the links left.
   int unlink() { 
-    assert( linkCount > 0 );
-    -- linkCount;
+    assert( links() > 0 );
+    int left = addRelaxed( linkCount, -1 );
     cleanup();
+    return left;
   }
+  // Frees the inode, and its file or directory with it, once no
+  // directory entry and no open reference is left.  A lookup on another
+  // thread may still be looking at it, so it is retired (see epoch.h);
+  // what refers to it from elsewhere goes now, in dropped().
   void cleanup() {
-    if ( ! openCount && ! linkCount ) {
-      // throwstuff away
-    }
+    if ( openCount || links() ) return;
+    dropped();
+    retire( this );
   }
+  virtual void dropped() {}
   virtual void updateTime(time_t create, time_t modified, time_t accessed) {
-	  c_time = create;
-	  m_time = modified;
-	  a_time = accessed;
+	  storeRelaxed( inodeTable.cTime[idnum], InodeTable::Time(create) );
+	  storeRelaxed( inodeTable.mTime[idnum], InodeTable::Time(modified) );
+	  storeRelaxed( inodeTable.aTime[idnum], InodeTable::Time(accessed) );
+	  touched();
   }
 };
-int InodeBase::count = 0;
 
 template< typename T >
 class Inode : public InodeBase {
 };
 
+// b as an Inode<T>, or 0 if b is null or of another kind.  This
+// replaces dynamic_cast, which has to search the class hierarchy.
+template< typename T > Inode<T>* as( InodeBase* b ) {
+  return b && b->kind == Inode<T>::KIND ? static_cast<Inode<T>*>(b) : 0;
+}
+
+
+class DentryCache {
+  // Remembers which directory a path prefix leads to from a given
+  // starting directory.  Each cached path records the (directory, name)
+  // hops it went through, so that changing one directory entry drops
+  // exactly the paths that went through it.  ".." hops are recorded as
+  // (directory, "..").  Single names need no cache: each directory
+  // keeps its own table for lookup().
+  //
+  // Commands on several threads look paths up at once, so paths is an
+  // RcuMap and lookupPath() takes no lock; the rest is changed under a
+  // mutex.  Hits and misses are counted per thread.
+public:
+  typedef pair<InodeBase*, string> Key;
+private:
+  struct KeyHash {
+    size_t operator()( const Key& k ) const {
+      return std::hash<string>()(k.second) ^ ( size_t(k.first) * 0x9E3779B97F4A7C15ULL );
+    }
+  };
+  // A thread's counts.  A thread gives its record up when it ends and
+  // a new one counts on in it, as Epochs does with its readers, so the
+  // totals stay and there are only as many as threads at once.
+  struct Counts {
+    long hits = 0, misses = 0;
+    bool taken = true;
+    Counts* next = 0;
+  };
+  struct Mine {
+    Counts* c = 0;
+    ~Mine() { if ( c ) __atomic_store_n( &c->taken, false, __ATOMIC_RELEASE ); }
+  };
+  static const size_t MAX_ENTRIES = 1 << 20;  // flush everything past this.
+  RcuMap<Key, InodeBase*, KeyHash> paths;
+  unordered_map<Key, vector<Key>, KeyHash> hops;         // path -> its hops.
+  unordered_map<Key, vector<Key>, KeyHash> dependents;   // hop -> paths.
+  size_t dependentCount = 0;
+  // The names cached under each directory, as paths or as hops, so
+  // that a directory's entries can be dropped when it is freed.  May
+  // hold stale names; compact() prunes them.
+  unordered_map<InodeBase*, vector<string>> byDir;
+  size_t byDirCount = 0;
+  long invalidated = 0;
+  Counts* counts = 0;           // every thread's, linked through next.
+  mutex m;
+
+  Counts& mine() {
+    static thread_local Mine my;
+    if ( ! my.c ) {
+      lock_guard<mutex> hold( m );
+      for ( Counts* c = counts; c && ! my.c; c = c->next )
+        if ( ! __atomic_load_n( &c->taken, __ATOMIC_ACQUIRE ) ) {
+          __atomic_store_n( &c->taken, true, __ATOMIC_RELAXED );
+          my.c = c;
+        }
+      if ( ! my.c ) {
+        my.c = new Counts;
+        my.c->next = counts;
+        counts = my.c;
+      }
+    }
+    return *my.c;
+  }
+
+  void remember( const Key& k ) {
+    byDir[k.first].push_back( k.second );
+    ++byDirCount;
+  }
+
+  // Rebuilds dependents from the live paths, dropping registrations
+  // left behind by paths that were already invalidated.
+  void compact() {
+    dependents.clear();
+    dependentCount = 0;
+    byDir.clear();
+    byDirCount = 0;
+    for ( auto& p : hops ) {
+      remember( p.first );
+      for ( auto& h : p.second ) {
+        dependents[h].push_back( p.first );
+        ++dependentCount;
+        remember( h );
+      }
+    }
+  }
+
+  void erasePath( const Key& k ) {
+    if ( ! hops.erase(k) ) return;
+    paths.erase(k);
+    ++invalidated;
+  }
+
+  void drop( InodeBase* dir, const string& name ) {
+    auto it = dependents.find( Key(dir, name) );
+    if ( it == dependents.end() ) return;
+    for ( auto& p : it->second ) erasePath(p);
+    dependentCount -= it->second.size();
+    dependents.erase(it);
+  }
+
+  void dropAll() {
+    paths.clear();
+    hops.clear();
+    dependents.clear();
+    dependentCount = 0;
+    byDir.clear();
+    byDirCount = 0;
+  }
+
+public:
+  // Returns true and sets dir if the path from start is cached.
+  bool lookupPath( InodeBase* start, const string& path, InodeBase*& dir ) {
+    EpochGuard g;
+    Counts& c = mine();
+    bool hit = paths.find( Key(start, path), dir );
+    if ( hit ) storeRelaxed( c.hits, c.hits + 1 );
+    else storeRelaxed( c.misses, c.misses + 1 );
+    return hit;
+  }
+
+  void insertPath( InodeBase* start, const string& path, InodeBase* dir, const vector<Key>& through ) {
+    lock_guard<mutex> hold( m );
+    if ( hops.size() >= MAX_ENTRIES ) dropAll();
+    Key k( start, path );
+    paths.insert( k, dir );
+    if ( ! hops.insert( make_pair( k, through ) ).second ) return;  // another thread was first.
+    remember( k );
+    for ( auto& x : through ) {
+      dependents[x].push_back(k);
+      ++dependentCount;
+      remember( x );
+    }
+    if ( dependentCount > 4 * ( hops.size() + 1024 ) ||
+         byDirCount > 4 * ( hops.size() + 1024 ) ) compact();
+  }
+
+  // Called whenever the entry name in dir is added, removed or
+  // replaced.
+  void invalidate( InodeBase* dir, const string& name ) {
+    lock_guard<mutex> hold( m );
+    drop( dir, name );
+  }
+
+  // Called when the directory dir is freed, so that nothing cached
+  // under its address outlives it.
+  void forget( InodeBase* dir ) {
+    lock_guard<mutex> hold( m );
+    auto it = byDir.find( dir );
+    if ( it == byDir.end() ) return;
+    for ( auto& name : it->second ) {
+      drop( dir, name );
+      erasePath( Key(dir, name) );
+    }
+    byDirCount -= it->second.size();
+    byDir.erase( it );
+  }
+
+  void clear() {
+    lock_guard<mutex> hold( m );
+    dropAll();
+  }
+
+  void clearCounts() {
+    lock_guard<mutex> hold( m );
+    for ( Counts* c = counts; c; c = c->next ) {
+      storeRelaxed( c->hits, 0L );
+      storeRelaxed( c->misses, 0L );
+    }
+    invalidated = 0;
+  }
+
+  size_t pathCount() { lock_guard<mutex> hold( m ); return hops.size(); }
+  long invalidations() { lock_guard<mutex> hold( m ); return invalidated; }
+  long hits() {
+    lock_guard<mutex> hold( m );
+    long n = 0;
+    for ( Counts* c = counts; c; c = c->next ) n += loadRelaxed( c->hits );
+    return n;
+  }
+  long misses() {
+    lock_guard<mutex> hold( m );
+    long n = 0;
+    for ( Counts* c = counts; c; c = c->next ) n += loadRelaxed( c->misses );
+    return n;
+  }
+};
+
+DentryCache dcache;             // single instance for the whole tree.
+
 template<>
 class Inode<App> : public InodeBase {
 public:
+  static const Kind KIND = Kind::app;
   App* file;
-  Inode ( App* x ) : file(x) {}
-  string type() { return "app"; }
-  int getbytes() { return 0; }
+  Inode ( App* x ) : InodeBase(KIND), file(x) {}
+  static void* operator new( size_t ) { return slab< Inode<App> >().allocate(); }
+  static void operator delete( void* p ) { slab< Inode<App> >().release(p); }
+  Offset getbytes() { return 0; }
   string show() {   // a simple diagnostic aid
     //return "This is inode #" + T2a(idnum) + ", which describes a/an " + type() + " at " + ctime(&m_time); 
-    return T2a(linkCount) + " iNode: #" + T2a(idnum) + "    " + to_string(this->getbytes()) + " bytes    " + type() + "    " + ctime(&m_time);
+    time_t m = mTime();
+    char when[26];                          // ctime_r: tree may run this on several threads.
+    return T2a(links()) + " iNode: #" + T2a(idnum) + "    " + to_string(this->getbytes()) + " bytes    " + type() + "    " + ctime_r(&m, when);
   } 
   void ls() { cout << show(); }
 };
@@ -147,15 +405,22 @@ public:
 
 class Directory {
 public:
-  Inode<Directory>* parent = NULL;
-  Inode<Directory>* current = parent;
+  Inode<Directory>* current = NULL;           // this directory's inode.
 
   // directories point to inodes, which in turn point to files.
 
   // map<string, Inode*> theMap;  // the data for this directory
-  map<string, InodeBase*> theMap;  // the data for this directory
+  DirIndex<InodeBase*> theMap;  // the data for this directory, in name order
+  // The same entries, for lookup(), which reads them with no lock.
+  RcuMap<string, InodeBase*> names;
+
+  // Held shared by commands that read theMap, alone by one that changes
+  // it; see runCommand().
+  RWLock lock;
 
   Directory() { theMap.clear(); }
+  static void* operator new( size_t ) { return slab<Directory>().allocate(); }
+  static void operator delete( void* p ) { slab<Directory>().release(p); }
 
   void ls() {   
     // for (auto& it : theMap) { 
@@ -169,72 +434,293 @@ public:
 	//else cout <<setw(1) << endl;
   } 
 
-  int rm( string s ) { theMap.erase(s); }
+  // All changes to theMap go through link(), detach() and rm(), which
+  // keep names, the dentry cache, the entries' parent pointers and this
+  // directory's linkCount (one more than its number of entries) up to
+  // date.  detach() takes the entry out and leaves the inode alone, as
+  // mv needs; rm() also drops the inode's link, which frees it unless
+  // it is still open.
+  InodeBase* detach( string s );        // defined after Inode<File>.
+  int rm( string s );
+  void link( string s, InodeBase* x );
 
   template<typename T>                               
   int mk( string s, T* x ) {
     Inode<T>* ind = new Inode<T>(x);
-    theMap[s] = ind;
+    link( s, ind );
+    return 0;
   }
  
 };
 
-class File{
+class File : public BlockFile {
+  // A regular file; its contents are kept in blocks (see blocks.h)
+  // and accessed through pread(), pwrite(), append() and truncate().
 public:
-  Inode<Directory>* parent = NULL;
-  string bytes;
-  string text;
-  File() {};
+  // A file can be shared: cp gives the copy the same File, and a save
+  // in progress holds the files it has yet to write.  A shared file is
+  // never changed; an inode about to change one moves to a copy of its
+  // own first (see Inode<File>::unshare()).  The last to let go of a
+  // file deletes it.  Inodes in different directories, changed under
+  // different locks, may share one, so refs is counted atomically.
+  int refs = 1;
+  File* share() { addRelaxed( refs, 1 ); return this; }
+  void release() { if ( ! __atomic_sub_fetch( &refs, 1, __ATOMIC_ACQ_REL ) ) delete this; }
+  bool shared() const { return __atomic_load_n( &refs, __ATOMIC_ACQUIRE ) > 1; }
 
-  template<typename T>                               
-  int touch( string s, T* x );
+  File() {};
+  static void* operator new( size_t ) { return slab<File>().allocate(); }
+  static void operator delete( void* p ) { slab<File>().release(p); }
 };
 template<>
 class Inode<File> : public InodeBase {
 public:
-  string type() { return "file"; }
-  int getbytes() { return file->text.size(); }
+  static const Kind KIND = Kind::file;
+  Offset getbytes() { return file->size(); }
   File* file;
   
-  Inode<File> ( File* x ) : file(x) {}
+  Inode<File> ( File* x ) : InodeBase(KIND), file(x) {
+    inodeTable.size[idnum] = x->size();
+    textIndex.changed( idnum );
+  }
+  ~Inode<File> () {
+    file->release();
+    textIndex.changed( idnum );
+  }
+  static void* operator new( size_t ) { return slab< Inode<File> >().allocate(); }
+  static void operator delete( void* p ) { slab< Inode<File> >().release(p); }
+
+  // Gives this inode a file of its own if the current one is shared.
+  void unshare() {
+    if ( ! file->shared() ) return;
+    File* copy = new File;
+    copy->assign( *file );
+    file->release();
+    file = copy;
+  }
+
+  // Changes to a linked file's contents go through these so that the
+  // sizes kept by the directories above it stay current.
+  Offset pwrite( const char* buf, Offset n, Offset off ) {
+    unshare();
+    Offset before = file->size();
+    n = file->pwrite( buf, n, off );
+    resized( before );
+    return n;
+  }
+  void append( const string& s ) { pwrite( s.data(), s.size(), file->size() ); }
+  void truncate( Offset len ) {
+    unshare();
+    Offset before = file->size();
+    file->truncate( len );
+    resized( before );
+  }
+  // Makes this inode's contents f's, shared rather than copied.
+  void share( File* f ) {
+    Offset before = file->size();
+    f->share();
+    file->release();
+    file = f;
+    resized( before );
+  }
+  void resized( Offset before );            // defined after Inode<Directory>.
+
   string show() {   // a simple diagnostic aid
     //return " This is inode #" + T2a(idnum) + ", which describes a/an " + type() + " with file size: " + to_string(this->getbytes()) + " at " + ctime(&m_time);
-    return T2a(linkCount) + " iNode: #" + T2a(idnum) + "    " + to_string(this->getbytes()) + " bytes    " + type() + "    " + ctime(&m_time);
+    time_t m = mTime();
+    char when[26];
+    return T2a(links()) + " iNode: #" + T2a(idnum) + "    " + to_string(this->getbytes()) + " bytes    " + type() + "    " + ctime_r(&m, when);
   } 
   void ls() {}
 };
 
+// Where incremental saves go; see segments.h.
+const string SEGMENTS = "info.segments";
+SegmentStore segments( SEGMENTS );
+
 template<>
 class Inode<Directory> : public InodeBase {
 public:
-  string type() { return "dir"; }
-  int getbytes() {
-    int size = 0;
-    for (auto it = file->theMap.begin(); it != file->theMap.end(); ++it ){
-      if(it->second->type() == "dir") {
-        size += dynamic_cast<Inode<Directory>*>(it->second)->getbytes();
-      }
-      else if(it->second->type() == "file") {
-        size += dynamic_cast<Inode<File>*>(it->second)->getbytes();
-      }
+  static const Kind KIND = Kind::dir;
+  // Totals for everything below this directory, kept current by
+  // Directory::link() and rm() and by Inode<File>'s resized().
+  Offset subtreeBytes = 0;
+  long subtreeEntries = 0;
+  Offset getbytes() { return loadRelaxed( subtreeBytes ); }
+  long entries() { return loadRelaxed( subtreeEntries ); }
+
+  // Adds a change in the totals to this directory and its ancestors.
+  // Commands in different directories under a common ancestor change
+  // its totals at once, holding its lock only shared, so the totals
+  // are added to atomically.
+  void propagate( Offset bytes, long entries ) {
+    for ( Inode<Directory>* d = this; d; d = d->parent ) {
+      Offset total = addRelaxed( d->subtreeBytes, bytes );
+      addRelaxed( d->subtreeEntries, entries );
+      storeRelaxed( inodeTable.size[d->idnum], total );
     }
-    return size;
   }
+
+  // This directory's record in segments, or 0 before its first save.
+  uint32_t saveId = 0;
+
+  // Marks this directory's record stale, and the way down to it from
+  // the root.  Stops at the first ancestor already marked, since the
+  // ones above that are marked too.
+  void markDirty() {
+    __atomic_fetch_or( &inodeTable.dirty[idnum], (unsigned char)InodeTable::DIRTY, __ATOMIC_RELAXED );
+    for ( Inode<Directory>* d = parent; d && ! loadRelaxed( inodeTable.dirty[d->idnum] ); d = d->parent )
+      __atomic_fetch_or( &inodeTable.dirty[d->idnum], (unsigned char)InodeTable::DIRTY_BELOW, __ATOMIC_RELAXED );
+  }
+
   Directory* file;
-  Inode<Directory> ( Directory* x ) : file(x) {}
+  Inode<Directory> ( Directory* x ) : InodeBase(KIND), file(x) {}
+  ~Inode<Directory> () {
+    if ( saveId ) segments.drop( saveId );
+    delete file;
+  }
+  // Only commands with the tree to themselves free directories, so
+  // these go while nothing else is using the cache or segments.  (The
+  // destructor may run under the cache's mutex; see Epochs::retire().)
+  void dropped() {
+    dcache.forget( this );
+    if ( saveId ) segments.drop( saveId );
+    saveId = 0;
+  }
+  static void* operator new( size_t ) { return slab< Inode<Directory> >().allocate(); }
+  static void operator delete( void* p ) { slab< Inode<Directory> >().release(p); }
+
+  // This directory's absolute path.  It is cached and recomputed
+  // (from the parent's cached path) only after some directory has
+  // been moved, which bumps renames.  Readers on several threads fill
+  // the cache, under pathLock.
+  static long renames;
+  static mutex pathLock;
+  string cachedPath;
+  long pathGeneration = -1;
+  string path() {
+    lock_guard<mutex> hold( pathLock );
+    return fillPath();
+  }
+  const string& fillPath() {
+    if ( pathGeneration != renames ) {
+      cachedPath = ! parent ? "/" : ( parent->parent ? parent->fillPath() : string() ) + "/" + name;
+      pathGeneration = renames;
+    }
+    return cachedPath;
+  }
   string show() {   // a simple diagnostic aid
     //return " This is inode #" + T2a(idnum) + ", which describes a/an " + type() + " with file size: " + to_string(this->getbytes()) + " at " + ctime(&m_time);
-    return T2a(linkCount) + " iNode: #" + T2a(idnum) + "    " + to_string(this->getbytes()) + " bytes    " + type() + "    " + ctime(&m_time);
+    time_t m = mTime();
+    char when[26];
+    return T2a(links()) + " iNode: #" + T2a(idnum) + "    " + to_string(this->getbytes()) + " bytes    " + type() + "    " + ctime_r(&m, when);
   } 
   void ls() { file->ls(); }
 };
 
-template<typename T>                               
-  int File::touch( string s, T* x ) {
+long Inode<Directory>::renames = 0;
+mutex Inode<Directory>::pathLock;
 
-    Inode<T>* ind = new Inode<T>(x);
-    parent->file->theMap[s] = ind;
+void InodeBase::touched() { if ( parent ) parent->markDirty(); }
+
+void Inode<File>::resized( Offset before ) {
+  storeRelaxed( inodeTable.size[idnum], file->size() );
+  textIndex.changed( idnum );
+  if ( parent ) parent->propagate( file->size() - before, 0 );
+  touched();
+}
+
+// What an entry adds to the totals of the directories above it.
+Offset subtreeBytes( InodeBase* b ) { return b->getbytes(); }
+long subtreeEntries( InodeBase* b ) {
+  Inode<Directory>* d = as<Directory>(b);
+  return 1 + ( d ? d->entries() : 0 );
+}
+
+// The absolute path of any inode, in O(depth) at worst.
+string pathOf( InodeBase* b ) {
+  if ( Inode<Directory>* d = as<Directory>(b) ) return d->path();
+  if ( ! b->parent ) return b->name;
+  string p = b->parent->path();
+  return ( p == "/" ? "" : p ) + "/" + b->name;
+}
+
+InodeBase* Directory::detach( string s ) {
+  dcache.invalidate( current, s );
+  auto it = theMap.find(s);
+  if ( it == theMap.end() ) return 0;
+  InodeBase* x = it->second;
+  if ( x ) current->propagate( - subtreeBytes(x), - subtreeEntries(x) );
+  if ( x && x->parent == current ) {
+    x->parent = NULL;
+    storeRelaxed( inodeTable.parent[x->idnum], -1 );
+  }
+  theMap.erase(s);
+  names.erase(s);
+  addRelaxed( current->linkCount, -1 );
+  current->markDirty();
+  return x;
+}
+
+int Directory::rm( string s ) {
+  InodeBase* x = detach(s);
+  if ( ! x ) return 0;
+  // rmdir only removes empty directories, but link() can replace a
+  // whole subtree, and its entries go with it.  Each directory is
+  // emptied before it is unlinked, with a stack rather than recursion.
+  struct Frame {
+    Inode<Directory>* d;
+    vector<string> names;
+    size_t next;
+  };
+  vector<Frame> stack;
+  while ( x ) {
+    if ( Inode<Directory>* d = as<Directory>(x) ) {
+      stack.push_back( Frame{ d, vector<string>(), 0 } );
+      for ( auto it = d->file->theMap.begin(); it != d->file->theMap.end(); ++it ) stack.back().names.push_back( it->first );
+    }
+    else x->unlink();
+    x = 0;
+    while ( stack.size() && ! x ) {
+      Frame& f = stack.back();
+      if ( f.next < f.names.size() ) x = f.d->file->detach( f.names[f.next++] );
+      else {
+        f.d->unlink();
+        stack.pop_back();
+      }
+    }
+  }
+  return 1;
+}
+
+void Directory::link( string s, InodeBase* x ) {
+  if ( theMap.find(s) != theMap.end() ) rm(s);        // replaces it.
+  dcache.invalidate( current, s );
+  theMap[s] = x;
+  names.insert( s, x );
+  addRelaxed( current->linkCount, 1 );
+  current->propagate( subtreeBytes(x), subtreeEntries(x) );
+  if ( Inode<Directory>* d = as<Directory>(x) ) {
+    if ( d->pathGeneration != -1 ) ++Inode<Directory>::renames;  // moved.
+    dcache.invalidate( d, ".." );
+    d->file->current = d;
   }
+  x->parent = current;
+  x->name = s;
+  storeRelaxed( inodeTable.parent[x->idnum], current->idnum );
+  current->markDirty();
+}
+
+// Looks name up in dir; 0 if absent.  Takes no lock, even as another
+// thread changes dir.  What it returns is not freed while the caller
+// is inside an EpochGuard (as commands are; see runCommand()), holds
+// dir's lock, or has the tree to itself.
+InodeBase* lookup( Inode<Directory>* dir, const string& name ) {
+  EpochGuard g;
+  InodeBase* b = 0;
+  dir->file->names.find( name, b );
+  return b;
+}
 
 
 
@@ -269,7 +755,7 @@ Directory* wd() { return wdi->file; }        // Working Directory
 //       return 0;
 //     }
 //     if ( (dir->theMap)[seg] != 0 ) {
-//       ind = dynamic_cast<Inode<Directory>*>( (dir->theMap)[seg] );
+//       ind = as<Directory>((dir->theMap)[seg] );
 //       if ( !ind ) {
 //         cerr << prefix.str() << ": No such file or directory\n";
 //         return 0;
@@ -323,6 +809,18 @@ public:
     stringstream prefix;
     if ( segCount > 1 ) {  
       if ( v[0] == "" ) ind = root;
+      // The directory that the prefix leads to is cached by (starting
+      // directory, prefix with empty and "." segments dropped).
+      Inode<Directory>* start = ind;
+      string key;
+      for ( auto it : v ) if ( it != "" && it != "." ) key += ( key.size() ? "/" : "" ) + it;
+      InodeBase* cached;
+      if ( dcache.lookupPath( start, key, cached ) ) {
+        ind = static_cast<Inode<Directory>*>(cached);
+      }
+      else {
+      bool clean = true;          // only clean walks are worth caching.
+      vector<DentryCache::Key> hops;
       for ( auto it : v ) suffix.push( it ); // put everything onto a queue.
       for (;;) {                          // now iterate through that queue.
         // must check each intermediated directory for existence.  FIX
@@ -332,27 +830,29 @@ public:
 		suffix.pop();
 		if ( prefix.str().size() != 0 ) prefix << "/";
 		prefix << seg; 
-		Directory* dir = dynamic_cast<Directory*>(ind->file);  
-		if ( ! dir ) {
-		  cerr << ": cannot access " << prefix.str() << ": Not a directory\n";
-		  break;
-		}
 		if (seg == ".") continue;
-		else if (seg == "..") {
-          if(ind->file->parent != NULL) ind = ind->file->parent;
+		InodeBase* next = ( seg == ".." ? 0 : lookup( ind, seg ) );
+		hops.push_back( DentryCache::Key( ind, seg ) );
+		if (seg == "..") {
+          if(ind->parent != NULL) ind = ind->parent;
 		}
-		else if ( dir->theMap.find(seg) != dir->theMap.end() ) {    // Added check so only valids can be added to map
-		  ind = dynamic_cast<Inode<Directory>*>( (dir->theMap)[seg] );
+		else if ( next ) {    // Added check so only valids can be added to map
+		  ind = as<Directory>(next);
 		  if ( ! ind ) {
 			cerr << prefix.str() << ":1 No such file or directory\n";
+			clean = false;
 			break;
 		  }
 		}
-		else if ( cmd == "mkdir" || cmd == "touch" || cmd == "mv" || cmd == "cp") {
+		else if ( cmd == "mkdir" || cmd == "touch" || cmd == "mv" || cmd == "cp" || cmd == "open" ) {
 		  cerr << cmd << ": cannot create directory `" << prefix.str() << "/" 
 		       << lastSeg << "':2 No such file or directory\n";
 		  error = true;
+		  clean = false;
 		}  
+		else clean = false;
+      }
+      if ( clean ) dcache.insertPath( start, key, ind, hops );
       }
     }
     if ( ! ind ) {
@@ -360,27 +860,23 @@ public:
       error = true;
       return;
     }
-    b = ( lastSeg == "" ? ind : (ind->file->theMap.find(lastSeg) != ind->file->theMap.end() ? ind->file->theMap[lastSeg] : 0)); // Added if-statement so only valids can be added to map
-    if ( !b  && cmd != "mkdir" && cmd !="touch" && cmd !="mv" && cmd != "cp") {
+    b = ( lastSeg == "" ? ind : lookup( ind, lastSeg ) );
+    if ( !b  && cmd != "mkdir" && cmd !="touch" && cmd !="mv" && cmd != "cp" && cmd != "open" ) {
       if(lastSeg == "." && ind == root) { // Added checks for . & .. directories
         lastSeg = "/";
         b = root;
       }
       else if(lastSeg == ".." && ind != root) { // Added checks for . & .. directories
-        b = wdi->file->parent;
-		if(b == root) lastSeg = "/";
-		else {
-          for (auto it = dynamic_cast<Inode<Directory>*>(b)->file->parent->file->theMap.begin(); it != dynamic_cast<Inode<Directory>*>(b)->file->parent->file->theMap.end(); ++it )
-            if (it->second == b) lastSeg = it->first;
-		}
+        b = ind->parent;
+        lastSeg = ( b == root ? "/" : b->name );
       }
       else if(lastSeg == ".." && ind == root) {
         b = root;
 		lastSeg = "/";
 	  }
       else if(lastSeg == ".") { // Added checks for . & .. directories
-        b = wdi->file->current;
-        lastSeg = current;
+        b = ind;
+        lastSeg = ind->name;
       }
       else {
         if(cmd != "write")
@@ -398,71 +894,396 @@ int echo (Args tok) {
 	echo_1(tok);
   return 0;
 }
-void TreeDFS ( Inode<Directory>* ind, string s) {
-  int count = 0;
-  string old_s = s;
-  for(auto it = ind->file->theMap.begin(); it != ind->file->theMap.end(); ++it) {
-    ++count;
-    if(it->second->type() == "dir") {
-        if(!dynamic_cast<Inode<Directory>*>(it->second)->file->theMap.empty()) {
-          if(ind->file->theMap.size() != count) {
-            cout << old_s << "├── " << left << setw(10) << it->first << setw(0) << " " << it->second->show();
-            s = old_s + "│   ";
-          }
-          else {
-            cout <<  old_s << "└── " << left << setw(10) << it->first << setw(0) << " " << it->second->show();
-            s = old_s + "    ";
-          }
+// Output for cat, read, write and tree.  File contents go out from
+// their blocks in place, gathered into one writev() per up to 256
+// runs, instead of being copied into a string and then through cout.
+// Short pieces are copied into a 64 KB buffer that goes out with them;
+// write() sends a long one at once.  When cout has been pointed
+// elsewhere (as while the journal is replayed) everything goes through
+// cout after all.
+streambuf* const consoleOut = cout.rdbuf();
+
+class OutStream {
+  static const int IOVS = 256;
+  static const size_t BUF = 64 * 1024;
+  int fd;
+  iovec v[IOVS];
+  int n = 0;
+  string buf;
+  size_t used = 0;
+public:
+  uint64_t bytes = 0;
+
+  OutStream( int f = STDOUT_FILENO ) : fd(f), buf( BUF, '\0' ) { cout.flush(); }
+  ~OutStream() { flush(); }
+
+  // Sends p[0, len), which must stay put until the next flush().
+  void ref( const char* p, size_t len ) {
+    if ( ! len ) return;
+    if ( n == IOVS ) flush();
+    v[n].iov_base = (void*)p;
+    v[n].iov_len = len;
+    ++n;
+  }
+  void copy( const char* p, size_t len ) {
+    while ( len ) {
+      if ( used == BUF || n == IOVS ) flush();
+      size_t k = min( len, BUF - used );
+      char* to = &buf[used];
+      memcpy( to, p, k );
+      if ( n && (char*)v[n-1].iov_base + v[n-1].iov_len == to ) v[n-1].iov_len += k;
+      else ref( to, k );
+      used += k;
+      p += k;
+      len -= k;
+    }
+  }
+  void copy( const string& s ) { copy( s.data(), s.size() ); }
+  void write( const char* p, size_t len ) {
+    ref( p, len );
+    flush();
+  }
+
+  void flush() {
+    iovec* p = v;
+    int left = n;
+    if ( cout.rdbuf() != consoleOut || fd < 0 ) {
+      for ( ; left; ++p, --left ) cout.write( (const char*)p->iov_base, p->iov_len );
+      left = 0;
+    }
+    while ( left ) {
+      ssize_t w = writev( fd, p, min( left, IOV_MAX ) );
+      if ( w < 0 ) {
+        if ( errno == EINTR ) continue;
+        break;
       }
-      else {
-      if(ind->file->theMap.size() != count) cout <<  old_s << "├── " << left << setw(10) << it->first << setw(0) << " " << it->second->show();
-      else cout <<  old_s << "└── " << left << setw(10) << it->first << " " << it->second->show();
+      bytes += w;
+      for ( ; left && size_t(w) >= p->iov_len; ++p, --left ) w -= p->iov_len;
+      if ( left ) {
+        p->iov_base = (char*)p->iov_base + w;
+        p->iov_len -= w;
       }
-      TreeDFS(dynamic_cast<Inode<Directory>*>(it->second), s);
     }
-    else if(ind->file->theMap.size() != count) {
-      if(it->second->type() == "file") cout <<  old_s << "├── " << "\033[0;32m" << left << setw(10) << it->first << setw(0) << " " << it->second->show() << "\033[0;30m";
-      else if(it->second->type() == "app") cout <<  old_s << "├── " << "\033[0;34m" << left << setw(10) << it->first << setw(0) << " " << it->second->show() << "\033[0;30m";
-      else cout <<  old_s << "├── " << left << setw(10) << it->first << setw(0) << " " << it->second->show();
+    n = 0;
+    used = 0;
+  }
+};
+
+// Tree walks.  walkEntries() visits the entries under a directory in
+// name order with a stack of its own rather than recursion, so a tree
+// of any depth can be walked.  For each entry the visitor's pre() is
+// called; if that says to go into a directory, its entries follow,
+// and then post() for it.  A visitor writes what it has to say to the
+// string it is handed, which walkEntries() passes on now and then to
+// sink, an ostream or an OutStream, if there is one.  A visitor V
+// provides
+//   WalkNext pre( const WalkStep&, string& out );
+//   void post( const WalkStep&, string& out );
+// and, to be walked on several threads by walkTree(),
+//   V fork( const WalkStep& dir );  a visitor for dir's entries, to
+//                                   run elsewhere, from this one's state;
+//   void join( V& part );           takes in what part found.
+// A directory's lock is held shared (unless this thread holds it
+// already) while its entries are walked, and the walk goes from the
+// top down, as the lock order asks.
+struct WalkStep {
+  InodeBase* x;
+  const string* name;
+  int depth;                  // 0 for the entries of the top directory.
+  bool last;                  // the last entry of its directory.
+};
+enum class WalkNext { into, over, stop };
+
+const size_t WALK_FLUSH = 1 << 18;            // bytes of output held back.
+
+// Walks the entries of top, which lie at depth; false if pre() said
+// to stop.
+template< typename V, typename Sink >
+bool walkEntries( Inode<Directory>* top, int depth, V& v, string& out, Sink* sink ) {
+  struct Frame {
+    Inode<Directory>* d;
+    DirIndex<InodeBase*>::iterator it;
+    WalkStep step;                    // d's own entry, for post().
+    bool locked;
+  };
+  vector<Frame> stack;
+  auto enter = [&]( Inode<Directory>* d, const WalkStep& s ) {
+    bool locked = readLock( d->file->lock );
+    stack.push_back( Frame{ d, d->file->theMap.begin(), s, locked } );
+  };
+  enter( top, WalkStep{ top, 0, depth - 1, true } );
+  while ( stack.size() ) {
+    Frame& f = stack.back();
+    if ( f.it == f.d->file->theMap.end() ) {
+      WalkStep s = f.step;
+      if ( f.locked ) readUnlock( f.d->file->lock );
+      stack.pop_back();
+      if ( stack.size() ) v.post( s, out );
+      continue;
+    }
+    auto& e = *f.it;
+    WalkStep s{ e.second, &e.first, depth + int( stack.size() ) - 1, ++f.it == f.d->file->theMap.end() };
+    WalkNext next = v.pre( s, out );
+    if ( sink && out.size() >= WALK_FLUSH ) {
+      sink->write( out.data(), out.size() );
+      out.clear();
     }
-    else {
-      if(it->second->type() == "file") cout <<  old_s << "└── " << "\033[0;32m" << left << setw(10) << it->first << setw(0) << " " << it->second->show() << "\033[0;30m";
-      else if(it->second->type() == "app") cout <<  old_s << "└── " << "\033[0;34m" << left << setw(10) << it->first << setw(0) << " " << it->second->show() << "\033[0;30m";
-      else cout <<  old_s << "└── " << left << setw(10) << it->first << setw(0) << " " << it->second->show();
+    if ( next == WalkNext::stop ) {
+      for ( auto& g : stack ) if ( g.locked ) readUnlock( g.d->file->lock );
+      return false;
     }
+    if ( next == WalkNext::into && s.x->kind == Kind::dir )
+      enter( static_cast<Inode<Directory>*>( s.x ), s );
+  }
+  if ( sink ) {
+    sink->write( out.data(), out.size() );
+    out.clear();
   }
-  return;
+  return true;
 }
 
+// Walks the entries of top as walkEntries() does, writing to sink, on
+// up to threads threads.  Once top holds WALK_SPLIT entries or more,
+// each directory of between WALK_MIN_TASK entries and a grain's worth
+// (about an eighth of a thread's share) is handed to a worker, to be
+// walked by a visitor fork()ed for it into output of its own; bigger
+// ones are walked here so that their subdirectories can be handed out
+// in turn.  Before post() for a directory, or before returning for
+// top, the parts handed out from its entries are join()ed in order,
+// so post() sees everything below.  The output is written in walk
+// order: it comes out the same whatever the number of threads.  Workers only
+// read the tree; a visitor that changes it must use walkEntries().
+const long WALK_SPLIT = 20000;
+const long WALK_MIN_TASK = 256;
+int walkThreads = max( 1, min( 8, int( thread::hardware_concurrency() ) ) );
 
-int pwd( Args tok ) {
-  vector<string> temp;
-  Inode<Directory>* ind = wdi->file->parent;
-  Inode<Directory>* indb = wdi;
-  while( ind ) {
-    for(auto it = ind->file->theMap.begin(); it != ind->file->theMap.end(); ++it ) {
-	  if(it->second == indb) {
-		temp.push_back(it->first);
-		temp.push_back("/");
-	    break;
-	  }
-	}
-	indb = ind;
-	ind = ind->file->parent;
+template< typename V, typename Sink >
+void walkTree( Inode<Directory>* top, V& v, Sink& sink, int threads = walkThreads ) {
+  string out;
+  if ( threads <= 1 || top->entries() < WALK_SPLIT ) {
+    walkEntries( top, 0, v, out, &sink );
+    return;
   }
-  if(temp.empty()) temp.push_back("/");
-  while (!temp.empty()) {
-    cout << temp[temp.size()-1];
-	temp.pop_back();
+  long grain = max( WALK_MIN_TASK, top->entries() / ( long( threads ) * 8 ) );
+  struct Task {
+    WalkStep step;
+    V part;
+    string out;
+    bool done;
+  };
+  deque<Task> tasks;                  // in walk order; never moves them.
+  size_t started = 0;
+  bool finished = false;
+  mutex m;
+  condition_variable cv;
+  auto run = [&]( Task* t ) {
+    walkEntries( static_cast<Inode<Directory>*>( t->step.x ), t->step.depth + 1, t->part, t->out, (Sink*)0 );
+    t->part.post( t->step, t->out );
+    lock_guard<mutex> hold( m );
+    t->done = true;
+    cv.notify_all();
+  };
+  vector<thread> workers;
+  for ( int i = 1; i < threads; ++i )
+    workers.push_back( thread( [&]() {
+      unique_lock<mutex> hold( m );
+      for ( ;; ) {
+        cv.wait( hold, [&]() { return finished || started < tasks.size(); } );
+        if ( started == tasks.size() ) return;
+        Task* t = &tasks[started++];
+        hold.unlock();
+        run( t );
+        hold.lock();
+      }
+    } ) );
+
+  // The output goes out as a list of pieces: this thread's, between
+  // the tasks'.  Those before the first unfinished task can be written.
+  deque<string> mine( 1 );
+  vector< pair<string*, Task*> > pieces;
+  size_t written = 0;
+  auto flush = [&]() {
+    for ( ; written < pieces.size(); ++written ) {
+      Task* t = pieces[written].second;
+      if ( t ) {
+        lock_guard<mutex> hold( m );
+        if ( ! t->done ) return;
+      }
+      string& s = *pieces[written].first;
+      sink.write( s.data(), s.size() );
+      string().swap( s );
+    }
+  };
+  // Waits for t, running tasks not yet started meanwhile.
+  auto await = [&]( Task* t ) {
+    unique_lock<mutex> hold( m );
+    while ( ! t->done ) {
+      if ( started < tasks.size() ) {
+        Task* next = &tasks[started++];
+        hold.unlock();
+        run( next );
+        hold.lock();
+      }
+      else cv.wait( hold );
+    }
+  };
+
+  struct Frame {
+    Inode<Directory>* d;
+    DirIndex<InodeBase*>::iterator it;
+    WalkStep step;
+    vector<size_t> handedOut;         // tasks made from d's entries.
+    bool locked;
+  };
+  vector<Frame> stack;
+  auto enter = [&]( Inode<Directory>* d, const WalkStep& s ) {
+    bool locked = readLock( d->file->lock );
+    stack.push_back( Frame{ d, d->file->theMap.begin(), s, vector<size_t>(), locked } );
+  };
+  enter( top, WalkStep{ top, 0, -1, true } );
+  while ( stack.size() ) {
+    Frame& f = stack.back();
+    if ( f.it == f.d->file->theMap.end() ) {
+      Frame done = f;
+      stack.pop_back();
+      for ( auto i : done.handedOut ) {
+        await( &tasks[i] );
+        v.join( tasks[i].part );
+      }
+      if ( done.locked ) readUnlock( done.d->file->lock );
+      if ( stack.size() ) v.post( done.step, mine.back() );
+      continue;
+    }
+    auto& e = *f.it;
+    WalkStep s{ e.second, &e.first, int( stack.size() ) - 1, ++f.it == f.d->file->theMap.end() };
+    WalkNext next = v.pre( s, mine.back() );
+    if ( written == pieces.size() && mine.back().size() >= WALK_FLUSH ) {
+      sink.write( mine.back().data(), mine.back().size() );
+      mine.back().clear();
+    }
+    if ( next == WalkNext::stop ) break;
+    if ( next != WalkNext::into || s.x->kind != Kind::dir ) continue;
+    Inode<Directory>* d = static_cast<Inode<Directory>*>( s.x );
+    if ( d->entries() < WALK_MIN_TASK || d->entries() > grain ) {
+      enter( d, s );
+      continue;
+    }
+    f.handedOut.push_back( tasks.size() );
+    pieces.push_back( make_pair( &mine.back(), (Task*)0 ) );
+    {
+      lock_guard<mutex> hold( m );
+      tasks.push_back( Task{ s, v.fork( s ), string(), false } );
+      pieces.push_back( make_pair( &tasks.back().out, &tasks.back() ) );
+      cv.notify_one();
+    }
+    mine.push_back( string() );
+    flush();
   }
-  cout << endl;
+  for ( auto& t : tasks ) await( &t );                // after a stop.
+  for ( auto& f : stack ) if ( f.locked ) readUnlock( f.d->file->lock );
+  pieces.push_back( make_pair( &mine.back(), (Task*)0 ) );
+  flush();
+  {
+    lock_guard<mutex> hold( m );
+    finished = true;
+    cv.notify_all();
+  }
+  for ( auto& w : workers ) w.join();
+}
+
+// The lines of tree: each entry under its directory, drawn with the
+// branches of the directories above, and what show() says about it.
+// The line is put together here rather than by show(), which builds
+// it through a stream and ctime(): numbers are written out directly,
+// and times come from a cache of the last few seconds formatted, since
+// entries made together share their second.  The branches for depth d
+// are the first at[d] bytes of prefix.
+struct TreeLines {
+  string prefix;
+  vector<size_t> at;
+  int levels;                          // how far down to go.
+  bool color;
+  struct When {
+    time_t t;
+    char text[32];
+  };
+  vector<When> times;                  // by second, modulo their number.
+
+  TreeLines( const string& s, int levels = INT_MAX, bool color = true )
+    : prefix( s ), at( 1, s.size() ), levels( levels ), color( color ), times( 64, When{ -1, "" } ) {}
+
+  const char* timeText( time_t t ) {
+    When& w = times[ size_t( t ) % times.size() ];
+    if ( w.t != t ) {
+      w.t = t;
+      if ( ! ctime_r( &t, w.text ) ) strcpy( w.text, "?\n" );
+    }
+    return w.text;
+  }
+
+  WalkNext pre( const WalkStep& s, string& out ) {
+    InodeBase* x = s.x;
+    out.append( prefix, 0, at[s.depth] );
+    out += s.last ? "└── " : "├── ";
+    const char* on = ! color ? "" : x->kind == Kind::file ? "\033[0;32m" : x->kind == Kind::app ? "\033[0;34m" : "";
+    out += on;
+    out += *s.name;
+    if ( s.name->size() < 10 ) out.append( 10 - s.name->size(), ' ' );
+    out += ' ';
+    appendDecimal( out, x->links() );
+    out += " iNode: #";
+    appendDecimal( out, x->idnum );
+    out += "    ";
+    appendDecimal( out, x->getbytes() );
+    out += " bytes    ";
+    out += kindName( x->kind );
+    out += "    ";
+    out += timeText( x->mTime() );
+    if ( *on ) out += "\033[0;30m";
+    if ( x->kind != Kind::dir || s.depth + 1 >= levels ) return WalkNext::over;
+    prefix.resize( at[s.depth] );
+    prefix += s.last ? "    " : "│   ";
+    at.resize( s.depth + 2 );
+    at[s.depth + 1] = prefix.size();
+    return WalkNext::into;
+  }
+  void post( const WalkStep&, string& ) {}
+  TreeLines fork( const WalkStep& ) { return *this; }
+  void join( TreeLines& ) {}
+};
+
+void TreeDFS ( Inode<Directory>* ind, string s, int levels = INT_MAX, bool color = true ) {
+  TreeLines lines( s, levels, color );
+  OutStream out;
+  walkTree( ind, lines, out );
+}
+
+
+int pwd( Args tok ) {
+  cout << wdi->path() << endl;
   return 0;
 }
 
 int tree( Args tok ){
+  // tree [-L levels] [-n] [dir]: -L stops that many levels down, and
+  // -n leaves out the colors.
+  int levels = INT_MAX;
+  bool color = true;
+  for ( size_t i = 1; i < tok.size(); ) {
+    if ( tok[i] == "-n" ) color = false;
+    else if ( tok[i] == "-L" ) {
+      if ( i + 1 == tok.size() || ( levels = atoi( tok[i+1].c_str() ) ) <= 0 ) {
+        cerr << "tree: Invalid level, must be greater than 0.\n";
+        return -1;
+      }
+      tok.erase( tok.begin() + i );
+    }
+    else { ++i; continue; }
+    tok.erase( tok.begin() + i );
+  }
   if ( tok.size() < 2 ) {
     cout << "." << endl;
-    TreeDFS(wdi, "");
+    TreeDFS(wdi, "", levels, color);
   }
   else {
     SetUp su( tok );
@@ -472,12 +1293,9 @@ int tree( Args tok ){
       cerr << "touch: missing operand\n";
 	  return -1;
     }
-    else if(su.b->type() == "dir") {
-      Inode<Directory>* ind = wdi;
-      wdi = dynamic_cast<Inode<Directory>*>(su.b);
-      pwd(tok);
-      wdi = ind;
-      TreeDFS(dynamic_cast<Inode<Directory>*>(su.b), "");
+    else if(su.b->kind == Kind::dir) {
+      cout << as<Directory>(su.b)->path() << endl;   // as pwd there would.
+      TreeDFS(as<Directory>(su.b), "", levels, color);
     }
     else {
       return -1;
@@ -486,6 +1304,81 @@ int tree( Args tok ){
   return 0;
 }
 
+// Adds up the bytes and entries under each directory from the files
+// themselves, the way getbytes() once did on every call, to check the
+// totals that link(), rm() and resized() keep.  sum[d] gathers the
+// entries at depth d of the directory being walked there.
+struct Recount {
+  struct Sum { Offset bytes; long entries; };
+  vector<Sum> sum;
+  long wrong = 0;                     // directories whose totals are off.
+  Recount() : sum( 1, Sum{ 0, 0 } ) {}
+
+  WalkNext pre( const WalkStep& s, string& ) {
+    sum.resize( max( sum.size(), size_t( s.depth + 2 ) ) );
+    if ( s.x->kind != Kind::dir ) {
+      sum[s.depth].bytes += s.x->getbytes();
+      ++sum[s.depth].entries;
+      return WalkNext::over;
+    }
+    sum[s.depth + 1] = Sum{ 0, 0 };
+    return WalkNext::into;
+  }
+  void post( const WalkStep& s, string& ) {
+    Inode<Directory>* d = static_cast<Inode<Directory>*>( s.x );
+    Sum& below = sum[s.depth + 1];
+    wrong += below.bytes != d->getbytes() || below.entries != d->entries();
+    sum[s.depth].bytes += below.bytes;
+    sum[s.depth].entries += below.entries + 1;
+  }
+  // A part's post() for its directory adds to sum[depth].
+  int depth = 0;
+  Recount fork( const WalkStep& s ) {
+    Recount part;
+    part.sum.assign( s.depth + 2, Sum{ 0, 0 } );
+    part.depth = s.depth;
+    return part;
+  }
+  void join( Recount& part ) {
+    sum[part.depth].bytes += part.sum[part.depth].bytes;
+    sum[part.depth].entries += part.sum[part.depth].entries;
+    wrong += part.wrong;
+  }
+};
+
+// The number of directories at or under d whose kept totals don't
+// match a recount.
+long recount( Inode<Directory>* d, int threads = walkThreads ) {
+  Recount r;
+  ostream none( 0 );
+  walkTree( d, r, none, threads );
+  return r.wrong + ( r.sum[0].bytes != d->getbytes() || r.sum[0].entries != d->entries() );
+}
+
+int du( Args tok ) {
+  // du [-s] [dir]: bytes and entries under each subdirectory of dir
+  // and under dir itself, read straight from the directories' totals;
+  // -s prints only the line for dir.
+  bool summary = tok.size() > 1 && tok[1] == "-s";
+  if ( summary ) tok.erase( tok.begin()+1 );
+  Inode<Directory>* d = wdi;
+  if ( tok.size() > 1 ) {
+    SetUp su( tok );
+    if ( su.error || ! su.b ) return -1;
+    d = as<Directory>(su.b);
+    if ( ! d ) {
+      cerr << "du: " << su.lastSeg << ": Not a directory\n";
+      return -1;
+    }
+  }
+  if ( ! summary )
+    for ( auto it = d->file->theMap.begin(); it != d->file->theMap.end(); ++it )
+      if ( Inode<Directory>* sub = as<Directory>(it->second) )
+        cout << left << setw(12) << sub->getbytes() << setw(10) << sub->entries() << sub->path() << endl;
+  cout << left << setw(12) << d->getbytes() << setw(10) << d->entries() << d->path() << endl;
+  return 0;
+}
+
 int touch( Args tok ) {
   if ( tok.size() < 2 ) {
     cerr << "touch: missing operand\n";
@@ -500,16 +1393,14 @@ int touch( Args tok ) {
 	  return -1;
     }
     if(!su.b) {
-      Inode<Directory>* dir_ptr = dynamic_cast<Inode<Directory>*>(su.ind);
+      Inode<Directory>* dir_ptr = su.ind;
       Directory* d = dir_ptr->file;
       File* sufile = new File();
-      sufile->parent = dynamic_cast<Inode<Directory>*>(dir_ptr);
-      sufile->touch( su.lastSeg, sufile );
-      ++dir_ptr->linkCount;
+      dir_ptr->file->mk( su.lastSeg, sufile );
     }
     else {
-      su.b->m_time = time(0);
-      su.b->a_time = su.b->m_time;
+      su.b->setMTime( inodeTable.now() );
+      su.b->setATime( su.b->mTime() );
     }
   return 0;
 }
@@ -532,7 +1423,7 @@ int mv( Args tok ) {
 		  cerr << "mv: source file does not exist.\n";
 		  return -1;
 	}
-	else if(su.b->type() == "file" || su.b->type() == "dir") {
+	else if(su.b->kind == Kind::file || su.b->kind == Kind::dir) {
 		tok.erase(tok.begin()+1);
 		SetUp su2( tok );
 		if ( su2.error ) {
@@ -548,73 +1439,70 @@ int mv( Args tok ) {
 			cerr << "mv: Cannot move bin.\n";
 			return -1;
 		}
-		else if(!su2.b) { // if destination doesn't exist
+		if ( Inode<Directory>* src = as<Directory>(su.b) ) {
+			// Moving a directory below itself would cut it off from the tree.
+			Inode<Directory>* into = as<Directory>(su2.b) ? as<Directory>(su2.b) : su2.ind;
+			for ( Inode<Directory>* d = into; d; d = d->parent )
+				if ( d == src ) {
+					cerr << "mv: cannot move a directory into itself.\n";
+					return -1;
+				}
+		}
+		if(!su2.b) { // if destination doesn't exist
       if(su2.ind == root) {
         cerr << "no copying in to root allowed.\n";
         return -1;
       }
       else {
-        Inode<Directory>* dir_ptr_s = dynamic_cast<Inode<Directory>*>(su.ind);
-        Inode<Directory>* dir_ptr_d = dynamic_cast<Inode<Directory>*>(su2.ind);
+        Inode<Directory>* dir_ptr_s = su.ind;
+        Inode<Directory>* dir_ptr_d = su2.ind;
         Directory* d_s = dir_ptr_s->file;
         Directory* d_d = dir_ptr_d->file;
-        d_d->theMap[su2.lastSeg] = su.b;
-        d_s->theMap.erase(su.lastSeg);
-        ++dir_ptr_d->linkCount;
-        --dir_ptr_s->linkCount;
-        if(su.b->type() == "dir")
-          dynamic_cast<Inode<Directory>*>(su.b)->file->parent = dynamic_cast<Inode<Directory>*>(dir_ptr_d);
-        else if (su.b->type() == "file")
-          dynamic_cast<Inode<File>*>(su.b)->file->parent = dynamic_cast<Inode<Directory>*>(dir_ptr_d);
+        d_s->detach(su.lastSeg);
+        d_d->link(su2.lastSeg, su.b);
       }
 		}
-		else if (su.b->type() == "file") { // if destination does exist
-      if(su2.b->type() == "dir") {
-        Inode<Directory>* dir_ptr_s = dynamic_cast<Inode<Directory>*>(su.ind);
-        Inode<Directory>* dir_ptr_d = dynamic_cast<Inode<Directory>*>(su2.b);
+		else if (su.b->kind == Kind::file) { // if destination does exist
+      if(su2.b->kind == Kind::dir) {
+        Inode<Directory>* dir_ptr_s = su.ind;
+        Inode<Directory>* dir_ptr_d = as<Directory>(su2.b);
         Directory* d_s = dir_ptr_s->file;
         Directory* d_d = dir_ptr_d->file;
-        d_d->theMap[su.lastSeg] = su.b;
-        d_s->theMap.erase(su.lastSeg);
-        ++dir_ptr_d->linkCount;
-        --dir_ptr_s->linkCount;
-        dynamic_cast<Inode<File>*>(su.b)->file->parent = dynamic_cast<Inode<Directory>*>(dir_ptr_d);
+        d_s->detach(su.lastSeg);
+        d_d->link(su.lastSeg, su.b);
       }
-      else if(su2.b->type() == "file") {
-        Inode<Directory>* dir_ptr_s = dynamic_cast<Inode<Directory>*>(su.ind);
-        Inode<Directory>* dir_ptr_d = dynamic_cast<Inode<Directory>*>(su2.ind);
+      else if(su2.b->kind == Kind::file) {
+        if(su2.b == su.b) return 0;      // the same file; rm would free it.
+        Inode<Directory>* dir_ptr_s = su.ind;
+        Inode<Directory>* dir_ptr_d = su2.ind;
         Directory* d_s = dir_ptr_s->file;
         Directory* d_d = dir_ptr_d->file;
-        d_d->theMap.erase(su2.lastSeg);
-        d_d->theMap[su2.lastSeg] = su.b;
-        d_s->theMap.erase(su.lastSeg);
-        ++dir_ptr_d->linkCount;
-        --dir_ptr_s->linkCount;
-        dynamic_cast<Inode<File>*>(su.b)->file->parent = dynamic_cast<Inode<Directory>*>(dir_ptr_d);
+        d_d->rm(su2.lastSeg);
+        d_s->detach(su.lastSeg);
+        d_d->link(su2.lastSeg, su.b);
       }
       else {
         cerr << "mv: destination is not a file or directory.\n";
         return -1;
       }
 		}
-		else if (su.b->type() == "dir") {
-			if(su2.b->type() == "file") {
+		else if (su.b->kind == Kind::dir) {
+			if(su2.b->kind == Kind::file) {
 				cerr << "mv: Cannot move directory '" << su.lastSeg << "' into file '" << su2.lastSeg << "'.\n";
 				return -1;
 			}
-			else if(su2.b->type() == "dir") {
-				Inode<Directory>* dir_ptr_d = dynamic_cast<Inode<Directory>*>(su2.ind);
+			else if(su2.b->kind == Kind::dir) {
+				Inode<Directory>* dir_ptr_d = su2.ind;
 				Directory* d_d = dir_ptr_d->file;
 				if(d_d->theMap.empty()) {
 					cerr << "mv: Cannot move directory '" << su.lastSeg << "' a non-empty directory '" << su2.lastSeg << "'.\n";
 					return -1;
 				}
 				else {
-					Inode<Directory>* dir_ptr_s = dynamic_cast<Inode<Directory>*>(su.ind);
+					Inode<Directory>* dir_ptr_s = su.ind;
 					Directory* d_s = dir_ptr_s->file;
-					dynamic_cast<Inode<Directory>*>(su2.b)->file->theMap[su.lastSeg] = su.b;
-					d_s->theMap.erase(su.lastSeg);
-          dynamic_cast<Inode<Directory>*>(su.b)->file->parent = dynamic_cast<Inode<Directory>*>(dir_ptr_d);
+					d_s->detach(su.lastSeg);
+					as<Directory>(su2.b)->file->link(su.lastSeg, su.b);
 				}
 			}
 			else {
@@ -635,7 +1523,189 @@ int mv( Args tok ) {
 	return 0;
 }
 
+// Recursive copies.  cloneTree() copies the subtree under src at the
+// inode level, sharing file contents, and returns its new top, not yet
+// linked anywhere.  It goes in three passes:
+//   1. walks src a directory at a time and makes every inode of the
+//      copy, one after another, so that their slots and inode-table
+//      rows are handed out in bulk;
+//   2. fills in each new directory's entries and its children's rows,
+//      split across up to cloneThreads threads once there are more
+//      than CLONE_SPLIT entries, since each directory's work touches
+//      only that directory and the inodes made for it;
+//   3. adds the totals up from the bottom.
+// Times are copied if keepTimes is set, else left at now.
+int cloneThreads = max( 1, min( 8, int( thread::hardware_concurrency() ) ) );
+const size_t CLONE_SPLIT = 20000;
+
+Inode<Directory>* cloneTree( Inode<Directory>* src, bool keepTimes ) {
+  struct Job {
+    Inode<Directory>* from;
+    Inode<Directory>* to;
+    size_t first, count;                   // its children in made.
+    Offset bytes;
+    long entries;
+  };
+  vector<Job> dirs;
+  vector< pair<InodeBase*, InodeBase*> > made;  // source, copy.
+  made.reserve( src->subtreeEntries );
+  inodeTable.reserve( src->subtreeEntries + 1 );
+  Inode<Directory>* top = new Inode<Directory>( new Directory );
+  top->file->current = top;
+  dirs.push_back( Job{ src, top, 0, 0, 0, 0 } );
+  for ( size_t i = 0; i < dirs.size(); ++i ) {
+    Directory* from = dirs[i].from->file;
+    dirs[i].first = made.size();
+    for ( auto it = from->theMap.begin(); it != from->theMap.end(); ++it ) {
+      InodeBase* x = it->second;
+      InodeBase* c;
+      if ( Inode<Directory>* d = as<Directory>(x) ) {
+        Inode<Directory>* cd = new Inode<Directory>( new Directory );
+        cd->file->current = cd;
+        dirs.push_back( Job{ d, cd, 0, 0, 0, 0 } );
+        c = cd;
+      }
+      else if ( Inode<File>* f = as<File>(x) ) c = new Inode<File>( f->file->share() );
+      else continue;                        // apps stay in /bin.
+      c->name = it->first;
+      made.push_back( make_pair( x, c ) );
+    }
+    dirs[i].count = made.size() - dirs[i].first;
+  }
+
+  auto fill = [&]( size_t lo, size_t hi ) {
+    for ( size_t i = lo; i < hi; ++i ) {
+      Job& j = dirs[i];
+      for ( size_t k = j.first; k < j.first + j.count; ++k ) {
+        InodeBase* x = made[k].first;
+        InodeBase* c = made[k].second;
+        j.to->file->theMap[c->name] = c;
+        j.to->file->names.insert( c->name, c );
+        c->parent = j.to;
+        inodeTable.parent[c->idnum] = j.to->idnum;
+        if ( keepTimes ) {
+          inodeTable.cTime[c->idnum] = inodeTable.cTime[x->idnum];
+          inodeTable.mTime[c->idnum] = inodeTable.mTime[x->idnum];
+          inodeTable.aTime[c->idnum] = inodeTable.aTime[x->idnum];
+        }
+        if ( c->kind == Kind::file ) j.bytes += c->getbytes();
+      }
+      j.to->linkCount += j.count;
+      j.entries = j.count;
+    }
+  };
+  size_t threads = made.size() < CLONE_SPLIT ? 1 : min( size_t( cloneThreads ), dirs.size() );
+  if ( threads <= 1 ) fill( 0, dirs.size() );
+  else {
+    // Ranges of directories with about as many entries each.
+    vector<thread> workers;
+    size_t lo = 0, per = made.size() / threads + 1, sum = 0;
+    for ( size_t i = 0; i < dirs.size(); ++i ) {
+      sum += dirs[i].count;
+      if ( sum >= per && workers.size() + 1 < threads ) {
+        workers.push_back( thread( fill, lo, i + 1 ) );
+        lo = i + 1;
+        sum = 0;
+      }
+    }
+    fill( lo, dirs.size() );
+    for ( auto& w : workers ) w.join();
+  }
+
+  for ( size_t i = dirs.size(); i-- > 0; ) {  // children come after parents.
+    Job& j = dirs[i];
+    j.to->subtreeBytes += j.bytes;
+    j.to->subtreeEntries += j.entries;
+    inodeTable.size[j.to->idnum] = j.to->subtreeBytes;
+    if ( i ) {
+      j.to->parent->subtreeBytes += j.to->subtreeBytes;
+      j.to->parent->subtreeEntries += j.to->subtreeEntries;
+    }
+  }
+  if ( keepTimes ) {
+    inodeTable.cTime[top->idnum] = src->cTime();
+    inodeTable.mTime[top->idnum] = src->mTime();
+    inodeTable.aTime[top->idnum] = src->aTime();
+  }
+  return top;
+}
+
+// Merges the entries under one directory into another: into[d] is the
+// directory that takes the entries at depth d.  Directories that are
+// not there yet are cloned whole.  Stops at the first entry that can't
+// be copied, with failed set.
+struct CopyInto {
+  vector<Inode<Directory>*> into;
+  bool keepTimes, failed = false;
+  CopyInto( Inode<Directory>* dest, bool keepTimes ) : into( 1, dest ), keepTimes( keepTimes ) {}
+
+  WalkNext pre( const WalkStep& s, string& ) {
+    Inode<Directory>* dest = into[s.depth];
+    InodeBase* there = lookup( dest, *s.name );
+    if ( Inode<Directory>* d = as<Directory>( s.x ) ) {
+      if ( there && ! as<Directory>( there ) ) {
+        cerr << "cp: cannot overwrite non-directory '" << *s.name << "' with a directory.\n";
+        failed = true;
+        return WalkNext::stop;
+      }
+      if ( ! there ) {
+        dest->file->link( *s.name, cloneTree( d, keepTimes ) );
+        return WalkNext::over;
+      }
+      into.resize( s.depth + 2 );
+      into[s.depth + 1] = as<Directory>( there );
+      return WalkNext::into;
+    }
+    Inode<File>* f = as<File>( s.x );
+    if ( ! f ) return WalkNext::over;
+    if ( as<Directory>( there ) ) {
+      cerr << "cp: cannot overwrite directory '" << *s.name << "' with a file.\n";
+      failed = true;
+      return WalkNext::stop;
+    }
+    if ( there ) as<File>( there )->share( f->file );
+    else dest->file->mk( *s.name, f->file->share() );
+    if ( keepTimes ) lookup( dest, *s.name )->updateTime( f->cTime(), f->mTime(), f->aTime() );
+    return WalkNext::over;
+  }
+  void post( const WalkStep&, string& ) {}
+};
+
+// Copies the directory src into dest as name.  If dest already has a
+// directory by that name the two are merged, entries from src winning.
+int copyTree( Inode<Directory>* src, Inode<Directory>* dest, const string& name, bool keepTimes ) {
+  for ( Inode<Directory>* d = dest; d; d = d->parent )
+    if ( d == src ) {
+      cerr << "cp: cannot copy a directory into itself.\n";
+      return -1;
+    }
+  InodeBase* old = lookup( dest, name );
+  Inode<Directory>* into = as<Directory>( old );
+  if ( old && ! into ) {
+    cerr << "cp: cannot overwrite non-directory '" << name << "' with a directory.\n";
+    return -1;
+  }
+  if ( ! into ) {
+    dest->file->link( name, cloneTree( src, keepTimes ) );
+    return 0;
+  }
+  // The merge changes the tree, so it walks on this thread alone.
+  CopyInto copy( into, keepTimes );
+  string unused;
+  walkEntries( src, 0, copy, unused, (ostream*)0 );
+  return copy.failed ? -1 : 0;
+}
+
 int cp ( Args tok ) {
+	// cp [-r] [-p] source dest: -p keeps the source's times; -r is
+	// accepted for habit's sake, since directories are always copied
+	// whole (see cloneTree()).
+	bool keepTimes = false;
+	for ( size_t i = 1; i < tok.size(); ) {
+		if ( tok[i] == "-p" ) keepTimes = true;
+		else if ( tok[i] != "-r" && tok[i] != "-R" ) { ++i; continue; }
+		tok.erase( tok.begin() + i );
+	}
 	if ( tok.size() < 2 ) {
 		cerr << "cp: missing file operand.\n";
 		return -1;
@@ -649,7 +1719,7 @@ int cp ( Args tok ) {
 		  cerr << "cp: No such file or directory.\n";
 		  return -1;
 	}
-	else if(su.b->type() == "file") {
+	else if(su.b->kind == Kind::file) {
 		tok.erase(tok.begin()+1);
 		SetUp su2( tok );
 		if ( su2.error ) {
@@ -662,31 +1732,26 @@ int cp ( Args tok ) {
 			return -1;
 		}
 		if(!su2.b) { // if destination doesn't exist
-			Inode<Directory>* dir_ptr = dynamic_cast<Inode<Directory>*>(su2.ind);
-			File* sufile = new File();
-			sufile->text = dynamic_cast<Inode<File>*>(su.b)->file->text;	
-			sufile->parent = dynamic_cast<Inode<Directory>*>(dir_ptr);
-			sufile->touch( su2.lastSeg, sufile );
-      ++dir_ptr->linkCount;
+			Inode<Directory>* dir_ptr = su2.ind;
+			dir_ptr->file->mk( su2.lastSeg, as<File>(su.b)->file->share() );
+			if ( keepTimes ) lookup( dir_ptr, su2.lastSeg )->updateTime( su.b->cTime(), su.b->mTime(), su.b->aTime() );
 		}
-		else if(su2.b->type() == "file") {
-			dynamic_cast<Inode<File>*>(su2.b)->file->text = dynamic_cast<Inode<File>*>(su.b)->file->text;	
-			touch( tok );
+		else if(su2.b->kind == Kind::file) {
+			as<File>(su2.b)->share( as<File>(su.b)->file );
+			if ( keepTimes ) su2.b->updateTime( su.b->cTime(), su.b->mTime(), su.b->aTime() );
+			else touch( tok );
 		}
-    else if(su2.b->type() == "dir") {
-			Inode<Directory>* dir_ptr = dynamic_cast<Inode<Directory>*>(su2.b);
-			File* sufile = new File();
-			sufile->text = dynamic_cast<Inode<File>*>(su.b)->file->text;	
-			sufile->parent = dynamic_cast<Inode<Directory>*>(dir_ptr);
-			sufile->touch( su.lastSeg, sufile );
-      ++dir_ptr->linkCount;
+    else if(su2.b->kind == Kind::dir) {
+			Inode<Directory>* dir_ptr = as<Directory>(su2.b);
+			dir_ptr->file->mk( su.lastSeg, as<File>(su.b)->file->share() );
+			if ( keepTimes ) lookup( dir_ptr, su.lastSeg )->updateTime( su.b->cTime(), su.b->mTime(), su.b->aTime() );
     }
 		else {
 			cerr << su2.lastSeg << ": destination exist and is not a file.";
 			return -1;
 		}
 	}
-	else if(su.b->type() == "dir") {
+	else if(su.b->kind == Kind::dir) {
 		tok.erase(tok.begin()+1);
 		SetUp su2( tok );
 		if ( su2.error ) {
@@ -698,52 +1763,12 @@ int cp ( Args tok ) {
 			cerr << "cp: missing destination file operand.\n";
 			return -1;
 		}
-		if(!su2.b) { // if destination doesn't exist
-      Inode<Directory>* dir_ptr = dynamic_cast<Inode<Directory>*>(su2.ind);
-      Directory* d = dir_ptr->file;
-      Directory* sudir = new Directory();
-      d->mk( su2.lastSeg, sudir );
-      sudir->parent = dynamic_cast<Inode<Directory>*>(dir_ptr);
-      sudir->current = dynamic_cast<Inode<Directory>*>(d->theMap[su2.lastSeg]);
-      ++dir_ptr->linkCount;
-      for(auto it = dynamic_cast<Inode<Directory>*>(su.b)->file->theMap.begin(); it != dynamic_cast<Inode<Directory>*>(su.b)->file->theMap.end();  ++it) {
-        vector<string> newdir;
-        newdir.push_back("cp");
-        newdir.push_back(su.input + "/" + it->first);
-        if(it->second->type() == "file") newdir.push_back(su2.input + "/" + it->first);
-        else if(it->second->type() == "dir") newdir.push_back(su2.input + "/" + it->first);
-        cp ( newdir );
-      }
-		}
-		else if(su2.b->type() == "file") {
-      cerr << "cp: cannot overwrite file w/ a dir.\n";
-      return -1;
-		}
-    else if(su2.b->type() == "dir") {
-      if(dynamic_cast<Inode<Directory>*>(su2.b)->file->theMap.size() == 0) {
-        Inode<Directory>* dir_ptr = dynamic_cast<Inode<Directory>*>(su2.b);
-        Directory* d = dir_ptr->file;
-        Directory* sudir = new Directory();
-        d->mk( su.lastSeg, sudir );
-        sudir->parent = dynamic_cast<Inode<Directory>*>(dir_ptr);
-        sudir->current = dynamic_cast<Inode<Directory>*>(d->theMap[su.lastSeg]);
-        ++dir_ptr->linkCount;
-        for(auto it = dynamic_cast<Inode<Directory>*>(su.b)->file->theMap.begin(); it != dynamic_cast<Inode<Directory>*>(su.b)->file->theMap.end();  ++it) {
-          vector<string> newdir;
-          newdir.push_back("cp");
-          newdir.push_back(su.input + "/" + it->first);
-          if(it->second->type() == "file") newdir.push_back(su2.input + "/" + su.lastSeg);
-          else if(it->second->type() == "dir") newdir.push_back(su2.input + "/" + su.lastSeg + "/" + su2.lastSeg);
-          cp ( newdir );
-        }
-      }
-      else {
-          cerr << "cp: directory not empty.\n";
-          return -1;
-      }
-    }
+		if(!su2.b) // if destination doesn't exist, it is the copy.
+			return copyTree( as<Directory>(su.b), su2.ind, su2.lastSeg, keepTimes );
+		else if(su2.b->kind == Kind::dir) // else the copy goes in it.
+			return copyTree( as<Directory>(su.b), as<Directory>(su2.b), su.lastSeg, keepTimes );
 		else {
-			cerr << su2.lastSeg << ": destination exist and is not a file.";
+			cerr << "cp: cannot overwrite file w/ a dir.\n";
 			return -1;
 		}
 	}
@@ -765,95 +1790,205 @@ int cp ( Args tok ) {
 	//~ 
 //~ }
 
-int wc(Args tok){
-	if ( tok.size() < 2 ) {
-		cerr << "wc: missing file operand.\n";
-		return -1;
-	}
-	SetUp su( tok );
-	if ( su.error ) {
-		cerr << "wc: file does not exist.\n";
-		return -1;
-	}
-	if (su.b->type() == "file") {
-		Inode<File>* f  =  dynamic_cast<Inode<File>*>( su.b );
-		string s = f->file->text;
-
-		int wCount=0; 
-		int nLineCount = 0;
-		int charCount = 0;        
-		for (unsigned int i=0; i < s.length(); i++){   
-			if ((s.at(i) == ' ')&&(s.at(i)+1 !='\0'))
-				wCount++;
-			if(s.at(i) == '\n') 
-				nLineCount++;
-			if ((s.at(i) != ' ' && s.at(i) != '\n' && s.at(i) != '\t'))
-				charCount++;
-		}
-		cout << wCount << " " << nLineCount << " " << charCount << endl;
-	}
-	else {
-		cerr << su.lastSeg << ": is not a file.\n";
-		return -1;
-	}
+// A file of more than WC_SPLIT bytes is counted in pieces of at least
+// that much, each on a thread of its own, up to wcThreads of them.
+const Offset WC_SPLIT = 16 << 20;
+int wcThreads = cloneThreads;
+
+Counts countFile( File* f ) {
+  Offset size = f->size();
+  int k = int( min( Offset( wcThreads ), size / WC_SPLIT ) );
+  vector<Counts> part( max( k, 1 ) );
+  auto piece = [&]( int i ) {
+    Offset off = size * i / part.size(), end = size * ( i + 1 ) / part.size();
+    Counts& c = part[i];
+    if ( off ) {                             // go on from the byte before.
+      char b;
+      f->pread( &b, 1, off - 1 );
+      c.space = isBlank( b );
+    }
+    f->spans( off, end - off, [&]( const char* p, Offset n ) { countBytes( p, n, c ); } );
+  };
+  if ( k <= 1 ) piece( 0 );
+  else {
+    vector<thread> workers;
+    for ( int i = 0; i < k; ++i ) workers.push_back( thread( piece, i ) );
+    for ( auto& w : workers ) w.join();
+  }
+  Counts total;
+  for ( auto& c : part ) total += c;
+  return total;
 }
 
-int write(Args tok)
-{
-  if ( tok.size() < 2 ) {
-    cerr << "write: missing operand\n";
+int wc( Args tok ) {
+  // wc [-l] [-w] [-m] [-c] file...: newlines, words, characters and
+  // bytes of each file, or those asked for, and their total if there
+  // are several.  Words are runs of bytes other than white space.
+  string opts;
+  size_t i = 1;
+  for ( ; i < tok.size() && tok[i].size() > 1 && tok[i][0] == '-'; ++i ) {
+    if ( tok[i].find_first_not_of( "lwmc", 1 ) != string::npos ) {
+      cerr << "wc: usage: wc [-l] [-w] [-m] [-c] file...\n";
+      return -1;
+    }
+    opts += tok[i].substr( 1 );
+  }
+  if ( i == tok.size() ) {
+    cerr << "wc: missing file operand.\n";
     return -1;
   }
-   // tok[1] the file
+  if ( opts == "" ) opts = "lwc";
+  auto show = [&]( const Counts& c, const string& name ) {
+    if ( opts.find( 'l' ) != string::npos ) cout << setw(8) << c.lines;
+    if ( opts.find( 'w' ) != string::npos ) cout << setw(8) << c.words;
+    if ( opts.find( 'm' ) != string::npos ) cout << setw(8) << c.chars;
+    if ( opts.find( 'c' ) != string::npos ) cout << setw(8) << c.bytes;
+    cout << " " << name << endl;
+  };
+  int status = 0;
+  Counts total;
+  bool several = tok.size() - i > 1;
+  for ( ; i < tok.size(); ++i ) {
+    SetUp su( Args{ tok[0], tok[i] } );
+    if ( su.error || ! su.b ) {
+      status = -1;
+      continue;
+    }
+    Inode<File>* f = as<File>( su.b );
+    if ( ! f ) {
+      cerr << "wc: " << tok[i] << ": is not a file.\n";
+      status = -1;
+      continue;
+    }
+    Counts c = countFile( f->file );
+    show( c, tok[i] );
+    total += c;
+  }
+  if ( several ) show( total, "total" );
+  return status;
+}
+
+// Parses a non-negative decimal byte count or offset.
+bool toOffset( string s, Offset& n ) {
+  if ( s == "" || s.find_first_not_of("0123456789") != string::npos ) return false;
+  n = a2T<Offset>(s);
+  return true;
+}
+
+// Where cat -n is: the last line number given, and whether the next
+// byte starts a line.
+struct LineCount {
+  long line = 0;
+  bool start = true;
+};
+
+// Sends bytes [off, off+len) of f to out, numbering lines as cat -n
+// does if lines is given.
+void streamFile( OutStream& out, File* f, Offset off, Offset len, LineCount* lines = 0 ) {
+  f->spans( off, len, [&]( const char* p, Offset n ) {
+    if ( ! lines ) {
+      out.ref( p, n );
+      return;
+    }
+    const char* end = p + n;
+    while ( p < end ) {
+      if ( lines->start ) {
+        char num[24];
+        out.copy( num, snprintf( num, sizeof num, "%6ld\t", ++lines->line ) );
+        lines->start = false;
+      }
+      const char* nl = (const char*)memchr( p, '\n', end - p );
+      const char* stop = nl ? nl + 1 : end;
+      if ( stop - p < 256 ) out.copy( p, stop - p );
+      else out.ref( p, stop - p );
+      lines->start = nl != 0;
+      p = stop;
+    }
+  } );
+}
+
+int write(Args tok)
+{
+  // write [-q] file text...: appends text to file, making it if need
+  // be, and shows the whole file unless -q is given.
+  bool quiet = tok.size() > 1 && tok[1] == "-q";
+  if ( quiet ) tok.erase( tok.begin() + 1 );
+  if ( tok.size() < 2 ) {
+    cerr << "write: missing operand\n";
+    return -1;
+  }
+   // tok[1] the file
   SetUp su(tok);
   string fileText;
   if(su.error) { //create new file
-    Inode<Directory>* dir_ptr = dynamic_cast<Inode<Directory>*>(su.ind);
+    Inode<Directory>* dir_ptr = su.ind;
     Directory* d = dir_ptr->file;
     File* sufile = new File();
-    sufile->parent = dynamic_cast<Inode<Directory>*>(dir_ptr);
-    sufile->touch( su.lastSeg, sufile );
     for(int i= 2; i<=tok.size()-1 ; i++) fileText += tok[i] +  " ";
-    sufile->text = fileText;
-    ++dir_ptr->linkCount;
+    sufile->append( fileText );
+    dir_ptr->file->mk( su.lastSeg, sufile );
 	}
-	else if(su.b->type() == "file") {
-		Inode<File>* theFile = dynamic_cast<Inode<File>*>(su.b);
+	else if(su.b->kind == Kind::file) {
+		Inode<File>* theFile = as<File>(su.b);
 		for(int i= 2; i<=tok.size()-1 ; i++) fileText += tok[i] +  " ";
-		theFile->file->text += fileText;
-		theFile->m_time = time(0);
-		theFile->a_time = theFile->m_time;
-		cout << "FILETEXT: " << theFile->file->text << endl;
+		theFile->append( fileText );
+		theFile->setMTime( inodeTable.now() );
+		theFile->setATime( theFile->mTime() );
+		if ( ! quiet ) {
+			OutStream out;
+			out.copy( "FILETEXT: " );
+			streamFile( out, theFile->file, 0, theFile->file->size() );
+			out.copy( "\n" );
+		}
 	}
 	else {
 		cout << tok[1] << ": is not a regular file.  Cannot write." << endl;
 		return -1;
 	}	
+  return 0;
 }
 
 int cat(Args tok)
 {
-	if ( tok.size() < 2 ) {
+  // cat [-n] [-o offset] [-c length] file...: prints each file, or
+  // length bytes of it from offset; -n numbers the lines.
+  LineCount lines;
+  bool number = false;
+  Offset off = 0, len = -1;
+  size_t i = 1;
+  for ( ; i < tok.size() && tok[i].size() > 1 && tok[i][0] == '-'; ++i ) {
+    if ( tok[i] == "-n" ) number = true;
+    else if ( ( tok[i] == "-o" || tok[i] == "-c" ) && i + 1 < tok.size()
+              && toOffset( tok[i+1], tok[i] == "-o" ? off : len ) ) ++i;
+    else {
+      cerr << "cat: usage: cat [-n] [-o offset] [-c length] file...\n";
+      return -1;
+    }
+  }
+  if ( i == tok.size() ) {
     cerr << "cat: missing operand\n";
     return -1;
+  }
+  int status = 0;
+  OutStream out;
+  for ( ; i < tok.size(); ++i ) {
+    SetUp su( Args{ tok[0], tok[i] } );
+    if ( su.error || ! su.ind || ! su.b ) {
+      status = -1;
+      continue;
     }
-	 // tok[1] the file
-    SetUp su(tok);
-    if(su.error) { //create new file
-		return -1;
-	}
-    else if(!su.ind) {
-        return -1;
+    if ( su.b->kind != Kind::file ) {
+      out.flush();
+      cerr << su.lastSeg << ": not a file to cat.\n";
+      status = -1;
+      continue;
     }
-	else {
-        if(su.b->type() != "file") {
-            cerr << su.lastSeg << ": not a file to cat.\n";
-            return -1;
-        }
-        cout << dynamic_cast<Inode<File>*>(su.b)->file->text << endl;
-	}
-	
-	
+    File* f = as<File>( su.b )->file;
+    streamFile( out, f, off, len < 0 ? f->size() : len, number ? &lines : 0 );
+    if ( ! number || ! lines.start ) out.copy( "\n" );
+    lines.start = true;
+  }
+  return status;
 }
 
 int read(Args tok)
@@ -869,9 +2004,631 @@ int read(Args tok)
     else if(!su.ind) {
         return -1;
     }
-	Inode<File>* f  =  dynamic_cast<Inode<File>*>(su.b);
-	cout << "text is: " << f->file->text << endl;
-	f->a_time = time(0);
+	Inode<File>* f  =  as<File>(su.b);
+	if ( ! f ) {
+		cerr << "read: " << su.lastSeg << ": is not a regular file.\n";
+		return -1;
+	}
+	Offset off = 0, len = f->file->size();
+	if ( ( tok.size() > 2 && ! toOffset( tok[2], off ) ) || ( tok.size() > 3 && ! toOffset( tok[3], len ) ) ) {
+		cerr << "read: usage: read file [offset [length]]\n";
+		return -1;
+	}
+	OutStream out;
+	out.copy( "text is: " );
+	streamFile( out, f->file, off, len );
+	out.copy( "\n" );
+	f->setATime( inodeTable.now() );
+	return 0;
+}
+
+// Resolves tok[1] to a regular file for the offset-addressed apps.
+Inode<File>* fileArg( Args tok ) {
+  SetUp su(tok);
+  if ( su.error || ! su.b ) return 0;
+  if ( su.b->kind != Kind::file ) {
+    cerr << tok[0] << ": " << su.lastSeg << ": is not a regular file.\n";
+    return 0;
+  }
+  return as<File>(su.b);
+}
+
+int pread( Args tok ) {
+  // pread file offset length: prints up to length bytes from offset.
+  Offset off, len;
+  if ( tok.size() < 4 || ! toOffset(tok[2], off) || ! toOffset(tok[3], len) ) {
+    cerr << "pread: usage: pread file offset length\n";
+    return -1;
+  }
+  Inode<File>* f = fileArg( tok );
+  if ( ! f ) return -1;
+  len = max( Offset(0), min( len, f->file->size() - off ) );
+  string buf( len, '\0' );
+  if ( len ) f->file->pread( &buf[0], len, off );
+  cout << buf << endl;
+  f->setATime( inodeTable.now() );
+  return 0;
+}
+
+int pwrite( Args tok ) {
+  // pwrite file offset text...: writes text at offset, leaving a hole
+  // if offset is past the end of the file.
+  Offset off;
+  if ( tok.size() < 4 || ! toOffset(tok[2], off) ) {
+    cerr << "pwrite: usage: pwrite file offset text\n";
+    return -1;
+  }
+  Inode<File>* f = fileArg( tok );
+  if ( ! f ) return -1;
+  string text = join( tok, " ", 3 );
+  f->pwrite( text.data(), text.size(), off );
+  f->setMTime( inodeTable.now() );
+  f->setATime( f->mTime() );
+  return 0;
+}
+
+int truncate( Args tok ) {
+  // truncate file size: shrinks or extends file to size bytes.
+  Offset len;
+  if ( tok.size() < 3 || ! toOffset(tok[2], len) ) {
+    cerr << "truncate: usage: truncate file size\n";
+    return -1;
+  }
+  Inode<File>* f = fileArg( tok );
+  if ( ! f ) return -1;
+  f->truncate( len );
+  f->setMTime( inodeTable.now() );
+  f->setATime( f->mTime() );
+  return 0;
+}
+
+// A time for query: seconds since the epoch, or an age such as 90s,
+// 30m, 12h or 7d, meaning that long before now.
+bool toTime( string s, time_t& t ) {
+  Offset n;
+  long unit = 0;
+  char last = s.size() ? s[s.size()-1] : 0;
+  if ( last == 's' ) unit = 1;
+  else if ( last == 'm' ) unit = 60;
+  else if ( last == 'h' ) unit = 3600;
+  else if ( last == 'd' ) unit = 86400;
+  if ( ! toOffset( unit ? s.substr(0, s.size()-1) : s, n ) ) return false;
+  t = unit ? time(0) - n * unit : n;
+  return true;
+}
+
+int query( Args tok ) {
+  // query [dir] [-type f|d] [-msince T] [-mbefore T] [-asince T]
+  //       [-abefore T] [-csince T] [-cbefore T] [-larger N] [-smaller N]
+  //       [-top K] [-c]
+  // Lists size, mtime and path of the inodes under dir (default /)
+  // that pass every test, scanning inodeTable's columns rather than
+  // the tree.  Sizes of directories are their subtree totals.  -top
+  // keeps the K largest; -c prints only the count.
+  InodeTable& t = inodeTable;
+  InodeTable::Selection sel = t.select();
+  InodeTable::Time lo = INT64_MIN, hi = INT64_MAX;
+  Inode<Directory>* under = root;
+  size_t top = 0;
+  bool countOnly = false;
+  for ( size_t i = 1; i < tok.size(); ++i ) {
+    string flag = tok[i];
+    if ( flag == "-c" ) { countOnly = true; continue; }
+    if ( flag[0] != '-' ) {
+      Args dirTok = { tok[0], flag };
+      SetUp su( dirTok );
+      if ( su.error || ! su.b ) return -1;
+      under = as<Directory>(su.b);
+      if ( ! under ) {
+        cerr << "query: " << flag << ": Not a directory\n";
+        return -1;
+      }
+      continue;
+    }
+    if ( i + 1 == tok.size() ) {
+      cerr << "query: " << flag << " needs a value\n";
+      return -1;
+    }
+    string v = tok[++i];
+    time_t when;
+    Offset n;
+    bool ok = true;
+    if ( flag == "-type" && ( ok = ( v == "f" || v == "d" ) ) )
+      t.whereKind( sel, (unsigned char)( v == "f" ? Kind::file : Kind::dir ) );
+    else if ( flag.size() == 7 && flag.substr(2) == "since" && string("amc").find(flag[1]) != string::npos && ( ok = toTime(v, when) ) )
+      t.whereBetween( sel, flag[1] == 'a' ? t.aTime : flag[1] == 'm' ? t.mTime : t.cTime, InodeTable::Time(when), hi );
+    else if ( flag.size() == 8 && flag.substr(2) == "before" && string("amc").find(flag[1]) != string::npos && ( ok = toTime(v, when) ) )
+      t.whereBetween( sel, flag[1] == 'a' ? t.aTime : flag[1] == 'm' ? t.mTime : t.cTime, lo, InodeTable::Time(when) - 1 );
+    else if ( flag == "-larger" && ( ok = toOffset(v, n) ) )
+      t.whereBetween( sel, t.size, int64_t(n) + 1, int64_t(INT64_MAX) );
+    else if ( flag == "-smaller" && ( ok = toOffset(v, n) ) )
+      t.whereBetween( sel, t.size, int64_t(INT64_MIN), int64_t(n) - 1 );
+    else if ( flag == "-top" && ( ok = toOffset(v, n) ) )
+      top = n;
+    else {
+      cerr << "query: bad " << ( ok ? "option " + flag : "value " + v ) << "\n";
+      return -1;
+    }
+  }
+  sel[ under->idnum ] = 0;
+  vector<int32_t> ids = t.ids( sel );
+  size_t kept = 0;                    // keep only ids below under.
+  for ( auto id : ids ) {
+    int32_t p = t.parent[id];
+    while ( p != -1 && p != under->idnum ) p = t.parent[p];
+    if ( p != -1 ) ids[kept++] = id;
+  }
+  ids.resize( kept );
+  if ( top && top < ids.size() ) {
+    partial_sort( ids.begin(), ids.begin() + top, ids.end(),
+                  [&t]( int32_t a, int32_t b ) { return t.size[a] > t.size[b]; } );
+    ids.resize( top );
+  }
+  if ( countOnly ) {
+    cout << ids.size() << endl;
+    return 0;
+  }
+  for ( auto id : ids )
+    cout << left << setw(12) << t.size[id] << setw(12) << t.mTime[id] << pathOf( t.inode[id] ) << endl;
+  return 0;
+}
+
+// find's expression is parsed into a tree of FindTerms and compiled
+// once into a FindProgram: a list of steps run on each inode with one
+// result register, in which -a and -o become jumps past the right
+// operand when the left one settles the answer.
+struct FindStep {
+  enum Op { NAME, TYPE, SIZE, NEWER, MTIME, TRUE, NOT, JUMP_FALSE, JUMP_TRUE, PRINT, PRUNE } op = TRUE;
+  enum Glob { EXACT, PREFIX, SUFFIX, CONTAINS, ANY, GENERAL } glob = EXACT;
+  string pat;                    // -name's pattern, or the fixed part of it.
+  Kind kind = Kind::file;
+  int cmp = 0;                   // -size, -mtime: -1 less, 0 equal, 1 more.
+  int64_t n = 0;                 // units, days, a time, or a jump target.
+  Offset unit = 1;
+};
+
+struct FindTerm {
+  char op;                       // 'p' a step, '!', 'a' or 'o'.
+  FindStep step;
+  int left = -1, right = -1;
+};
+
+// The fixed forms of a glob are compared directly; the rest go to
+// fnmatch().
+void compileGlob( FindStep& s, const string& pat ) {
+  s.pat = pat;
+  s.glob = FindStep::GENERAL;
+  size_t meta = pat.find_first_of( "*?[\\" );
+  if ( meta == string::npos ) s.glob = FindStep::EXACT;
+  else if ( pat.find_first_of( "?[\\" ) == string::npos ) {
+    size_t stars = count( pat.begin(), pat.end(), '*' );
+    size_t k = pat.size();
+    if ( pat == "*" ) s.glob = FindStep::ANY;
+    else if ( stars == 1 && pat[k-1] == '*' ) s.glob = FindStep::PREFIX, s.pat = pat.substr( 0, k - 1 );
+    else if ( stars == 1 && pat[0] == '*' ) s.glob = FindStep::SUFFIX, s.pat = pat.substr( 1 );
+    else if ( stars == 2 && k > 2 && pat[0] == '*' && pat[k-1] == '*' ) s.glob = FindStep::CONTAINS, s.pat = pat.substr( 1, k - 2 );
+  }
+}
+
+bool globMatch( const FindStep& s, const string& name ) {
+  switch ( s.glob ) {
+  case FindStep::EXACT:    return name == s.pat;
+  case FindStep::PREFIX:   return name.compare( 0, s.pat.size(), s.pat ) == 0;
+  case FindStep::SUFFIX:   return name.size() >= s.pat.size() && name.compare( name.size() - s.pat.size(), s.pat.size(), s.pat ) == 0;
+  case FindStep::CONTAINS: return name.find( s.pat ) != string::npos;
+  case FindStep::ANY:      return true;
+  default:                 return fnmatch( s.pat.c_str(), name.c_str(), 0 ) == 0;
+  }
+}
+
+class FindProgram {
+  vector<FindTerm> terms;
+  Args tok;
+  size_t i = 0;
+  time_t now = 0;
+  bool actions = false;          // -print or -prune appears.
+
+  int add( FindTerm t ) {
+    terms.push_back( t );
+    return terms.size() - 1;
+  }
+  int binary( char op, int l, int r ) {
+    FindTerm t;
+    t.op = op;
+    t.left = l;
+    t.right = r;
+    return add( t );
+  }
+  bool starts( const string& s ) { return s == "!" || s == "-not" || s == "(" || ( s.size() > 1 && s[0] == '-' && s != "-o" && s != "-or" && s != "-a" && s != "-and" ); }
+
+  int parseOr() {
+    int l = parseAnd();
+    while ( l >= 0 && i < tok.size() && ( tok[i] == "-o" || tok[i] == "-or" ) ) {
+      ++i;
+      int r = parseAnd();
+      l = r < 0 ? -1 : binary( 'o', l, r );
+    }
+    return l;
+  }
+  int parseAnd() {
+    int l = parseUnary();
+    while ( l >= 0 && i < tok.size() && ( tok[i] == "-a" || tok[i] == "-and" || starts( tok[i] ) ) ) {
+      if ( tok[i] == "-a" || tok[i] == "-and" ) ++i;
+      int r = parseUnary();
+      l = r < 0 ? -1 : binary( 'a', l, r );
+    }
+    return l;
+  }
+  int parseUnary() {
+    if ( i == tok.size() ) return fail( "expected an expression at the end" );
+    if ( tok[i] == "!" || tok[i] == "-not" ) {
+      ++i;
+      int t = parseUnary();
+      return t < 0 ? -1 : binary( '!', t, -1 );
+    }
+    if ( tok[i] == "(" ) {
+      ++i;
+      int t = parseOr();
+      if ( t < 0 ) return -1;
+      if ( i == tok.size() || tok[i] != ")" ) return fail( "missing )" );
+      ++i;
+      return t;
+    }
+    return primary();
+  }
+
+  int fail( const string& why ) {
+    if ( error.empty() ) error = why;
+    return -1;
+  }
+
+  // [+-]N: sets cmp and returns the N.
+  bool number( string v, FindStep& s ) {
+    s.cmp = v.size() && v[0] == '+' ? 1 : v.size() && v[0] == '-' ? -1 : 0;
+    Offset n;
+    if ( ! toOffset( s.cmp ? v.substr(1) : v, n ) ) return false;
+    s.n = n;
+    return true;
+  }
+
+  int primary() {
+    string p = tok[i++];
+    FindTerm t;
+    t.op = 'p';
+    FindStep& s = t.step;
+    if ( p == "-print" || p == "-prune" ) {
+      s.op = p == "-print" ? FindStep::PRINT : FindStep::PRUNE;
+      actions = true;
+      return add( t );
+    }
+    if ( p != "-name" && p != "-type" && p != "-size" && p != "-mtime" && p != "-newer" && p != "-maxdepth" && p != "-mindepth" )
+      return fail( "unknown predicate `" + p + "'" );
+    if ( i == tok.size() ) return fail( "missing argument to `" + p + "'" );
+    string v = tok[i++];
+    Offset n;
+    if ( p == "-name" ) {
+      s.op = FindStep::NAME;
+      compileGlob( s, v );
+    }
+    else if ( p == "-type" ) {
+      if ( v != "f" && v != "d" ) return fail( "unknown argument to -type: " + v );
+      s.op = FindStep::TYPE;
+      s.kind = v == "f" ? Kind::file : Kind::dir;
+    }
+    else if ( p == "-size" ) {
+      s.op = FindStep::SIZE;
+      char u = v.size() ? v[v.size()-1] : 0;
+      const char* units = "cwbkMG";
+      const Offset bytes[] = { 1, 2, 512, 1 << 10, 1 << 20, 1 << 30 };
+      s.unit = 512;
+      if ( u && strchr( units, u ) ) {
+        s.unit = bytes[ strchr( units, u ) - units ];
+        v.erase( v.size() - 1 );
+      }
+      if ( ! number( v, s ) ) return fail( "invalid -size " + tok[i-1] );
+    }
+    else if ( p == "-mtime" ) {
+      s.op = FindStep::MTIME;
+      if ( ! number( v, s ) ) return fail( "invalid -mtime " + v );
+    }
+    else if ( p == "-newer" ) {
+      SetUp su( Args{ "find", v } );
+      if ( su.error || ! su.b ) return fail( "cannot stat " + v );
+      s.op = FindStep::NEWER;
+      s.n = su.b->mTime();
+    }
+    else if ( p == "-maxdepth" || p == "-mindepth" ) {
+      if ( ! toOffset( v, n ) ) return fail( "invalid " + p + " " + v );
+      ( p == "-maxdepth" ? maxDepth : minDepth ) = n;
+      s.op = FindStep::TRUE;
+    }
+    return add( t );
+  }
+
+  void emit( int t ) {
+    FindTerm& x = terms[t];
+    if ( x.op == 'p' ) {
+      code.push_back( x.step );
+      return;
+    }
+    emit( x.left );
+    if ( x.op == '!' ) {
+      FindStep s;
+      s.op = FindStep::NOT;
+      code.push_back( s );
+      return;
+    }
+    FindStep jump;
+    jump.op = x.op == 'a' ? FindStep::JUMP_FALSE : FindStep::JUMP_TRUE;
+    size_t at = code.size();
+    code.push_back( jump );
+    emit( x.right );
+    code[at].n = code.size();
+  }
+
+  // A bound b such that nothing can pass with a size of b or less, or
+  // -1 if there is none.
+  Offset floorOf( int t ) {
+    FindTerm& x = terms[t];
+    if ( x.op == 'p' ) return x.step.op == FindStep::SIZE && x.step.cmp > 0 ? x.step.n * x.step.unit : -1;
+    if ( x.op == 'a' ) return max( floorOf( x.left ), floorOf( x.right ) );
+    if ( x.op == 'o' ) {
+      Offset l = floorOf( x.left ), r = floorOf( x.right );
+      return l < 0 || r < 0 ? -1 : min( l, r );
+    }
+    return -1;
+  }
+
+public:
+  vector<FindStep> code;
+  string error;
+  long maxDepth = LONG_MAX, minDepth = 0;
+  Offset sizeFloor = -1;         // see floorOf(); prunes small subtrees.
+
+  // Compiles tok[from..]; error says why if it can't.
+  FindProgram( const Args& t, size_t from ) : tok(t), i(from), now( inodeTable.now() ) {
+    int top = -1;
+    if ( i < tok.size() ) {
+      top = parseOr();
+      if ( top >= 0 && i < tok.size() ) top = fail( "unexpected `" + tok[i] + "'" );
+      if ( top < 0 ) return;
+    }
+    if ( top >= 0 ) emit( top );
+    if ( ! actions ) {
+      // As if ( expr ) -a -print.  Then only what passes is printed,
+      // and a subtree that is too small to hold anything that passes
+      // can be skipped.
+      if ( top >= 0 ) sizeFloor = floorOf( top );
+      FindStep print;
+      print.op = FindStep::PRINT;
+      if ( top >= 0 ) {
+        FindStep jump;
+        jump.op = FindStep::JUMP_FALSE;
+        jump.n = code.size() + 2;
+        code.push_back( jump );
+      }
+      code.push_back( print );
+    }
+  }
+
+  // Runs the program on b, named name, at path; says whether to
+  // -prune it.
+  bool run( InodeBase* b, const string& name, const string& path, OutStream& out ) {
+    bool r = true, prune = false;
+    for ( size_t pc = 0; pc < code.size(); ++pc ) {
+      const FindStep& s = code[pc];
+      switch ( s.op ) {
+      case FindStep::NAME:  r = globMatch( s, name ); break;
+      case FindStep::TYPE:  r = b->kind == s.kind; break;
+      case FindStep::NEWER: r = b->mTime() > s.n; break;
+      case FindStep::TRUE:  r = true; break;
+      case FindStep::NOT:   r = ! r; break;
+      case FindStep::SIZE:
+      case FindStep::MTIME: {
+        int64_t v = s.op == FindStep::SIZE ? ( inodeTable.size[ b->idnum ] + s.unit - 1 ) / s.unit
+                                           : ( now - b->mTime() ) / 86400;
+        r = s.cmp > 0 ? v > s.n : s.cmp < 0 ? v < s.n : v == s.n;
+        break;
+      }
+      case FindStep::JUMP_FALSE: if ( ! r ) pc = s.n - 1; break;
+      case FindStep::JUMP_TRUE:  if ( r ) pc = s.n - 1; break;
+      case FindStep::PRINT:
+        out.copy( path );
+        out.copy( "\n", 1 );
+        r = true;
+        break;
+      case FindStep::PRUNE: prune = r = true; break;
+      }
+    }
+    return prune;
+  }
+};
+
+int find( Args tok ) {
+  // find [path...] [expression]: the inodes under each path (default
+  // .) for which the expression holds.  Tests: -name glob, -type f|d,
+  // -size [+-]N[cwbkMG], -mtime [+-]days, -newer file; operators ( ),
+  // ! or -not, -a or -and (or nothing), -o or -or; -maxdepth N and
+  // -mindepth N; actions -print and -prune.  Without -print everything
+  // that passes is printed.  As with query, a directory's size is its
+  // subtree's.
+  size_t first = 1, end = 1;
+  while ( end < tok.size() && tok[end] != "!" && tok[end] != "(" && ( tok[end].size() < 2 || tok[end][0] != '-' ) ) ++end;
+  FindProgram prog( tok, end );
+  if ( prog.error.size() ) {
+    cerr << "find: " << prog.error << endl;
+    return -1;
+  }
+  Args starts( tok.begin() + first, tok.begin() + end );
+  if ( starts.empty() ) starts.push_back( "." );
+  struct Frame {
+    Inode<Directory>* dir;
+    DirIndex<InodeBase*>::iterator it;
+    size_t len;                              // of path, for this dir.
+    long depth;
+    bool locked;
+  };
+  vector<Frame> stack;
+  string path;
+  auto enter = [&]( Inode<Directory>* d, long depth ) {
+    bool locked = readLock( d->file->lock );
+    stack.push_back( Frame{ d, d->file->theMap.begin(), path.size(), depth, locked } );
+  };
+  OutStream out;
+  int status = 0;
+  // Tests b and says whether to go into it.
+  auto visit = [&]( InodeBase* b, const string& name, long depth ) {
+    bool prune = depth >= prog.minDepth && prog.run( b, name, path, out );
+    Inode<Directory>* d = as<Directory>( b );
+    return d && ! prune && depth < prog.maxDepth && d->getbytes() > prog.sizeFloor;
+  };
+  for ( auto& start : starts ) {
+    SetUp su( Args{ tok[0], start } );
+    if ( su.error || ! su.b ) {
+      status = -1;
+      continue;
+    }
+    path = start;
+    size_t cut = start.find_last_not_of( '/' );
+    string name = cut == string::npos ? "/" : start.substr( 0, cut + 1 );
+    name = name.substr( name.find_last_of( '/' ) == string::npos || name == "/" ? 0 : name.find_last_of( '/' ) + 1 );
+    if ( visit( su.b, name, 0 ) ) enter( as<Directory>( su.b ), 0 );
+    while ( stack.size() ) {
+      Frame& f = stack.back();
+      if ( f.it == f.dir->file->theMap.end() ) {
+        if ( f.locked ) readUnlock( f.dir->file->lock );
+        stack.pop_back();
+        continue;
+      }
+      InodeBase* b = f.it->second;
+      long depth = f.depth + 1;
+      ++f.it;
+      path.resize( f.len );
+      if ( path.empty() || path[path.size()-1] != '/' ) path += '/';
+      path += b->name;
+      if ( visit( b, b->name, depth ) ) enter( as<Directory>( b ), depth );
+    }
+  }
+  return status;
+}
+
+// Whether f's contents hold s, or with word set hold it as a whole
+// word.  Reads a megabyte at a time; each piece begins with the last
+// s.size() + 1 bytes of the one before, so a match across the seam,
+// and the byte on either side of it, is seen whole in one of them.
+bool contentHas( File* f, const string& s, bool word ) {
+  Offset size = f->size(), m = s.size();
+  const Offset CHUNK = max( Offset(1) << 20, 4 * ( m + 1 ) );
+  if ( m == 0 ) return true;
+  auto wordByte = []( char c ) { return isalnum( (unsigned char)c ) || c == '_'; };
+  string buf;
+  for ( Offset start = 0; start + m <= size; start += CHUNK - m - 1 ) {
+    Offset len = min( CHUNK, size - start );
+    buf.resize( len );
+    f->pread( &buf[0], len, start );
+    for ( const char* p = buf.data(); ( p = (const char*)memmem( p, buf.data() + len - p, s.data(), m ) ); ++p ) {
+      if ( ! word ) return true;
+      Offset at = p - buf.data();
+      if ( ( at == 0 && start > 0 ) || ( at + m == len && start + len < size ) ) continue;  // seen whole elsewhere.
+      if ( ( at == 0 || ! wordByte( p[-1] ) ) && ( at + m == len || ! wordByte( p[m] ) ) ) return true;
+    }
+    if ( start + len == size ) break;
+  }
+  return false;
+}
+
+// Brings textIndex up to date with the files changed since it was last
+// used, rebuilding it if it has grown too stale.
+void syncTextIndex() {
+  if ( textIndex.wasteful() ) {
+    textIndex.clear();
+    for ( size_t id = 0; id < inodeTable.rows(); ++id )
+      if ( inodeTable.kind[id] == (unsigned char)Kind::file ) textIndex.changed( id );
+  }
+  for ( int32_t id : textIndex.takePending() ) {
+    textIndex.drop( id );
+    if ( inodeTable.kind[id] != (unsigned char)Kind::file ) continue;
+    File* f = static_cast<Inode<File>*>( inodeTable.inode[id] )->file;
+    textIndex.begin( id );
+    f->spans( 0, f->size(), []( const char* p, Offset n ) { textIndex.feed( p, n ); } );
+    textIndex.end();
+  }
+}
+
+int grep( Args tok ) {
+  // grep [-w] [-c] [-s] string [dir]: the paths of the files under dir
+  // (default .) whose contents hold string, taken literally; -w only
+  // as a whole word.  -c prints only the count.  The files are found
+  // through textIndex and checked; -s checks every file instead, as
+  // does a string shorter than three bytes.  grep -stats reports on
+  // the index.
+  bool word = false, countOnly = false, scan = false;
+  size_t i = 1;
+  if ( tok.size() == 2 && tok[1] == "-stats" ) {
+    syncTextIndex();
+    size_t g, w;
+    size_t m = textIndex.memory( g, w );
+    cout << textIndex.files << " files indexed, " << textIndex.bytes << " bytes read, "
+         << textIndex.rebuilds << " rebuilds\n"
+         << g << " trigrams, " << w << " words, " << textIndex.live << " live and "
+         << textIndex.stale << " stale entries, about " << m / 1024 << " KB\n";
+    return 0;
+  }
+  for ( ; i < tok.size() && tok[i].size() == 2 && tok[i][0] == '-' && string( "wcs" ).find( tok[i][1] ) != string::npos; ++i ) {
+    word = word || tok[i] == "-w";
+    countOnly = countOnly || tok[i] == "-c";
+    scan = scan || tok[i] == "-s";
+  }
+  if ( i == tok.size() || tok.size() - i > 2 ) {
+    cerr << "grep: usage: grep [-w] [-c] [-s] string [dir]\n";
+    return -1;
+  }
+  string s = tok[i];
+  Inode<Directory>* under = wdi;
+  if ( i + 1 < tok.size() ) {
+    SetUp su( Args{ tok[0], tok[i+1] } );
+    if ( su.error || ! su.b ) return -1;
+    if ( ! ( under = as<Directory>( su.b ) ) ) {
+      cerr << "grep: " << tok[i+1] << ": Not a directory\n";
+      return -1;
+    }
+  }
+  vector<int32_t> ids;
+  if ( ! scan ) {
+    syncTextIndex();
+    scan = ! textIndex.candidates( s, word, ids );
+  }
+  vector<string> found;
+  if ( scan ) {
+    vector<Inode<Directory>*> stack( 1, under );
+    while ( stack.size() ) {
+      Inode<Directory>* d = stack.back();
+      stack.pop_back();
+      for ( auto it = d->file->theMap.begin(); it != d->file->theMap.end(); ++it ) {
+        if ( Inode<Directory>* sub = as<Directory>( it->second ) ) stack.push_back( sub );
+        else if ( Inode<File>* f = as<File>( it->second ) )
+          if ( contentHas( f->file, s, word ) ) found.push_back( pathOf( f ) );
+      }
+    }
+  }
+  else for ( auto id : ids ) {
+    if ( inodeTable.kind[id] != (unsigned char)Kind::file ) continue;
+    int32_t p = inodeTable.parent[id];
+    while ( p != -1 && p != under->idnum ) p = inodeTable.parent[p];
+    Inode<File>* f = static_cast<Inode<File>*>( inodeTable.inode[id] );
+    if ( p != -1 && f->parent && contentHas( f->file, s, word ) ) found.push_back( pathOf( f ) );
+  }
+  if ( countOnly ) {
+    cout << found.size() << endl;
+    return 0;
+  }
+  sort( found.begin(), found.end() );
+  OutStream out;
+  for ( auto& path : found ) {
+    out.copy( path );
+    out.copy( "\n", 1 );
+  }
+  return 0;
 }
 
 int cd( Args tok ) {
@@ -879,11 +2636,17 @@ int cd( Args tok ) {
   if ( tok.size() == 1 ) tok.push_back( home );
   SetUp su( tok );
   if ( su.error ) return -1;
-  if ( su.b->type() != "dir" ) {
+  if ( su.b->kind != Kind::dir ) {
     cerr << "shell: cd:" << su.lastSeg << ": Not a directory\n";
     return -1;
   }
-  wdi = dynamic_cast<Inode<Directory>*>(su.b);
+  // The working directory is held open, so removing it elsewhere
+  // doesn't free it while we are still in it.
+  Inode<Directory>* old = wdi;
+  wdi = static_cast<Inode<Directory>*>(su.b);
+  ++wdi->openCount;
+  --old->openCount;
+  old->cleanup();
   current = ( su.lastSeg != "" ? su.lastSeg : su.next2lastSeg +"/" );
   return 0;
 }
@@ -900,7 +2663,7 @@ int ls( Args tok ) {
   if(!su.b) {
       return -1;
   }
-  if ( su.b->type() != "dir" ) {
+  if ( su.b->kind != Kind::dir ) {
     //assert(false);
     cout << su.lastSeg << endl;
     return -1;
@@ -931,7 +2694,7 @@ int mkdir( Args tok ) {
       cerr << "mkdir: invalid directory name\n";
     return -1;
     }
-    Inode<Directory>* dir_ptr = dynamic_cast<Inode<Directory>*>(su.ind);
+    Inode<Directory>* dir_ptr = su.ind;
     // Added Directory Already Exist
     if(dir_ptr->file->theMap.find(su.lastSeg) != dir_ptr->file->theMap.end()) { // Added checks for . & .. directories
       cerr << "mkdir: File exists\n";
@@ -940,72 +2703,13 @@ int mkdir( Args tok ) {
       Directory* d = dir_ptr->file;
       Directory* sudir = new Directory();
       d->mk( su.lastSeg, sudir );
-      sudir->parent = dynamic_cast<Inode<Directory>*>(dir_ptr);
-      sudir->current = dynamic_cast<Inode<Directory>*>(d->theMap[su.lastSeg]);
-      ++dir_ptr->linkCount;
+      sudir->current = as<Directory>(d->theMap[su.lastSeg]);
     }
     temp.erase(temp.begin()+1);
   }
   return 0;
 }   
 
-int mkdir( Args tok, time_t c, time_t m, time_t a){
-  
-  SetUp su( tok );
-  if ( su.error ) return -1;
-  // Need to fix this in the Setup, but shouldn't check for "" here.
-  if(su.lastSeg == "." || su.lastSeg == ".." || (su.lastSeg).find(".") != std::string::npos || su.lastSeg == "") { // Added checks for . & .. directories
-    cerr << "mkdir: invalid directory name\n";
-  return -1;
-  }
-  Inode<Directory>* dir_ptr = dynamic_cast<Inode<Directory>*>(su.ind);
-  // Added Directory Already Exist
-  if(dir_ptr->file->theMap.find(su.lastSeg) != dir_ptr->file->theMap.end()) { // Added checks for . & .. directories
-    cerr << "mkdir: File exists\n";
-    dir_ptr->file->theMap[su.lastSeg]->updateTime(c,m,a);
-  }
-  else {
-    Directory* d = dir_ptr->file;
-    Directory* sudir = new Directory();
-    d->mk( su.lastSeg, sudir );
-    sudir->parent = dynamic_cast<Inode<Directory>*>(dir_ptr);
-    sudir->current = dynamic_cast<Inode<Directory>*>(d->theMap[su.lastSeg]);
-    sudir->current->updateTime(c,m,a);
-    ++dir_ptr->linkCount;
-  }
-  return 0;
-}
-
-int write( Args tok, time_t c, time_t m, time_t a){
-	SetUp su(tok);
-    string fileText;
-    if(su.error) { //create new file
-      Inode<Directory>* dir_ptr = dynamic_cast<Inode<Directory>*>(su.ind);
-      Directory* d = dir_ptr->file;
-      File* sufile = new File();
-      sufile->parent = dynamic_cast<Inode<Directory>*>(dir_ptr);
-      sufile->touch( su.lastSeg, sufile );
-      for(int i= 2; i<=tok.size()-1 ; i++) fileText += tok[i] +  " ";
-      sufile->text = fileText;
-      sufile->parent->file->theMap[su.lastSeg]->updateTime(c,m,a);
-      ++dir_ptr->linkCount;
-		
-	}
-	else if(su.b->type() != "file") {
-		cout << tok[1] << ": is not a regular file.  Cannot write." << endl;
-		return -1;
-	}
-	else {
-    Inode<File>* theFile  =  dynamic_cast<Inode<File>*>( su.ind->file->theMap.find(tok[1])->second);
-    for(int i= 2; i<=tok.size()-1 ; i++) fileText += tok[i] +  " ";
-    theFile->file->text = theFile->file->text + fileText;
-    theFile->updateTime(c,m,a);
-    cout << "FILETEXT: " << theFile->file->text << endl;
-	}
-  return 0;
-}
-
-
 int rmdir( Args tok ) {
   if ( tok.size() < 2 ) {
     cerr << "rmdir: missing operand\n";
@@ -1018,23 +2722,22 @@ int rmdir( Args tok ) {
     SetUp su( temp );
     if ( su.error ) return -1;
     
-    if(su.b->type() != "dir") { // Added checks for directories
+    if(su.b->kind != Kind::dir) { // Added checks for directories
         cerr << "rmdir: invalid directory name\n";
       return -1;
       }
-    Inode<Directory>* dir_ptr = dynamic_cast<Inode<Directory>*>(su.ind);
+    Inode<Directory>* dir_ptr = su.ind;
     if ( ! dir_ptr ) { 
       cerr << "rmdir: failed to remove '" << tok[0] 
            << "'; no such file or directory.\n";
-    } else if ( dynamic_cast<Inode<Directory>*>(su.b)->file->theMap.size() != 0 ) { 
+    } else if ( as<Directory>(su.b)->file->theMap.size() != 0 ) { 
       cerr << "rmdir: failed to remove '" << tok[0] 
            << "'; directory is not empty.\n";
-    } else if (dir_ptr->file->theMap.find(su.lastSeg) == dir_ptr->file->theMap.end() || dynamic_cast<Inode<Directory>*>(dir_ptr->file->theMap[su.lastSeg])->type() != "dir") {  // oops: if not there. added directory check
+    } else if (dir_ptr->file->theMap.find(su.lastSeg) == dir_ptr->file->theMap.end() || dir_ptr->file->theMap[su.lastSeg]->kind != Kind::dir) {  // oops: if not there. added directory check
       cerr << "rmdir: failed to remove '" << su.lastSeg
            << "'; no such file or directory.\n";
     } else {
       dir_ptr->file->rm(su.lastSeg);
-      --dir_ptr->linkCount;
     }
     temp.erase(temp.begin()+1);
   }
@@ -1042,29 +2745,38 @@ int rmdir( Args tok ) {
 }
 
 
+void journalCommand( const Args& tok );
+
 int rm( Args tok ) {
-  if ( tok.size() < 2 ) {
+  // rm [-f] file...: -f removes without asking.
+  Args temp = tok;
+  bool force = tok.size() > 1 && tok[1] == "-f";
+  if ( force ) temp.erase( temp.begin()+1 );
+  if ( temp.size() < 2 ) {
     cerr << "rm: missing operand\n";
     return -1;
   }
-  Args temp = tok;
-  for(auto it = tok.begin()+1; it != tok.end(); ++it) 
+  while ( temp.size() > 1 )
   {
     SetUp su( temp );
     if(su.error) { 
       cout << "rm: file does not exist\n";
       return -1;
     }
-    if ( su.ind->file->theMap[su.lastSeg]->type() == "dir" ) {  
+    if ( su.ind->file->theMap[su.lastSeg]->kind == Kind::dir ) {  
       cout << "rm: cannot remove `"<< su.lastSeg << "': is a  directory\n";
       return -1;
     }
-    cout << "rm: remove regular file `" << su.lastSeg << "'? ";
-    string response;
-    getline( cin, response );            // read user's response.
-    if ( response[0] != 'y' && response[0] != 'Y' )  return 0;
+    if ( ! force ) {
+      cout << "rm: remove regular file `" << su.lastSeg << "'? ";
+      string response;
+      getline( cin, response );            // read user's response.
+      if ( response[0] != 'y' && response[0] != 'Y' )  return 0;
+    }
+    // Journaled only once confirmed, and as rm -f, so that replay
+    // doesn't ask again.
+    journalCommand( Args{ "rm", "-f", temp[1] } );
     su.ind->file->rm(su.lastSeg);
-    --su.ind->linkCount;
     temp.erase(temp.begin()+1);
   }
   return 0;
@@ -1072,27 +2784,7 @@ int rm( Args tok ) {
 
 
 string pwdStr( Inode<Directory>* indb ) {
-	string pwdStr = "";
-  vector<string> temp;
-  Inode<Directory>* ind = indb->file->parent;
-  while( ind ) {
-    for(auto it = ind->file->theMap.begin(); it != ind->file->theMap.end(); ++it ) {
-	  if(it->second == indb) {
-		temp.push_back(it->first);
-		temp.push_back("/");
-	    break;
-	  }
-	}
-	indb = ind;
-	ind = ind->file->parent;
-  }
-  if(temp.empty()) temp.push_back("/");
-  //cout << "Current Directory is: ";
-  while (!temp.empty()) {
-    pwdStr += temp[temp.size()-1];
-	temp.pop_back();
-  }
-  return pwdStr;
+  return indb->path();
 }
 /*
 int ioRedirect(string filename, char ioType) {
@@ -1104,7 +2796,7 @@ int ioRedirect(string filename, char ioType) {
     cout << "Unable to do redirection.\n";
     return -1;
   }
-  else if (su.b->type() != "file") {
+  else if (su.b->kind != Kind::file) {
     cout << "Unable to do redirection. " << su.lastSeg << " is not a file.\n";
     return -1;
   }
@@ -1112,7 +2804,7 @@ int ioRedirect(string filename, char ioType) {
     stringstream buffer;
     streambuf *old = cout.rdbuf(buffer.rdbuf());
     cout << "hello";
-    dynamic_cast<Inode<File>*>(su.b)->file->text = buffer.str();
+    as<File>(su.b)->append( buffer.str() );
     cout.rdbuf(old);
   }
 }
@@ -1121,58 +2813,910 @@ int ioRedirect ( Args tok ) {
   ioRedirect("2", 'w');
 }*/
 
+// The lines of the text image: one per directory and file, apps and
+// /bin left out.  The path of the directory at depth d is the first
+// at[d] bytes of path.
+struct SaveLines {
+  InodeBase* bin;
+  string path;
+  vector<size_t> at;
+  SaveLines( InodeBase* bin, const string& s ) : bin( bin ), path( s ), at( 1, s.size() ) {}
+
+  WalkNext pre( const WalkStep& s, string& out ) {
+    InodeBase* x = s.x;
+    if ( x == bin || x->kind == Kind::app ) return WalkNext::over;
+    out += x->kind == Kind::dir ? "dir;" : "file;";
+    out.append( path, 0, at[s.depth] );
+    out += '/';
+    out += *s.name;
+    out += ';' + to_string( x->cTime() ) + ';' + to_string( x->mTime() ) + ';' + to_string( x->aTime() );
+    if ( x->kind == Kind::file ) {
+      out += ';';
+      out += static_cast<Inode<File>*>(x)->file->contents();
+      out += '\n';
+      return WalkNext::over;
+    }
+    out += '\n';
+    path.resize( at[s.depth] );
+    path += '/';
+    path += *s.name;
+    at.resize( s.depth + 2 );
+    at[s.depth + 1] = path.size();
+    return WalkNext::into;
+  }
+  void post( const WalkStep&, string& ) {}
+  SaveLines fork( const WalkStep& ) { return *this; }
+  void join( SaveLines& ) {}
+};
+
 void preserveRecursive ( Inode<Directory>* ind, string s, ofstream& store) {
-  int count = 0;
-  string old_s = s;
-  for(auto it = ind->file->theMap.begin(); it != ind->file->theMap.end(); ++it) 
-  {
-	++count;
-	if(it->second == root->file->theMap["bin"]) {
-		continue;
-	}
-	else if(it->second->type() == "dir") {
-	  old_s = pwdStr(dynamic_cast<Inode<Directory>*>(it->second));
-	  store << it->second->type() << ";" << old_s << ";" << it->second->c_time << ";" << it->second->m_time << ";" << it->second->a_time << endl ;
-	  
-	  if(dynamic_cast<Inode<Directory>*>(it->second)->file->theMap.size() != 0)
-	    preserveRecursive(dynamic_cast<Inode<Directory>*>(it->second), old_s, store);
-	}
-	else if(it->second->type() == "app") {
-		continue;
-	}
-	else if(it->second->type() == "file"){
-		Inode<File>* f  =  dynamic_cast<Inode<File>*>( it->second);
-		store << it->second->type() << ";" << s + "/" + it->first << ";" << it->second->c_time << ";" << it->second->m_time << ";" << it->second->a_time << ";" << f->file->text << endl;
-	}
-	else {
-	  store << it->second->type() << ";" << s + "/" + it->first << ";" << it->second->c_time << ";" << it->second->m_time << ";" << it->second->a_time << endl ;
-	}
+  SaveLines lines( lookup( root, "bin" ), s );
+  walkTree( ind, lines, store );
+}
+
+
+// Compressed images: the entries of the text format, in the same
+// order, as records in an LZ stream (see lz.h), each
+//   kind byte, how much of its path is the same as the previous
+//   record's, the rest of the path, ctime, then mtime and atime as
+//   zigzag differences from ctime, and for a file its contents.
+// Front-coding the paths leaves little of them but the names.  Where a
+// directory's entries were walked on another thread, last is still the
+// directory's own path when the record after them comes; that gives the
+// same shared length, since that record is never below the directory.
+struct CompressedLines {
+  InodeBase* bin;
+  string path, last;
+  vector<size_t> at;
+  SnapWriter w;
+  CompressedLines( InodeBase* bin, const string& s ) : bin( bin ), path( s ), at( 1, s.size() ) {}
+
+  WalkNext pre( const WalkStep& s, string& out ) {
+    InodeBase* x = s.x;
+    if ( x == bin || ( x->kind != Kind::dir && x->kind != Kind::file ) ) return WalkNext::over;
+    path.resize( at[s.depth] );
+    path += '/';
+    path += *s.name;
+    size_t same = 0;
+    while ( same < last.size() && same < path.size() && last[same] == path[same] ) ++same;
+    w.buf.clear();
+    w.byte( (unsigned char)x->kind );
+    w.varint( same );
+    w.varint( path.size() - same );
+    w.bytes( path.data() + same, path.size() - same );
+    w.varint( x->cTime() );
+    w.zigzag( int64_t( x->mTime() ) - x->cTime() );
+    w.zigzag( int64_t( x->aTime() ) - x->cTime() );
+    last = path;
+    if ( x->kind == Kind::dir ) {
+      out += w.buf;
+      at.resize( s.depth + 2 );
+      at[s.depth + 1] = path.size();
+      return WalkNext::into;
+    }
+    File* f = static_cast<Inode<File>*>(x)->file;
+    w.varint( f->size() );
+    out += w.buf;
+    f->spans( 0, f->size(), [&]( const char* p, Offset n ) { out.append( p, n ); } );
+    return WalkNext::over;
   }
-  return;
+  void post( const WalkStep&, string& ) {}
+  CompressedLines fork( const WalkStep& ) { return *this; }
+  void join( CompressedLines& ) {}
+};
+
+void preserveCompressed( Inode<Directory>* ind, const string& s, LZWriter& store ) {
+  CompressedLines lines( lookup( root, "bin" ), s );
+  walkTree( ind, lines, store );
+}
 
+// Writes the tree under ind to info.txt, as text or compressed.
+void preserve ( Inode<Directory>* ind, string s, bool compressed = false ) {
+  ofstream store ("info.txt", ios::binary);
+  if ( ! store.is_open() ) {
+    cout << "info.txt does not exist.  No pre-directory to load." << endl;
+    return;
+  }
+  if ( compressed ) {
+    LZWriter z( store );
+    preserveCompressed( ind, s, z );
+    z.close();
+    ostringstream ratio;
+    ratio << fixed << setprecision(1) << double( z.raw ) / max( z.stored, uint64_t(1) );
+    cout << "info.txt: " << z.raw << " bytes compressed to " << z.stored << " (" << ratio.str() << ":1)\n";
+  }
+  else preserveRecursive(ind, s, store);
+  store.close();
 }
 
+// Binary snapshots.  After the magic and a version number come the
+// table of entry names and then one record per inode, each written
+// after its parent's record:
+//   kind byte, parent's record number (0 is /), index of its name,
+//   ctime, then mtime and atime as zigzag differences from ctime,
+//   and for a file its length and contents.
+// The file ends with an FNV-1a checksum of everything before it.
+// /bin is left out; FSInit builds it.  Version 2 adds, after the
+// version, the number of the last journal record the image includes.
+const string SNAPSHOT = "info.snap";
+const char SNAP_MAGIC[] = "FSSNAP";
+const uint64_t SNAP_VERSION = 2;
 
-void preserve ( Inode<Directory>* ind, string s) {
-  ofstream store ("info.txt");
-  if (store.is_open())
-  {
-    preserveRecursive(ind, s, store);
-	store.close();
-   }
-  else cout << "info.txt does not exist.  No pre-directory to load." << endl;	
-  return;
+// Commands since the last checkpoint; see journaled() below.
+const string JOURNAL = "info.journal";
+Journal journal;
+uint64_t journalSeq = 0;           // number of the last record journaled.
+bool replaying = false;
+
+// What a load put into the tree, for FSInit's report.
+struct LoadSummary {
+  long dirs = 0, files = 0, skipped = 0;    // skipped: unusable lines.
+  Offset bytes = 0;
+  uint64_t seq = 0;                         // journal records it includes.
+};
+
+bool saveSnapshot( const string& file ) {
+  SnapWriter names, body;
+  unordered_map<string, uint64_t> nameIds;
+  uint64_t records = 0;
+  InodeBase* bin = lookup( root, "bin" );
+  vector< pair<Inode<Directory>*, uint64_t> > dirs( 1, make_pair( root, uint64_t(0) ) );
+  while ( dirs.size() ) {
+    Inode<Directory>* d = dirs.back().first;
+    uint64_t parentNo = dirs.back().second;
+    dirs.pop_back();
+    for ( auto it = d->file->theMap.begin(); it != d->file->theMap.end(); ++it ) {
+      InodeBase* x = it->second;
+      if ( x == bin || x->kind == Kind::app ) continue;
+      ++records;
+      auto n = nameIds.find( it->first );
+      if ( n == nameIds.end() ) {
+        n = nameIds.insert( make_pair( it->first, uint64_t( nameIds.size() ) ) ).first;
+        names.str( it->first );
+      }
+      body.byte( (unsigned char)x->kind );
+      body.varint( parentNo );
+      body.varint( n->second );
+      body.varint( x->cTime() );
+      body.zigzag( int64_t( x->mTime() ) - x->cTime() );
+      body.zigzag( int64_t( x->aTime() ) - x->cTime() );
+      if ( x->kind == Kind::file ) {
+        File* f = static_cast<Inode<File>*>(x)->file;
+        Offset len = f->size();
+        body.varint( len );
+        size_t at = body.buf.size();
+        body.buf.resize( at + len );
+        f->pread( &body.buf[at], len, 0 );
+      }
+      else dirs.push_back( make_pair( static_cast<Inode<Directory>*>(x), records ) );
+    }
+  }
+  SnapWriter head;
+  head.bytes( SNAP_MAGIC, 6 );
+  head.varint( SNAP_VERSION );
+  head.varint( journalSeq );
+  head.varint( nameIds.size() );
+  head.bytes( names.buf.data(), names.buf.size() );
+  head.varint( records );
+  head.varint( root->cTime() );
+  head.zigzag( int64_t( root->mTime() ) - root->cTime() );
+  head.zigzag( int64_t( root->aTime() ) - root->cTime() );
+  uint64_t sum = fnv64( head.buf.data(), head.buf.size() );
+  sum = fnv64( body.buf.data(), body.buf.size(), sum );
+  char tail[8];
+  for ( int i = 0; i < 8; ++i ) tail[i] = char( sum >> ( 8 * i ) );
+
+  // Written beside the old snapshot and renamed over it, so a crash
+  // part way leaves the old one intact.
+  string tmp = file + ".tmp";
+  ofstream out( tmp, ios::binary | ios::trunc );
+  out.write( head.buf.data(), head.buf.size() );
+  out.write( body.buf.data(), body.buf.size() );
+  out.write( tail, 8 );
+  out.close();
+  if ( ! out || ::rename( tmp.c_str(), file.c_str() ) != 0 ) {
+    cerr << "save: cannot write " << file << endl;
+    return false;
+  }
+  return true;
+}
+
+// Loads a snapshot written by saveSnapshot() into the tree.  Returns
+// false, leaving the tree alone, if file is missing, is not a
+// snapshot, or fails its checksum.
+bool loadSnapshot( const string& file, LoadSummary* sum = 0 ) {
+  ifstream in( file, ios::binary );
+  if ( ! in ) return false;
+  string data( (istreambuf_iterator<char>(in)), istreambuf_iterator<char>() );
+  if ( data.size() < 6 + 8 || data.compare( 0, 6, SNAP_MAGIC ) != 0 ) return false;
+  uint64_t check = 0;
+  for ( int i = 0; i < 8; ++i ) check |= uint64_t( (unsigned char)data[ data.size() - 8 + i ] ) << ( 8 * i );
+  if ( check != fnv64( data.data(), data.size() - 8 ) ) {
+    cerr << file << ": snapshot is damaged (bad checksum)\n";
+    return false;
+  }
+  SnapReader r( data.data() + 6, data.size() - 6 - 8 );
+  uint64_t version = r.varint();
+  if ( version < 1 || version > SNAP_VERSION ) {
+    cerr << file << ": snapshot version " << version << " is not supported\n";
+    return false;
+  }
+  LoadSummary ignored;
+  if ( ! sum ) sum = &ignored;
+  if ( version >= 2 ) sum->seq = r.varint();
+  vector<string> names( r.varint() );
+  for ( auto& n : names ) n = r.str();
+  uint64_t records = r.varint();
+  time_t c = r.varint();
+  root->updateTime( c, c + r.zigzag(), c + r.zigzag() );
+  // dirs[i] is record i's inode if it is a directory; records refer
+  // to their parents by number, so no path is ever resolved.
+  vector<Inode<Directory>*> dirs( 1, root );
+  for ( uint64_t i = 1; i <= records && r.ok; ++i ) {
+    Kind kind = Kind( r.byte() );
+    uint64_t parentNo = r.varint();
+    uint64_t nameNo = r.varint();
+    c = r.varint();
+    time_t m = c + r.zigzag();
+    time_t a = c + r.zigzag();
+    if ( parentNo >= dirs.size() || ! dirs[parentNo] || nameNo >= names.size() ) r.ok = false;
+    if ( ! r.ok ) break;
+    Directory* p = dirs[parentNo]->file;
+    const string& name = names[nameNo];
+    InodeBase* x = 0;
+    if ( kind == Kind::dir ) {
+      auto it = p->theMap.find( name );
+      x = ( it != p->theMap.end() ? as<Directory>( it->second ) : 0 );   // e.g. /dev
+      if ( ! x ) {
+        x = new Inode<Directory>( new Directory );
+        p->link( name, x );
+      }
+      dirs.push_back( static_cast<Inode<Directory>*>(x) );
+      ++sum->dirs;
+    }
+    else if ( kind == Kind::file ) {
+      uint64_t len = r.varint();
+      const char* q = r.bytes( len );
+      if ( ! q ) break;
+      File* f = new File;
+      f->pwrite( q, len, 0 );
+      x = new Inode<File>( f );
+      p->link( name, x );
+      dirs.push_back( 0 );
+      ++sum->files;
+      sum->bytes += len;
+    }
+    else r.ok = false;
+    if ( x ) x->updateTime( c, m, a );
+  }
+  if ( ! r.ok || r.left() ) cerr << file << ": snapshot is damaged; loaded " << dirs.size() - 1 << " of " << records << " entries\n";
+  return true;
+}
+
+// Incremental saves (see segments.h).  A directory's record is
+//   number of entries, then per entry: kind byte, name, ctime, mtime
+//   and atime as zigzag differences from ctime, and the record id of
+//   a directory or the length and contents of a file.
+// The manifest's header holds the journal sequence number the image
+// includes, the root's record id and the root's times.  /bin is left
+// out, as in snapshots.
+
+// A save in progress.  freezeSave() runs with commands held off: it
+// takes down the metadata of each stale record, leaving out its files'
+// contents and sharing those files instead (see File), so that
+// commands can go on changing the tree as soon as it returns.  encodeSave() and
+// writeSave() fill the contents in and write the segment and manifest;
+// they read only the Save and the files held, so they may run in
+// another thread.  finishSave(), with commands held off again, takes
+// the result in.
+struct Save {
+  struct Record {
+    uint32_t id;
+    string meta;
+    vector< pair<size_t, File*> > files;   // contents go at meta offset.
+  };
+  vector<Record> records;
+  SegmentStore::Batch batch;
+  off_t journalUpTo = 0;                   // where the journal can be cut.
+  bool empty = false;                      // nothing changed; write nothing.
+  bool ok = false;
+};
+
+bool fullSaveNeeded = false;               // set when a save fails.
+
+// Adds to sv the records of top and of the directories under it that
+// are marked dirty, or of all of them if all is set, clearing the
+// marks.  A directory's record goes in after those below it; the walk
+// keeps a stack of its own rather than recursing.
+void freezeDirty( Inode<Directory>* top, bool all, Save& sv ) {
+  struct Frame {
+    Inode<Directory>* d;
+    bool rewrite;
+    InodeBase* bin;
+    DirIndex<InodeBase*>::iterator it;
+    Save::Record rec;
+    SnapWriter w;
+  };
+  vector<Frame> stack;
+  // Takes d's mark, and stacks d if its record or one below is stale.
+  auto enter = [&]( Inode<Directory>* d ) {
+    unsigned char& mark = inodeTable.dirty[d->idnum];
+    bool rewrite = all || ( mark & InodeTable::DIRTY ) || ! segments.has( d->saveId );
+    if ( ! all && ! mark && d->saveId ) return;
+    mark = 0;
+    if ( ! d->saveId ) d->saveId = segments.newId();
+    InodeBase* bin = ( d == root ? lookup( root, "bin" ) : 0 );
+    stack.push_back( Frame{ d, rewrite, bin, d->file->theMap.begin(), Save::Record(), SnapWriter() } );
+    if ( rewrite ) stack.back().w.varint( d->file->theMap.size() - ( bin ? 1 : 0 ) );
+  };
+  enter( top );
+  while ( stack.size() ) {
+    Frame& f = stack.back();
+    if ( f.it == f.d->file->theMap.end() ) {
+      if ( f.rewrite ) {
+        f.rec.id = f.d->saveId;
+        f.rec.meta.swap( f.w.buf );
+        sv.records.push_back( move( f.rec ) );
+      }
+      stack.pop_back();
+      continue;
+    }
+    auto& e = *f.it;
+    ++f.it;
+    InodeBase* x = e.second;
+    if ( x == f.bin || x->kind == Kind::app ) continue;
+    Inode<Directory>* sub = as<Directory>( x );
+    size_t at = stack.size() - 1;
+    if ( sub ) enter( sub );                // may move f.
+    Frame& g = stack[at];
+    if ( ! g.rewrite ) continue;
+    SnapWriter& w = g.w;
+    w.byte( (unsigned char)x->kind );
+    w.str( e.first );
+    w.varint( x->cTime() );
+    w.zigzag( int64_t( x->mTime() ) - x->cTime() );
+    w.zigzag( int64_t( x->aTime() ) - x->cTime() );
+    if ( sub ) w.varint( sub->saveId );
+    else {
+      File* file = as<File>( x )->file;
+      w.varint( file->size() );
+      file->share();
+      g.rec.files.push_back( make_pair( w.buf.size(), file ) );
+    }
+  }
+}
+
+// Starts a save of what changed since the last one, or of everything
+// if all is set or the segments hold more than twice what is live.
+// Returns 0 if a save is already in flight.
+Save* freezeSave( bool all = false ) {
+  if ( segments.busy() ) return 0;
+  if ( fullSaveNeeded || segments.stored() > 2 * segments.live() + ( 1 << 20 ) ) all = true;
+  fullSaveNeeded = false;
+  Save* sv = new Save;
+  freezeDirty( root, all, *sv );
+  SnapWriter h;
+  h.varint( journalSeq );
+  h.varint( root->saveId );
+  h.varint( root->cTime() );
+  h.zigzag( int64_t( root->mTime() ) - root->cTime() );
+  h.zigzag( int64_t( root->aTime() ) - root->cTime() );
+  journal.sync();
+  sv->journalUpTo = journal.size();
+  if ( sv->records.empty() && h.buf == segments.header ) {
+    sv->empty = true;
+    return sv;
+  }
+  segments.prepare( sv->batch );
+  sv->batch.header = h.buf;
+  return sv;
+}
+
+// Puts the records, contents and all, into the batch.  Calls yield, if
+// given, every so often, for a thread that shares its CPU.
+void encodeSave( Save& sv, void (*yield)() = 0 ) {
+  string rec;
+  size_t since = 0;
+  for ( auto& r : sv.records ) {
+    rec.clear();
+    size_t at = 0;
+    for ( auto& f : r.files ) {
+      rec.append( r.meta, at, f.first - at );
+      size_t n = f.second->size();
+      rec.resize( rec.size() + n );
+      f.second->pread( &rec[ rec.size() - n ], n, 0 );
+      at = f.first;
+      since += n;
+    }
+    rec.append( r.meta, at, string::npos );
+    sv.batch.put( r.id, rec );
+    since += r.meta.size();
+    if ( yield && since >= ( 1 << 20 ) ) {
+      yield();
+      since = 0;
+    }
+  }
+}
+
+void writeSave( Save& sv ) {
+  if ( ! sv.empty ) sv.ok = segments.write( sv.batch );
+}
+
+// Ends sv, letting go of its files and, if it was written, cutting the
+// journal.  Returns the number of records written, or -1.
+long finishSave( Save* sv ) {
+  long wrote = sv->records.size();
+  for ( auto& r : sv->records )
+    for ( auto& f : r.files ) f.second->release();
+  if ( sv->empty ) {
+    segments.written = 0;
+    journal.trim( sv->journalUpTo );
+  }
+  else {
+    segments.finish( sv->batch, sv->ok );
+    if ( sv->ok ) journal.trim( sv->journalUpTo );
+    else {
+      cerr << "save: cannot write " << SEGMENTS << endl;
+      fullSaveNeeded = true;              // its records' marks are gone.
+      wrote = -1;
+    }
+  }
+  delete sv;
+  return wrote;
+}
+
+// A whole save, in the calling thread.
+long saveSegments( bool all = false ) {
+  Save* sv = freezeSave( all );
+  if ( ! sv ) {
+    cerr << "save: a background save is still running\n";
+    return -1;
+  }
+  encodeSave( *sv );
+  writeSave( *sv );
+  return finishSave( sv );
+}
+
+// Builds the entries of top from record id, and of the directories in
+// it from theirs, with a stack of its own rather than recursion.  False
+// if a record is missing or damaged; loading stops there.
+bool loadRecord( Inode<Directory>* top, uint32_t id, LoadSummary* sum ) {
+  struct Frame {
+    Inode<Directory>* d;
+    SnapReader r;
+    uint64_t left;                // entries still to read.
+    time_t c, m, a;               // d's times, set once its entries are in.
+  };
+  vector<Frame> stack;
+  auto open = [&]( Inode<Directory>* d, uint32_t id, time_t c, time_t m, time_t a ) {
+    size_t len;
+    const char* p = segments.record( id, len );
+    if ( ! p ) return false;
+    d->saveId = id;
+    stack.push_back( Frame{ d, SnapReader( p, len ), 0, c, m, a } );
+    stack.back().left = stack.back().r.varint();
+    return true;
+  };
+  if ( ! open( top, id, 0, 0, 0 ) ) return false;
+  bool ok = true;
+  while ( stack.size() ) {
+    Frame& cur = stack.back();
+    if ( ! ok || ! cur.r.ok || ! cur.left ) {
+      ok = ok && cur.r.ok && ! cur.r.left();
+      Frame done = cur;
+      stack.pop_back();
+      if ( stack.size() ) done.d->updateTime( done.c, done.m, done.a );   // top's are the caller's.
+      continue;
+    }
+    --cur.left;
+    SnapReader& r = cur.r;
+    Kind kind = Kind( r.byte() );
+    string name = r.str();
+    time_t c = r.varint();
+    time_t m = c + r.zigzag();
+    time_t a = c + r.zigzag();
+    if ( ! r.ok ) continue;
+    if ( kind == Kind::dir ) {
+      uint32_t sub = r.varint();
+      auto it = cur.d->file->theMap.find( name );
+      Inode<Directory>* x = ( it != cur.d->file->theMap.end() ? as<Directory>( it->second ) : 0 );   // e.g. /dev
+      if ( ! x ) {
+        x = new Inode<Directory>( new Directory );
+        cur.d->file->link( name, x );
+      }
+      ++sum->dirs;
+      if ( ! open( x, sub, c, m, a ) ) {
+        ok = false;
+        x->updateTime( c, m, a );
+      }
+    }
+    else if ( kind == Kind::file ) {
+      uint64_t size = r.varint();
+      const char* q = r.bytes( size );
+      if ( ! q ) continue;
+      File* f = new File;
+      f->pwrite( q, size, 0 );
+      InodeBase* x = new Inode<File>( f );
+      cur.d->file->link( name, x );
+      ++sum->files;
+      sum->bytes += size;
+      x->updateTime( c, m, a );
+    }
+    else r.ok = false;
+  }
+  return ok;
+}
+
+// Loads the image in SEGMENTS; false, leaving the tree alone, if there
+// is no manifest.
+bool loadSegments( LoadSummary* sum ) {
+  if ( ! segments.open() ) return false;
+  SnapReader h( segments.header.data(), segments.header.size() );
+  sum->seq = h.varint();
+  uint32_t rootId = h.varint();
+  time_t c = h.varint();
+  time_t m = c + h.zigzag();
+  time_t a = c + h.zigzag();
+  if ( ! loadRecord( root, rootId, sum ) ) cerr << SEGMENTS << " is damaged; loaded what could be read\n";
+  root->updateTime( c, m, a );
+  segments.release();
+  // What was just loaded is what is saved.
+  fill( inodeTable.dirty.begin(), inodeTable.dirty.end(), 0 );
+  return true;
+}
+
+int dcacheApp ( Args tok ) {
+  // dcache [-c]: reports path cache counters; -c empties the cache
+  // and resets them.
+  if ( tok.size() > 1 && tok[1] == "-c" ) {
+    dcache.clear();
+    dcache.clearCounts();
+    return 0;
+  }
+  long hits = dcache.hits(), misses = dcache.misses();
+  long lookups = hits + misses;
+  cout << "paths: " << dcache.pathCount() << endl
+       << "hits: " << hits
+       << "  misses: " << misses
+       << "  hit rate: " << ( lookups ? 100 * hits / lookups : 0 ) << "%"
+       << "  paths invalidated: " << dcache.invalidations() << endl;
+  return 0;
+}
+
+// One line of mem's report for the objects of type T.
+template< typename T > void memLine( const char* label ) {
+  Slab<T>& sl = slab<T>();
+  cout << left << setw(18) << label << right << setw(10) << sl.live
+       << setw(14) << sl.liveBytes() << setw(14) << sl.reservedBytes()
+       << setw(12) << sl.allocations << setw(12) << sl.releases << endl;
+}
+
+int mem ( Args tok ) {
+  // mem: objects and bytes held by each slab and by file blocks.
+  cout << left << setw(18) << "" << right << setw(10) << "live" << setw(14) << "bytes"
+       << setw(14) << "reserved" << setw(12) << "allocs" << setw(12) << "frees" << endl;
+  memLine< Inode<Directory> >( "dir inodes" );
+  memLine< Directory >( "directories" );
+  memLine< Inode<File> >( "file inodes" );
+  memLine< File >( "files" );
+  memLine< Inode<App> >( "app inodes" );
+  cout << left << setw(18) << "file blocks" << right << setw(10) << blocks.inUse
+       << setw(14) << Offset(blocks.inUse) * BLOCK_SIZE << setw(14) << blocks.reservedBytes() << endl;
+  // Contents shared by cp are counted once; "as copies" is what they
+  // would take if every inode had its own.
+  unordered_set<File*> seen;
+  long sharedFiles = 0, uniqueFiles = 0;
+  Offset sharedBytes = 0, uniqueBytes = 0, copies = 0;
+  for ( size_t i = 0; i < inodeTable.inode.size(); ++i ) {
+    if ( inodeTable.kind[i] != (unsigned char)Kind::file || ! inodeTable.inode[i] ) continue;
+    File* f = static_cast<Inode<File>*>( inodeTable.inode[i] )->file;
+    Offset n = f->allocatedBytes();
+    copies += n;
+    if ( ! f->shared() ) {
+      ++uniqueFiles;
+      uniqueBytes += n;
+    }
+    else if ( seen.insert( f ).second ) {
+      ++sharedFiles;
+      sharedBytes += n;
+    }
+  }
+  cout << left << setw(18) << "shared contents" << right << setw(10) << sharedFiles << setw(14) << sharedBytes << endl
+       << left << setw(18) << "unique contents" << right << setw(10) << uniqueFiles << setw(14) << uniqueBytes << endl
+       << left << setw(18) << "as copies" << right << setw(10) << "" << setw(14) << copies << endl;
+  return 0;
+}
+
+// Appends a command line, the directory it runs in and the time to
+// the journal.  Replaying the commands in order over the last
+// checkpoint rebuilds the tree.  Commands on several threads take
+// turns at it.
+mutex journalLock;
+
+void journalCommand( const Args& tok ) {
+  if ( ! journal.isOpen() || replaying ) return;
+  lock_guard<mutex> hold( journalLock );
+  SnapWriter w;
+  w.varint( ++journalSeq );
+  w.varint( inodeTable.now() );
+  w.str( wdi->path() );
+  w.varint( tok.size() );
+  for ( auto& t : tok ) w.str( t );
+  if ( ! journal.append( w.buf ) ) cerr << tok[0] << ": cannot write to " << JOURNAL << endl;
+}
+
+// Mutating apps are registered as journaled<app>, which journals the
+// command before running it.  (rm journals itself once confirmed.)
+template< App* F > int journaled( Args tok ) {
+  journalCommand( tok );
+  return F( tok );
+}
+
+// Open files.  Each process has a table of descriptors holding the
+// resolved inode and an offset, so reads and writes through one skip
+// the path lookup.  An open file counts in its inode's openCount,
+// which keeps it alive after it is unlinked until it is closed.
+const int OPEN_MAX = 32;
+enum { OPEN_READ = 1, OPEN_WRITE = 2, OPEN_APPEND = 4 };
+
+struct OpenFile {
+  Inode<File>* inode = 0;                    // 0 if the slot is free.
+  Offset offset = 0;
+  int mode = 0;
+};
+
+struct FdTable {
+  OpenFile fd[OPEN_MAX];
+};
+
+map<pid_t, FdTable> fdTables;
+
+// The calling process's descriptors.  A process forked by the shell
+// starts with a copy of its parent's, as after fork(2).
+FdTable& fdTable() {
+  auto it = fdTables.find( getpid() );
+  if ( it != fdTables.end() ) return it->second;
+  FdTable& t = fdTables[ getpid() ];
+  auto parent = fdTables.find( getppid() );
+  if ( parent != fdTables.end() ) {
+    t = parent->second;
+    for ( auto& o : t.fd ) if ( o.inode ) ++o.inode->openCount;
+  }
+  return t;
+}
+
+// tok[1] as an open descriptor of this process, or -1.
+int descriptorArg( Args tok ) {
+  Offset n;
+  if ( tok.size() < 2 || ! toOffset( tok[1], n ) || n >= OPEN_MAX || ! fdTable().fd[n].inode ) return -1;
+  return n;
+}
+
+string modeName( int mode ) {
+  string s = mode & OPEN_APPEND ? "a" : mode & OPEN_READ && ! ( mode & OPEN_WRITE ) ? "r" : "w";
+  if ( mode & OPEN_READ && mode & OPEN_WRITE ) s += "+";
+  return s;
+}
+
+int openApp( Args tok ) {
+  // open file [r | r+ | w | w+ | a | a+]: opens file and prints its
+  // descriptor.  The modes are fopen's: w and a create the file, w
+  // empties it, a writes at the end.  With no operand lists what is
+  // open.
+  FdTable& t = fdTable();
+  if ( tok.size() < 2 ) {
+    for ( int i = 0; i < OPEN_MAX; ++i ) {
+      OpenFile& o = t.fd[i];
+      if ( o.inode ) cout << left << setw(4) << i << setw(4) << modeName( o.mode ) << setw(12) << o.offset
+                          << ( o.inode->parent ? pathOf( o.inode ) : o.inode->name + " (deleted)" ) << endl;
+    }
+    return 0;
+  }
+  string m = tok.size() > 2 ? tok[2] : "r";
+  int mode = m == "r" ? OPEN_READ : m == "w" ? OPEN_WRITE : m == "a" ? OPEN_WRITE | OPEN_APPEND : 0;
+  if ( m.size() == 2 && m[1] == '+' && ( m[0] == 'r' || m[0] == 'w' || m[0] == 'a' ) )
+    mode = OPEN_READ | OPEN_WRITE | ( m[0] == 'a' ? OPEN_APPEND : 0 );
+  if ( ! mode ) {
+    cerr << "open: usage: open file [r | r+ | w | w+ | a | a+]\n";
+    return -1;
+  }
+  int fd = 0;
+  while ( fd < OPEN_MAX && t.fd[fd].inode ) ++fd;
+  if ( fd == OPEN_MAX ) {
+    cerr << "open: too many open files\n";
+    return -1;
+  }
+  SetUp su( tok );
+  if ( su.error ) return -1;
+  if ( su.lastSeg == "" ) {
+    cerr << "open: missing operand\n";
+    return -1;
+  }
+  Inode<File>* f;
+  if ( ! su.b ) {
+    if ( m[0] == 'r' ) {
+      cerr << "open: " << tok[1] << ": No such file\n";
+      return -1;
+    }
+    su.ind->file->mk( su.lastSeg, new File() );
+    f = as<File>( su.ind->file->theMap.find( su.lastSeg )->second );
+    journalCommand( Args{ "touch", pathOf( f ) } );
+  }
+  else if ( ! ( f = as<File>( su.b ) ) ) {
+    cerr << "open: " << su.lastSeg << ": is not a regular file.\n";
+    return -1;
+  }
+  else if ( m[0] == 'w' && f->file->size() ) {
+    journalCommand( Args{ "truncate", pathOf( f ), "0" } );
+    f->truncate( 0 );
+    f->setMTime( inodeTable.now() );
+    f->setATime( f->mTime() );
+  }
+  OpenFile& o = t.fd[fd];
+  o.inode = f;
+  o.offset = 0;
+  o.mode = mode;
+  ++f->openCount;
+  cout << fd << endl;
+  return 0;
+}
+
+int closeApp( Args tok ) {
+  // close fd
+  int fd = descriptorArg( tok );
+  if ( fd < 0 ) {
+    cerr << "close: " << ( tok.size() > 1 ? tok[1] : "" ) << ": bad descriptor\n";
+    return -1;
+  }
+  OpenFile& o = fdTable().fd[fd];
+  Inode<File>* f = o.inode;
+  o = OpenFile();
+  --f->openCount;
+  f->cleanup();
+  return 0;
+}
+
+int lseekApp( Args tok ) {
+  // lseek fd offset [set | cur | end]: moves fd's offset, from the
+  // start, where it is, or the end, and prints where it lands.
+  int fd = descriptorArg( tok );
+  bool neg = tok.size() > 2 && tok[2].size() && tok[2][0] == '-';
+  Offset off;
+  string whence = tok.size() > 3 ? tok[3] : "set";
+  if ( fd < 0 || tok.size() < 3 || ! toOffset( tok[2].substr( neg ), off )
+       || ( whence != "set" && whence != "cur" && whence != "end" ) ) {
+    cerr << "lseek: usage: lseek fd offset [set | cur | end]\n";
+    return -1;
+  }
+  OpenFile& o = fdTable().fd[fd];
+  Offset to = ( whence == "set" ? 0 : whence == "cur" ? o.offset : o.inode->file->size() ) + ( neg ? -off : off );
+  if ( to < 0 ) {
+    cerr << "lseek: offset before the start of the file\n";
+    return -1;
+  }
+  o.offset = to;
+  cout << to << endl;
+  return 0;
+}
+
+// read -d fd [length]: prints up to length bytes, or the rest, from fd's
+// offset and moves it past them.
+int readFd( int fd, Args tok ) {
+  OpenFile& o = fdTable().fd[fd];
+  Offset len = o.inode->file->size();
+  if ( ! ( o.mode & OPEN_READ ) ) {
+    cerr << "read: " << fd << ": not open for reading\n";
+    return -1;
+  }
+  if ( tok.size() > 2 && ! toOffset( tok[2], len ) ) {
+    cerr << "read: usage: read -d fd [length]\n";
+    return -1;
+  }
+  len = max( Offset(0), min( len, o.inode->file->size() - o.offset ) );
+  OutStream out;
+  streamFile( out, o.inode->file, o.offset, len );
+  out.copy( "\n" );
+  o.offset += len;
+  o.inode->setATime( inodeTable.now() );
+  return 0;
+}
+
+// write -d fd text...: writes text at fd's offset, or at the end if fd
+// was opened to append, and moves the offset past it.  It is
+// journaled as the pwrite it amounts to, so replay needs no
+// descriptors; writes to an unlinked file are not journaled at all.
+int writeFd( int fd, Args tok ) {
+  OpenFile& o = fdTable().fd[fd];
+  if ( ! ( o.mode & OPEN_WRITE ) ) {
+    cerr << "write: " << fd << ": not open for writing\n";
+    return -1;
+  }
+  if ( tok.size() < 3 ) {
+    cerr << "write: usage: write -d fd text\n";
+    return -1;
+  }
+  if ( o.mode & OPEN_APPEND ) o.offset = o.inode->file->size();
+  string text = join( tok, " ", 2 );
+  if ( o.inode->parent ) journalCommand( Args{ "pwrite", pathOf( o.inode ), T2a( o.offset ), text } );
+  o.offset += o.inode->pwrite( text.data(), text.size(), o.offset );
+  o.inode->setMTime( inodeTable.now() );
+  o.inode->setATime( o.inode->mTime() );
+  return 0;
+}
+
+// read and write take -d and an open descriptor in place of a file
+// name, so that a file named 3 is still a file.  Takes the -d out of
+// tok and returns the descriptor, or -1 (having said why) if it is not
+// open; -2 if tok names a file.
+int descriptorOperand( Args& tok ) {
+  if ( tok.size() < 2 || tok[1] != "-d" ) return -2;
+  tok.erase( tok.begin() + 1 );
+  int fd = descriptorArg( tok );
+  if ( fd < 0 ) cerr << tok[0] << ": " << ( tok.size() > 1 ? tok[1] : "" ) << ": bad descriptor\n";
+  return fd;
+}
+
+int readApp( Args tok ) {
+  int fd = descriptorOperand( tok );
+  return fd == -2 ? read( tok ) : fd < 0 ? -1 : readFd( fd, tok );
+}
+
+int writeApp( Args tok ) {
+  int fd = descriptorOperand( tok );
+  return fd == -2 ? journaled<write>( tok ) : fd < 0 ? -1 : writeFd( fd, tok );
+}
+
+// Saves everything journaled so far, then empties the journal.
+bool checkpoint( bool all = false ) {
+  return saveSegments( all ) >= 0;
 }
 
 int save ( Args tok ) {
-  preserve(root, "");
+  // save [-c | -t | -z]: saves what changed since the last save; -c
+  // rewrites everything into one segment; -t writes the text format
+  // to info.txt instead, and -z a compressed image of it.
+  if ( tok.size() > 1 && tok[1] == "-t" ) preserve(root, "");
+  else if ( tok.size() > 1 && tok[1] == "-z" ) preserve(root, "", true);
+  else if ( ! checkpoint( tok.size() > 1 && tok[1] == "-c" ) ) return -1;
+  else cout << segments.written << " bytes written; " << segments.records() << " records in "
+            << segments.segmentCount() << " segments.\n";
   cout << "FileSystem saved successfuly.\n";
   return 0;
 }
 
+int journalApp ( Args tok ) {
+  // journal [none | fsync | group [ms [batch]] | sync]: sets how soon
+  // journaled commands reach the disk, or forces them out; with no
+  // argument reports the mode and counters.  In group mode the ms
+  // window is checked only when the next command is journaled.
+  if ( tok.size() == 1 ) {
+    const char* names[] = { "none", "fsync", "group" };
+    cout << "mode " << names[journal.mode];
+    if ( journal.mode == Journal::GROUP ) cout << " " << journal.windowMs << "ms " << journal.batch;
+    cout << "  records " << journal.records << "  syncs " << journal.syncs
+         << "  file " << journal.size() << " bytes  seq " << journalSeq << endl;
+    return 0;
+  }
+  if ( tok[1] == "none" ) journal.mode = Journal::NONE;
+  else if ( tok[1] == "fsync" ) journal.mode = Journal::FSYNC;
+  else if ( tok[1] == "group" ) {
+    journal.mode = Journal::GROUP;
+    if ( tok.size() > 2 ) journal.windowMs = max( 0, atoi( tok[2].c_str() ) );
+    if ( tok.size() > 3 ) journal.batch = max( 1, atoi( tok[3].c_str() ) );
+  }
+  else if ( tok[1] == "sync" ) return journal.sync() ? 0 : -1;
+  else {
+    cerr << "journal: usage: journal [none | fsync | group [ms [batch]] | sync]\n";
+    return -1;
+  }
+  journal.sync();
+  return 0;
+}
 
 int exit( Args tok ) {
-   preserve(root, "");
+  // Everything since the last checkpoint is in the journal already.
+  if ( journal.isOpen() ) journal.sync();
+  else checkpoint();
   _exit(0);
 }
 
@@ -1180,81 +3724,430 @@ int exit( Args tok ) {
 
 map<string, App*> apps = {
   pair<const string, App*>("ls", ls),
-  pair<const string, App*>("mkdir", mkdir),
-  pair<const string, App*>("rmdir", rmdir),
+  pair<const string, App*>("mkdir", journaled<mkdir>),
+  pair<const string, App*>("rmdir", journaled<rmdir>),
   pair<const string, App*>("exit", exit),
   pair<const string, App*>("rm", rm),
   pair<const string, App*>("cd", cd),
-  pair<const string, App*>("touch", touch),
+  pair<const string, App*>("touch", journaled<touch>),
   pair<const string, App*>("pwd", pwd),
   pair<const string, App*>("tree", tree),
+  pair<const string, App*>("du", du),
   pair<const string, App*>("echo", echo),
   pair<const string, App*>("cat", cat),
   pair<const string, App*>("wc", wc),
-  pair<const string, App*>("write", write),
-  pair<const string, App*>("read", read),
-  pair<const string, App*>("mv", mv),
-  pair<const string, App*>("cp", cp),
+  pair<const string, App*>("write", writeApp),
+  pair<const string, App*>("read", readApp),
+  pair<const string, App*>("open", openApp),
+  pair<const string, App*>("close", closeApp),
+  pair<const string, App*>("lseek", lseekApp),
+  pair<const string, App*>("pread", pread),
+  pair<const string, App*>("pwrite", journaled<pwrite>),
+  pair<const string, App*>("truncate", journaled<truncate>),
+  pair<const string, App*>("mv", journaled<mv>),
+  pair<const string, App*>("cp", journaled<cp>),
   pair<const string, App*>("save", save),
+  pair<const string, App*>("journal", journalApp),
+  pair<const string, App*>("dcache", dcacheApp),
+  pair<const string, App*>("mem", mem),
+  pair<const string, App*>("query", query),
+  pair<const string, App*>("find", find),
+  pair<const string, App*>("grep", grep),
 //  pair<const string, App*>("ioRedirect", ioRedirect)
   
 };  // app maps mames to their implementations.
 
+// Commands side by side.  runCommand() runs an app as a command that
+// commands on other threads may be running alongside.  Most commands
+// read or change the entries of a few directories named by their
+// paths; such a command holds treeLock shared and, for each path, the
+// locks of the directories it goes through (shared), of the directory
+// whose entry it names (alone, if it changes entries), and for ls,
+// tree, du and find, or a directory mv or cp puts something in, of the
+// directory it names.  Any other command (cd, rmdir, save, those on
+// descriptors, mv or cp of a directory, ...) takes treeLock alone and
+// has the tree to itself.  So while treeLock is shared no directory is
+// moved or freed, and a directory's depth stays put.
+//
+// Directory locks are taken in lockOrder(): by depth, then inode
+// number.  Walks go down the tree and so keep to it as well.  Paths
+// are resolved before the locks are taken, with lookup(), which takes
+// none, and again once they are held; if they now lead elsewhere, the
+// locks are let go and the command starts over.  A command runs inside
+// an EpochGuard, so that what it looked up without a lock (a file
+// another command removes meanwhile, say) stays allocated until it is
+// done; what commands retire is freed as each one ends.
+RWLock treeLock;
+
+uint64_t lockOrder( Inode<Directory>* d ) {
+  uint64_t depth = 0;
+  for ( Inode<Directory>* p = d->parent; p; p = p->parent ) ++depth;
+  return depth << 32 | uint32_t( d->idnum );
+}
+
+// Adds to locks what resolving path as SetUp does takes, as above;
+// change is set if the command changes the entry the path names, into
+// if it uses the directory the path names.  Returns what that is, or
+// 0.
+InodeBase* planPath( const string& path, LockSet& locks, bool change, bool into ) {
+  if ( path == "" ) return 0;
+  vector<string> v = split( path, "/" );
+  string last = v.back();
+  v.pop_back();
+  Inode<Directory>* ind = ( v.size() && v[0] == "" ? root : wdi );
+  for ( auto& seg : v ) {
+    if ( seg == "" || seg == "." ) continue;
+    locks.add( ind->file->lock, lockOrder( ind ), false );
+    if ( seg == ".." ) {
+      if ( ind->parent ) ind = ind->parent;
+      continue;
+    }
+    InodeBase* next = lookup( ind, seg );
+    if ( ! next ) continue;                    // SetUp goes on from ind.
+    ind = as<Directory>( next );
+    if ( ! ind ) return 0;
+  }
+  locks.add( ind->file->lock, lockOrder( ind ), change );
+  InodeBase* b = ( last == "" ? ind : lookup( ind, last ) );
+  if ( ! b && last == "." ) b = ind;
+  if ( ! b && last == ".." ) b = ind->parent ? ind->parent : root;
+  Inode<Directory>* d = as<Directory>( b );
+  if ( d && into ) locks.add( d->file->lock, lockOrder( d ), change );
+  return b;
+}
+
+// Adds the locks tok needs to locks, and sets rows to the number of
+// inodes it may make; false if it has to have the tree to itself.
+bool planCommand( Args tok, LockSet& locks, size_t& rows ) {
+  const string cmd = tok[0];
+  rows = 0;
+  auto drop = [&]( const string& opt ) {
+    for ( size_t i = 1; i < tok.size(); )
+      if ( tok[i] == opt ) tok.erase( tok.begin() + i );
+      else ++i;
+  };
+  auto leading = [&]() {                // leading options; cat's take values.
+    size_t i = 1;
+    while ( i < tok.size() && tok[i].size() > 1 && tok[i][0] == '-' ) i += ( tok[i] == "-o" || tok[i] == "-c" ) ? 2 : 1;
+    tok.erase( tok.begin() + 1, tok.begin() + min( i, tok.size() ) );
+  };
+  auto all = [&]( bool change, bool into ) {
+    for ( size_t i = 1; i < tok.size(); ++i ) planPath( tok[i], locks, change, into );
+  };
+  auto here = [&]() { locks.add( wdi->file->lock, lockOrder( wdi ), false ); };
+  if ( cmd == "pwd" ) return true;
+  if ( cmd == "ls" || cmd == "tree" || cmd == "du" ) {
+    drop( "-s" );
+    drop( "-n" );
+    for ( size_t i = 1; cmd == "tree" && i < tok.size(); ++i )
+      if ( tok[i] == "-L" ) tok.erase( tok.begin() + i, tok.begin() + min( i + 2, tok.size() ) );
+    if ( tok.size() < 2 ) here();
+    else planPath( tok[1], locks, false, true );
+    return true;
+  }
+  if ( cmd == "find" ) {
+    size_t end = 1;
+    while ( end < tok.size() && tok[end] != "!" && tok[end] != "(" && ( tok[end].size() < 2 || tok[end][0] != '-' ) ) ++end;
+    if ( end > 2 || std::find( tok.begin(), tok.end(), "-newer" ) != tok.end() ) return false;
+    if ( end == 1 ) here();
+    else planPath( tok[1], locks, false, true );
+    return true;
+  }
+  if ( cmd == "cat" || cmd == "wc" ) {
+    leading();
+    all( false, false );
+    return true;
+  }
+  if ( cmd == "read" || cmd == "write" ) {
+    drop( "-q" );
+    if ( tok.size() > 1 && tok[1] == "-d" ) return false;
+  }
+  if ( cmd == "read" || cmd == "pread" || cmd == "write" || cmd == "pwrite" || cmd == "truncate" ) {
+    if ( tok.size() > 1 ) planPath( tok[1], locks, cmd != "read" && cmd != "pread", false );
+    rows = cmd == "write";
+    return true;
+  }
+  if ( cmd == "mkdir" || cmd == "touch" || cmd == "rm" ) {
+    drop( "-f" );
+    all( true, false );
+    rows = tok.size();
+    return true;
+  }
+  if ( cmd == "mv" || cmd == "cp" ) {
+    drop( "-p" );
+    drop( "-r" );
+    drop( "-R" );
+    if ( tok.size() < 3 ) return true;
+    InodeBase* src = planPath( tok[1], locks, cmd == "mv", false );
+    if ( src && src->kind == Kind::dir ) return false;
+    Inode<Directory>* into = as<Directory>( planPath( tok[2], locks, true, true ) );
+    // Putting it in a directory replaces an entry of the same name,
+    // which if a directory goes with all below it.
+    if ( src && into && as<Directory>( lookup( into, src->name ) ) ) return false;
+    rows = 1;
+    return true;
+  }
+  return false;
+}
 
+// Runs app on tok with treeLock shared, if it can be; false, having
+// run nothing, if it has to start over or, with alone set, have the
+// tree to itself.
+bool runShared( App* app, const Args& tok, int& status, bool& alone ) {
+  treeLock.lockShared();
+  bool ran = false;
+  {
+    EpochGuard g;
+    LockSet locks, again;
+    size_t rows, more;
+    alone = ! planCommand( tok, locks, rows ) || ! inodeTable.claim( rows );
+    if ( ! alone ) {
+      locks.acquire();
+      alone = ! planCommand( tok, again, more );
+      if ( ! alone && locks.covers( again ) ) {
+        status = app( tok );
+        ran = true;
+      }
+      locks.release();
+      inodeTable.unclaim( rows );
+    }
+  }
+  // Still under treeLock, as what is freed comes out of inodeTable.
+  epochs.reclaim();
+  treeLock.unlock();
+  return ran;
+}
+
+int runCommand( App* app, Args tok ) {
+  int status = 0;
+  bool alone = false;
+  while ( ! alone )
+    if ( runShared( app, tok, status, alone ) ) return status;
+  treeLock.lock();
+  // Room for the rows that commands side by side will add.
+  if ( inodeTable.capacity() < inodeTable.rows() + inodeTable.rows() / 4 + 1024 )
+    inodeTable.reserve( inodeTable.rows() + 1024 );
+  status = app( tok );
+  epochs.reclaim();
+  treeLock.unlock();
+  return status;
+}
 
 
+
+
+// Runs the journaled commands numbered above after, quietly, each in
+// the directory and at the time it first ran.  Returns how many ran.
+long replayJournal( const vector<string>& records, uint64_t after ) {
+  streambuf* out = cout.rdbuf();
+  streambuf* err = cerr.rdbuf();
+  ostream null( 0 );
+  cout.rdbuf( null.rdbuf() );
+  cerr.rdbuf( null.rdbuf() );
+  replaying = true;
+  long ran = 0;
+  for ( auto& rec : records ) {
+    SnapReader r( rec.data(), rec.size() );
+    uint64_t seq = r.varint();
+    time_t t = r.varint();
+    string dir = r.str();
+    vector<string> tok( r.varint() );
+    for ( auto& s : tok ) s = r.str();
+    if ( ! r.ok || tok.empty() ) break;
+    if ( seq <= after ) continue;
+    journalSeq = seq;
+    auto app = apps.find( tok[0] );
+    if ( app == apps.end() ) continue;
+    if ( dir != wdi->path() && cd( Args{ "cd", dir } ) != 0 ) continue;
+    inodeTable.fixedNow = t;
+    app->second( tok );
+    ++ran;
+  }
+  inodeTable.fixedNow = 0;
+  if ( wdi != root ) cd( Args{ "cd", "/" } );
+  replaying = false;
+  cout.rdbuf( out );
+  cerr.rdbuf( err );
+  return ran;
+}
+
+bool importText( string file, LoadSummary* sum = 0 );
+
 void FSInit(string file){
   root->file = new Directory;   // OOPS!!! review this.
+  root->file->current = root;
+  ++wdi->openCount;                    // held by the working directory.
   Directory* appdir = new Directory(); //Update to put apps in a directory
   root->file->mk("bin", appdir); //Update to put apps in a directory
-  appdir->parent = root; //Update to put apps in a directory
-  appdir->current = dynamic_cast<Inode<Directory>*>(root->file->theMap["bin"]); //Update to put apps in a directory
+  appdir->current = as<Directory>(root->file->theMap["bin"]); //Update to put apps in a directory
   
   for( auto it : apps ) {
     //Inode<App>* temp(new Inode<App>(ls));
     //InodeBase* junk = static_cast<InodeBase*>(temp);
     //    InodeBase* junk = temp;
-    dynamic_cast<Inode<Directory>*>(	wd()->theMap["bin"])->file->theMap[it.first] = new Inode<App>(it.second);
-    ++wd()->theMap["bin"]->linkCount;
+    appdir->link( it.first, new Inode<App>(it.second) );
   }
   
   Directory* devdir = new Directory(); //Update to put devs in a directory
   root->file->mk("dev", devdir);//Update to put devss in a directory
-  devdir->parent = root; //Update to set dev devices parent as root
-  devdir -> current = dynamic_cast<Inode<Directory>*>(root->file->theMap["dev"]);
-  Inode<Directory>* r = root;
-  string line = "";
-  ifstream myfile (file);
-  if (myfile.is_open())
-  {
-    while ( getline (myfile,line) )
-    {
-      cout << line << '\n';
-      stringstream ss(line);             // split temp at white spaces.
-      vector<string> rfile;          // then get its cmd-line arguments.
-      string s;
-	    time_t c, m, a;
-      vector<string> filepaths;
-
-      filepaths = split(line,";");
-      c = atol(filepaths[2].c_str());
-      m = atol(filepaths[3].c_str());
-      a = atol(filepaths[4].c_str());
-      filepaths.erase (filepaths.begin()+2,filepaths.begin()+5); //remove a,m,c times
-      if(filepaths[0] == "dir") {
-        filepaths[0] = "mkdir";
-        mkdir( filepaths, c, m, a );
-      }
-      else if(filepaths[0] == "file") {
-        filepaths[0] = "write";
-        write( filepaths, c, m, a );
+  devdir -> current = as<Directory>(root->file->theMap["dev"]);
+  // The saved segments, if there are any, supersede a snapshot from
+  // before them, which supersedes the text file.
+  LoadSummary sum;
+  string from = SEGMENTS;
+  clock_t start = clock();
+  if ( loadSegments( &sum ) ) ;
+  else if ( loadSnapshot( SNAPSHOT, &sum ) ) from = SNAPSHOT;
+  else {
+    from = file;
+    if ( ! importText( file, &sum ) ) cout << "Unable to open " << file << endl;
+  }
+  // Then whatever was journaled after that image was taken.
+  vector<string> records;
+  if ( ! journal.open( JOURNAL, records ) ) cerr << "Unable to open " << JOURNAL << "; changes will be saved on exit only\n";
+  journalSeq = sum.seq;
+  long replayed = replayJournal( records, sum.seq );
+  if ( records.size() && ! replayed ) journal.reset();     // all in the image.
+  cout << from << ": " << sum.dirs << " directories, " << sum.files << " files, "
+       << sum.bytes << " bytes";
+  if ( replayed ) cout << " + " << replayed << " journaled commands";
+  cout << " loaded in " << ( clock() - start ) * 1000 / CLOCKS_PER_SEC << " ms";
+  if ( sum.skipped ) cout << " (" << sum.skipped << " lines skipped)";
+  cout << endl;
+}
+
+// The directory at an absolute path, found by walking from the root
+// without SetUp or the dentry cache; 0 if there is none.
+Inode<Directory>* dirAt( const string& path ) {
+  Inode<Directory>* d = root;
+  size_t at = 0;
+  while ( d && at < path.size() ) {
+    size_t next = path.find( '/', at );
+    if ( next == string::npos ) next = path.size();
+    if ( next > at ) {
+      auto it = d->file->theMap.find( path.substr( at, next - at ) );
+      d = ( it == d->file->theMap.end() ? 0 : as<Directory>( it->second ) );
+    }
+    at = next + 1;
+  }
+  return d;
+}
+
+// Puts the entries of a text or compressed image into the tree.  Both
+// list each directory before its contents, so the loader keeps the
+// chain of directories leading to the last one it made and finds an
+// entry's parent by popping back along it.  Only an entry out of that
+// order costs a walk from the root.
+struct ImageLoader {
+  vector< pair<string, Inode<Directory>*> > open;
+  LoadSummary* sum;
+
+  ImageLoader( LoadSummary* sum ) : open( 1, make_pair( string(), root ) ), sum(sum) {}
+
+  // Makes the entry at path; a file gets contents data[0, len).
+  void place( bool isDir, const string& path, time_t c, time_t m, time_t a,
+              const char* data = 0, size_t len = 0 ) {
+    size_t slash = path.rfind( '/' );
+    if ( slash == string::npos || slash + 1 == path.size() ) {
+      ++sum->skipped;
+      return;
+    }
+    string parentPath = path.substr( 0, slash );
+    string name = path.substr( slash + 1 );
+    while ( open.size() > 1 && open.back().first != parentPath ) open.pop_back();
+    Inode<Directory>* parent = open.back().first == parentPath ? open.back().second : dirAt( parentPath );
+    if ( ! parent ) {
+      ++sum->skipped;
+      return;
+    }
+    InodeBase* x;
+    auto it = parent->file->theMap.find( name );
+    InodeBase* old = ( it == parent->file->theMap.end() ? 0 : it->second );
+    if ( isDir ) {
+      x = as<Directory>( old );                  // e.g. /dev, made above.
+      if ( ! x && old ) {
+        ++sum->skipped;
+        return;
       }
-      else {
+      if ( ! x ) {
+        x = new Inode<Directory>( new Directory );
+        parent->file->link( name, x );
       }
+      open.push_back( make_pair( path, static_cast<Inode<Directory>*>(x) ) );
+      ++sum->dirs;
+    }
+    else {
+      File* contents = new File;
+      contents->pwrite( data, len, 0 );
+      x = new Inode<File>( contents );
+      parent->file->link( name, x );
+      ++sum->files;
+      sum->bytes += contents->size();
+    }
+    x->updateTime( c, m, a );
+  }
+};
+
+// Loads a compressed image, a block at a time; records may run on
+// from one block into the next.
+bool importCompressed( istream& in, LoadSummary* sum ) {
+  ImageLoader loader( sum );
+  LZReader z( in );
+  string buf, block, path;
+  size_t at = 0;
+  while ( z.next( block ) ) {
+    buf.erase( 0, at );
+    buf += block;
+    at = 0;
+    for (;;) {
+      SnapReader r( buf.data() + at, buf.size() - at );
+      Kind kind = Kind( r.byte() );
+      size_t same = r.varint();
+      size_t rest = r.varint();
+      const char* tail = r.bytes( rest );
+      time_t c = r.varint();
+      time_t m = c + r.zigzag();
+      time_t a = c + r.zigzag();
+      size_t len = kind == Kind::file ? r.varint() : 0;
+      const char* data = r.bytes( len );
+      if ( ! r.ok ) break;                      // the rest is in the next block.
+      path.resize( min( same, path.size() ) );
+      path.append( tail, rest );
+      if ( kind == Kind::dir || kind == Kind::file ) loader.place( kind == Kind::dir, path, c, m, a, data, len );
+      else ++sum->skipped;
+      at = buf.size() - r.left();
+    }
+  }
+  if ( ! z.ok || at != buf.size() ) cerr << "compressed image is damaged; loaded what came before\n";
+  return true;
+}
+
+// Loads a file in the text format that preserve() writes:
+//   dir;path;ctime;mtime;atime   or   file;path;ctime;mtime;atime;contents
+// Contents run to the end of the line, ';'s and all.  A compressed
+// image is told by its magic.
+bool importText( string file, LoadSummary* sum ) {
+  ifstream in( file, ios::binary );
+  if ( ! in ) return false;
+  LoadSummary ignored;
+  if ( ! sum ) sum = &ignored;
+  if ( LZReader::sniff( in ) ) return importCompressed( in, sum );
+  ImageLoader loader( sum );
+  string line;
+  while ( getline( in, line ) ) {
+    size_t f[5];                       // where the first five ';' are.
+    int n = 0;
+    for ( size_t p = 0; n < 5 && ( p = line.find( ';', p ) ) != string::npos; ++p ) f[n++] = p;
+    bool isDir = line.compare( 0, 4, "dir;" ) == 0, isFile = line.compare( 0, 5, "file;" ) == 0;
+    if ( ! ( isDir || ( isFile && n == 5 ) ) || n < 4 ) {
+      ++sum->skipped;
+      continue;
     }
-    myfile.close();
+    loader.place( isDir, line.substr( f[0] + 1, f[1] - f[0] - 1 ),
+                  atol( line.c_str() + f[1] + 1 ), atol( line.c_str() + f[2] + 1 ), atol( line.c_str() + f[3] + 1 ),
+                  isFile ? line.data() + f[4] + 1 : 0, isFile ? line.size() - f[4] - 1 : 0 );
   }
-  else cout << "Unable to open file"; 
+  return true;
 }
 
 }
@@ -0,0 +1,177 @@
+// Inode metadata kept in columns.  Every inode's idnum indexes one
+// row, and each field lives in its own contiguous array, so a scan
+// such as "files modified since T" reads just the columns it tests
+// instead of chasing pointers through the tree.  Rows of freed inodes
+// are marked FREE in the kind column and their ids reused.
+//
+// Select() and the filters after it build a selection over all rows
+// with one branch-free pass per predicate, which the compiler turns
+// into vector code.
+//
+// Rows are added and removed under a mutex.  Readers index the columns
+// without one, so while commands run side by side the columns must not
+// move: each such command claim()s beforehand the rows it may add (see
+// runCommand() in filesystem.h).
+
+#ifndef FILESYSTEM_INODETABLE_H
+#define FILESYSTEM_INODETABLE_H
+
+#include <vector>
+#include <ctime>
+#include <cstdint>
+#include <cassert>
+#include <mutex>
+#include <algorithm>
+
+using namespace std;
+namespace filesystem {
+
+class InodeBase;
+
+class InodeTable {
+public:
+  typedef int64_t Time;
+  static const unsigned char FREE = 0xff;   // kind of an unused row.
+
+  vector<Time> aTime, mTime, cTime;
+  vector<int64_t> size;
+  vector<unsigned char> kind;
+  vector<int32_t> parent;                   // parent's id, or -1.
+  vector<InodeBase*> inode;
+
+  // For directories, what an incremental save has to write: DIRTY if
+  // the directory's own record is stale, DIRTY_BELOW if some directory
+  // under it is.  New rows start DIRTY.
+  enum { DIRTY = 1, DIRTY_BELOW = 2 };
+  vector<unsigned char> dirty;
+
+private:
+  vector<int32_t> freeIds;
+  mutex rowLock;
+  size_t claimed = 0;               // rows promised to running commands.
+
+public:
+  size_t live = 0;
+
+  size_t rows() const { return kind.size(); }
+
+  // The time stamped on rows.  Journal replay sets fixedNow so that a
+  // replayed command leaves the times it left when it first ran.
+  Time fixedNow = 0;
+  Time now() const { return fixedNow ? fixedNow : time(0); }
+
+  int32_t add( unsigned char k, InodeBase* x ) {
+    Time now = this->now();
+    lock_guard<mutex> hold( rowLock );
+    int32_t id;
+    if ( freeIds.size() ) {
+      id = freeIds.back();
+      freeIds.pop_back();
+      aTime[id] = mTime[id] = cTime[id] = now;
+      size[id] = 0;
+      kind[id] = k;
+      parent[id] = -1;
+      inode[id] = x;
+      dirty[id] = DIRTY;
+    } else {
+      id = kind.size();
+      aTime.push_back(now);  mTime.push_back(now);  cTime.push_back(now);
+      size.push_back(0);
+      kind.push_back(k);
+      parent.push_back(-1);
+      inode.push_back(x);
+      dirty.push_back(DIRTY);
+    }
+    ++live;
+    return id;
+  }
+
+  // Makes room for n more rows, so that adding them moves no column.
+  void reserve( size_t n ) {
+    size_t want = kind.size() + n;
+    aTime.reserve( want );  mTime.reserve( want );  cTime.reserve( want );
+    size.reserve( want );
+    kind.reserve( want );
+    parent.reserve( want );
+    inode.reserve( want );
+    dirty.reserve( want );
+  }
+
+  // Rows that can be added without moving any column.
+  size_t capacity() const {
+    return min( { aTime.capacity(), mTime.capacity(), cTime.capacity(), size.capacity(),
+                  kind.capacity(), parent.capacity(), inode.capacity(), dirty.capacity() } );
+  }
+
+  // Promises room for n more rows, if there is room; unclaim() takes
+  // the promise back once the rows have been added (or not).
+  bool claim( size_t n ) {
+    lock_guard<mutex> hold( rowLock );
+    if ( kind.size() + claimed + n > capacity() ) return false;
+    claimed += n;
+    return true;
+  }
+  void unclaim( size_t n ) {
+    lock_guard<mutex> hold( rowLock );
+    claimed -= n;
+  }
+
+  void remove( int32_t id ) {
+    lock_guard<mutex> hold( rowLock );
+    assert( kind[id] != FREE );
+    kind[id] = FREE;
+    parent[id] = -1;
+    inode[id] = 0;
+    freeIds.push_back(id);
+    --live;
+  }
+
+  // A selection: one byte per row, nonzero where the row qualifies.
+  typedef vector<unsigned char> Selection;
+
+  // Every live row.
+  Selection select() const {
+    size_t n = rows();
+    Selection s( n );
+    const unsigned char* k = kind.data();
+    unsigned char* o = s.data();
+    for ( size_t i = 0; i < n; ++i ) o[i] = k[i] != FREE;
+    return s;
+  }
+
+  // Keeps the rows whose kind is k.
+  void whereKind( Selection& s, unsigned char k ) const {
+    size_t n = rows();
+    const unsigned char* c = kind.data();
+    unsigned char* o = s.data();
+    for ( size_t i = 0; i < n; ++i ) o[i] &= c[i] == k;
+  }
+
+  // Keeps the rows with lo <= col[i] <= hi.
+  template< typename C >
+  void whereBetween( Selection& s, const vector<C>& col, C lo, C hi ) const {
+    size_t n = rows();
+    const C* c = col.data();
+    unsigned char* o = s.data();
+    for ( size_t i = 0; i < n; ++i ) o[i] &= ( c[i] >= lo ) & ( c[i] <= hi );
+  }
+
+  size_t count( const Selection& s ) const {
+    size_t n = 0;
+    for ( size_t i = 0; i < s.size(); ++i ) n += s[i] != 0;
+    return n;
+  }
+
+  // The ids of the selected rows, in id order.
+  vector<int32_t> ids( const Selection& s ) const {
+    vector<int32_t> v;
+    for ( size_t i = 0; i < s.size(); ++i ) if ( s[i] ) v.push_back(i);
+    return v;
+  }
+};
+
+InodeTable inodeTable;            // single instance for the whole tree.
+
+}
+
+#endif
@@ -0,0 +1,161 @@
+// An append-only journal of the commands that change the tree, so
+// that nothing between two snapshots is lost and saving doesn't have
+// to rewrite the whole image.  The file is the magic "FSJRNL"
+// followed by records, each
+//   varint length, payload, 8-byte little-endian FNV-1a of the payload.
+// A record that is cut short or fails its checksum ends the journal;
+// a crash in the middle of an append loses only that record.
+//
+// How soon a record reaches the disk depends on the mode:
+//   NONE   written to the file at once, never fsync'ed by us;
+//   FSYNC  fsync'ed before the command runs;
+//   GROUP  fsync'ed when a batch of records fills, or when a record
+//          is appended after the oldest unsynced one has waited the
+//          time window, and on sync().  Nothing watches the clock in
+//          between, so after the last command the tail waits for the
+//          next append, journal sync, a checkpoint or exit.
+
+#ifndef FILESYSTEM_JOURNAL_H
+#define FILESYSTEM_JOURNAL_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+using namespace std;
+namespace filesystem {
+
+const char JOURNAL_MAGIC[] = "FSJRNL";
+
+class Journal {
+  int fd = -1;
+  string path;
+  size_t pending = 0;                     // appended since the last fsync.
+  chrono::steady_clock::time_point firstPending;
+
+  bool writeAll( const char* p, size_t n ) {
+    while ( n ) {
+      ssize_t w = ::write( fd, p, n );
+      if ( w < 0 ) return false;
+      p += w;
+      n -= w;
+    }
+    return true;
+  }
+
+public:
+  enum Mode { NONE, FSYNC, GROUP };
+  Mode mode = GROUP;
+  int windowMs = 50;                      // GROUP: age that forces an fsync at the next append,
+  size_t batch = 64;                      // and most records per fsync.
+  uint64_t records = 0, bytes = 0, syncs = 0;
+
+  bool isOpen() const { return fd >= 0; }
+
+  // Opens the journal at p for appending, first reading the payloads of
+  // its intact records into out.  Anything after the last intact record
+  // is cut off so that new records follow it directly.
+  bool open( const string& p, vector<string>& out ) {
+    close();
+    path = p;
+    fd = ::open( p.c_str(), O_RDWR | O_CREAT, 0644 );
+    if ( fd < 0 ) return false;
+    string data;
+    char chunk[64 * 1024];
+    ssize_t n;
+    while ( ( n = ::read( fd, chunk, sizeof chunk ) ) > 0 ) data.append( chunk, n );
+    size_t good = 6;
+    if ( data.size() >= 6 && data.compare( 0, 6, JOURNAL_MAGIC ) == 0 ) {
+      SnapReader r( data.data() + 6, data.size() - 6 );
+      while ( r.left() ) {
+        size_t len = r.varint();
+        const char* q = r.bytes( len );
+        const char* s = r.bytes( 8 );
+        if ( ! s ) break;
+        uint64_t sum = 0;
+        for ( int i = 0; i < 8; ++i ) sum |= uint64_t( (unsigned char)s[i] ) << ( 8 * i );
+        if ( sum != fnv64( q, len ) ) break;
+        out.push_back( string( q, len ) );
+        good = data.size() - r.left();
+      }
+    }
+    else if ( ftruncate( fd, 0 ) != 0 || ! writeAll( JOURNAL_MAGIC, 6 ) ) return false;
+    if ( good < data.size() && ftruncate( fd, good ) != 0 ) return false;
+    lseek( fd, 0, SEEK_END );
+    return true;
+  }
+
+  // Appends one record and makes it as durable as the mode asks.
+  bool append( const string& payload ) {
+    if ( fd < 0 ) return false;
+    SnapWriter w;
+    w.str( payload );
+    uint64_t sum = fnv64( payload.data(), payload.size() );
+    for ( int i = 0; i < 8; ++i ) w.byte( sum >> ( 8 * i ) );
+    if ( ! writeAll( w.buf.data(), w.buf.size() ) ) return false;
+    ++records;
+    bytes += w.buf.size();
+    if ( mode == FSYNC ) return sync();
+    if ( mode == GROUP ) {
+      if ( ! pending++ ) firstPending = chrono::steady_clock::now();
+      if ( pending >= batch || chrono::steady_clock::now() - firstPending >= chrono::milliseconds( windowMs ) )
+        return sync();
+    }
+    return true;
+  }
+
+  // Forces everything appended so far to disk.
+  bool sync() {
+    if ( fd < 0 ) return false;
+    pending = 0;
+    ++syncs;
+    return fdatasync( fd ) == 0;
+  }
+
+  // Empties the journal once its records are in a checkpoint.
+  bool reset() {
+    if ( fd < 0 ) return false;
+    pending = 0;
+    return ftruncate( fd, 6 ) == 0 && lseek( fd, 0, SEEK_END ) == 6 && fsync( fd ) == 0;
+  }
+
+  // Drops the records before offset upTo, which a checkpoint now
+  // holds, keeping those appended since by copying them to a new file
+  // that replaces this one.
+  bool trim( off_t upTo ) {
+    off_t end = size();
+    if ( upTo >= end ) return reset();
+    if ( fd < 0 || upTo < 6 ) return false;
+    string tail( end - upTo, 0 );
+    if ( pread( fd, &tail[0], tail.size(), upTo ) != ssize_t( tail.size() ) ) return false;
+    string tmp = path + ".tmp";
+    int nfd = ::open( tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if ( nfd < 0 ) return false;
+    swap( fd, nfd );
+    bool ok = writeAll( JOURNAL_MAGIC, 6 ) && writeAll( tail.data(), tail.size() )
+           && fsync( fd ) == 0 && ::rename( tmp.c_str(), path.c_str() ) == 0;
+    if ( ! ok ) swap( fd, nfd );               // keep the old journal.
+    ::close( nfd );
+    pending = 0;
+    return ok;
+  }
+
+  off_t size() const {
+    struct stat st;
+    return fd >= 0 && fstat( fd, &st ) == 0 ? st.st_size : 0;
+  }
+
+  void close() {
+    if ( fd >= 0 ) ::close( fd );
+    fd = -1;
+    pending = 0;
+  }
+};
+
+}
+
+#endif
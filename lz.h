@@ -0,0 +1,267 @@
+// A small LZ77 codec for compressed images, in the manner of LZ4.
+// Data is cut into blocks of at most LZ_BLOCK bytes, and a block only
+// refers back into itself, so each one decodes on its own and a reader
+// can stream a file a block at a time.  A compressed block is a run of
+// sequences, each
+//   token: literal count in the high 4 bits, match length - 4 in the
+//          low 4; a field of 15 goes on in bytes that follow (255
+//          means add it and read another);
+//   the literals;
+//   2-byte little-endian distance back to the match, and the rest of
+//   the match length if any.
+// The last sequence has literals only.
+//
+// A stream is the magic "FSLZ01", then its blocks, each
+//   byte 1 (compressed) or 2 (stored as is), varint raw length,
+//   varint stored length, the stored bytes, 8-byte FNV-1a of them,
+// and a 0 byte to end it.
+
+#ifndef FILESYSTEM_LZ_H
+#define FILESYSTEM_LZ_H
+
+#include <string>
+#include <cstring>
+#include <iostream>
+#include "snapshot.h"
+
+using namespace std;
+namespace filesystem {
+
+const char LZ_MAGIC[] = "FSLZ01";
+const size_t LZ_BLOCK = 64 * 1024;           // distances fit in 16 bits.
+
+inline uint32_t lzRead32( const char* p ) {
+  uint32_t v;
+  memcpy( &v, p, 4 );
+  return v;
+}
+
+inline uint32_t lzHash( uint32_t v ) { return ( v * 2654435761u ) >> ( 32 - 14 ); }
+
+inline void lzLength( string& out, size_t n ) {
+  for ( ; n >= 255; n -= 255 ) out.push_back( char(255) );
+  out.push_back( char(n) );
+}
+
+inline void lzSequence( string& out, const char* lit, size_t nlit, size_t dist, size_t len ) {
+  size_t t = out.size();
+  out.push_back( 0 );
+  if ( nlit >= 15 ) lzLength( out, nlit - 15 );
+  out.append( lit, nlit );
+  unsigned char token = ( nlit < 15 ? nlit : 15 ) << 4;
+  if ( len ) {
+    out.push_back( char( dist ) );
+    out.push_back( char( dist >> 8 ) );
+    len -= 4;
+    if ( len >= 15 ) lzLength( out, len - 15 );
+    token |= ( len < 15 ? len : 15 );
+  }
+  out[t] = token;
+}
+
+// Appends the compressed form of in[0, n), n <= LZ_BLOCK, to out.
+void lzCompress( const char* in, size_t n, string& out ) {
+  uint16_t table[ 1 << 14 ];                 // hash of 4 bytes -> where.
+  memset( table, 0, sizeof table );
+  const char* ip = in;
+  const char* anchor = in;                   // first byte not yet out.
+  const char* end = in + n;
+  const char* limit = n > 12 ? end - 12 : in;  // no match starts after;
+  const char* matchEnd = end - 5;            // the last 5 are literals.
+  while ( ip < limit ) {
+    uint32_t h = lzHash( lzRead32( ip ) );
+    const char* ref = in + table[h];
+    table[h] = ip - in;
+    if ( ref >= ip || lzRead32( ref ) != lzRead32( ip ) ) {
+      ip += 1 + ( ( ip - anchor ) >> 6 );    // skip faster through noise.
+      continue;
+    }
+    while ( ip > anchor && ref > in && ip[-1] == ref[-1] ) {
+      --ip;
+      --ref;
+    }
+    const char* p = ip + 4;
+    const char* q = ref + 4;
+    for (;;) {                               // 8 bytes at a time.
+      if ( p + 8 > matchEnd ) {
+        while ( p < matchEnd && *p == *q ) ++p, ++q;
+        break;
+      }
+      uint64_t a, b;
+      memcpy( &a, p, 8 );
+      memcpy( &b, q, 8 );
+      if ( a != b ) {
+        p += __builtin_ctzll( a ^ b ) >> 3;
+        break;
+      }
+      p += 8;
+      q += 8;
+    }
+    lzSequence( out, anchor, ip - anchor, ip - ref, p - ip );
+    ip = anchor = p;
+    if ( ip - 2 >= in && ip < limit ) table[ lzHash( lzRead32( ip - 2 ) ) ] = ip - 2 - in;
+  }
+  lzSequence( out, anchor, end - anchor, 0, 0 );
+}
+
+// Decodes in[0, n) into exactly raw bytes at out; false if the block
+// is malformed.  Never reads or writes out of bounds.
+bool lzDecompress( const char* in, size_t n, char* out, size_t raw ) {
+  const unsigned char* ip = (const unsigned char*)in;
+  const unsigned char* iend = ip + n;
+  char* op = out;
+  char* oend = out + raw;
+  while ( ip < iend ) {
+    unsigned token = *ip++;
+    size_t lit = token >> 4;
+    if ( lit == 15 ) {
+      unsigned char b;
+      do {
+        if ( ip == iend ) return false;
+        lit += b = *ip++;
+      } while ( b == 255 );
+    }
+    if ( lit > size_t( iend - ip ) || lit > size_t( oend - op ) ) return false;
+    if ( iend - ip >= 16 && oend - op >= 16 && lit <= 16 ) memcpy( op, ip, 16 );  // past lit is rewritten.
+    else memcpy( op, ip, lit );
+    op += lit;
+    ip += lit;
+    if ( ip == iend ) break;                 // the last sequence.
+    if ( iend - ip < 2 ) return false;
+    size_t dist = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t len = token & 15;
+    if ( len == 15 ) {
+      unsigned char b;
+      do {
+        if ( ip == iend ) return false;
+        len += b = *ip++;
+      } while ( b == 255 );
+    }
+    len += 4;
+    if ( dist == 0 || dist > size_t( op - out ) || len > size_t( oend - op ) ) return false;
+    const char* ref = op - dist;
+    if ( dist >= 8 && size_t( oend - op ) >= len + 8 )
+      for ( size_t i = 0; i < len; i += 8 ) memcpy( op + i, ref + i, 8 );
+    else for ( size_t i = 0; i < len; ++i ) op[i] = ref[i];   // overlaps.
+    op += len;
+  }
+  return op == oend;
+}
+
+// Compresses what is written to it onto out, a block at a time.
+class LZWriter {
+  ostream& out;
+  string block, packed;
+public:
+  uint64_t raw = 0, stored = 0;
+
+  LZWriter( ostream& o ) : out(o) {
+    out.write( LZ_MAGIC, 6 );
+    stored = 6;
+    block.reserve( LZ_BLOCK );
+  }
+
+  void write( const char* p, size_t n ) {
+    while ( n ) {
+      size_t k = min( n, LZ_BLOCK - block.size() );
+      block.append( p, k );
+      p += k;
+      n -= k;
+      if ( block.size() == LZ_BLOCK ) flush();
+    }
+  }
+  void write( const string& s ) { write( s.data(), s.size() ); }
+
+  void flush() {
+    if ( block.empty() ) return;
+    packed.clear();
+    lzCompress( block.data(), block.size(), packed );
+    bool lz = packed.size() < block.size();
+    const string& data = lz ? packed : block;
+    SnapWriter h;
+    h.byte( lz ? 1 : 2 );
+    h.varint( block.size() );
+    h.varint( data.size() );
+    uint64_t sum = fnv64( data.data(), data.size() );
+    for ( int i = 0; i < 8; ++i ) h.byte( sum >> ( 8 * i ) );
+    out.write( h.buf.data(), h.buf.size() - 8 );
+    out.write( data.data(), data.size() );
+    out.write( h.buf.data() + h.buf.size() - 8, 8 );
+    raw += block.size();
+    stored += h.buf.size() + data.size();
+    block.clear();
+  }
+
+  void close() {
+    flush();
+    out.put( 0 );
+    ++stored;
+  }
+};
+
+// Reads back what an LZWriter wrote, a block at a time.
+class LZReader {
+  istream& in;
+  string packed;
+
+  uint64_t varint() {
+    uint64_t v = 0;
+    for ( int shift = 0; shift < 64; shift += 7 ) {
+      int b = in.get();
+      if ( b == EOF ) break;
+      v |= uint64_t( b & 0x7f ) << shift;
+      if ( ! ( b & 0x80 ) ) return v;
+    }
+    ok = false;
+    return 0;
+  }
+
+public:
+  bool ok = true;                            // false once damage is found.
+
+  // in should be positioned just after the magic.
+  LZReader( istream& i ) : in(i) {}
+
+  static bool sniff( istream& in ) {
+    char m[6];
+    in.read( m, 6 );
+    if ( in.gcount() == 6 && memcmp( m, LZ_MAGIC, 6 ) == 0 ) return true;
+    in.clear();
+    in.seekg( 0 );
+    return false;
+  }
+
+  // Decodes the next block into out.  False at the end of the stream,
+  // or, with ok false, if the stream is damaged or cut short.
+  bool next( string& out ) {
+    int type = in.get();
+    if ( type == 0 ) return false;
+    size_t raw = varint(), len = varint();
+    if ( ( type != 1 && type != 2 ) || ! ok || raw > LZ_BLOCK || len > LZ_BLOCK + LZ_BLOCK / 255 + 16 ) {
+      ok = false;
+      return false;
+    }
+    packed.resize( len + 8 );
+    in.read( &packed[0], len + 8 );
+    uint64_t sum = 0;
+    for ( int i = 0; i < 8; ++i ) sum |= uint64_t( (unsigned char)packed[ len + i ] ) << ( 8 * i );
+    if ( size_t( in.gcount() ) != len + 8 || sum != fnv64( packed.data(), len ) ) {
+      ok = false;
+      return false;
+    }
+    if ( type == 2 ) {
+      ok = len == raw;
+      out.assign( packed, 0, len );
+    }
+    else {
+      out.resize( raw );
+      ok = lzDecompress( packed.data(), len, &out[0], raw );
+    }
+    return ok;
+  }
+};
+
+}
+
+#endif
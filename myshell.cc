@@ -19,6 +19,7 @@
 #include "thread.h"
 #include <mutex>
 #include "filesystem.h"
+#include "checkpoint.h"
 
 using namespace filesystem;
 using namespace std;
@@ -35,22 +36,10 @@ void testCompleteMe(){
 */
 int doit( vector<string> tok );
 
-struct Devices{
-  int deviceNumber;
-  string driverName;
-};
-
-struct openFileTable{
-  Devices *ptr; //pointer to device
-  bool write;
-  bool read;
-};
-
-
+// Open files are kept per process by the filesystem; see FdTable.
 struct processTable{
     pid_t pid;
     pid_t *ppid;
-    openFileTable opfile[32];
    
     void setid(pid_t p, pid_t pp){pid = p; ppid = &pp;}
     void print(){
@@ -131,16 +120,17 @@ class shellThread : public Thread {
           if ( progname[0] == '~' ) progname = getenv("HOME")+progname.substr(1);
 //          execvp( progname.c_str(), arglist );         // execute the command.
 
-		  Inode<App>* junk = static_cast<Inode<App>*>((dynamic_cast<Inode<Directory>*>(root->file->theMap["bin"])->file->theMap)[tok[0]] ); //Update to put apps in a directory
+		  Inode<App>* junk = static_cast<Inode<App>*>( lookup( as<Directory>(lookup(root, "bin")), tok[0] ) ); //Update to put apps in a directory
 
 		    if ( ! junk ) {
-			  (dynamic_cast<Inode<Directory>*>(root->file->theMap["bin"])->file->theMap).erase(tok[0]);
 			  cerr << "shell: " << tok[0] << " command not found\n";
 			  continue;
 			}
 			App* thisApp = static_cast<App*>(junk->file);
 			if ( thisApp != 0 ) {
-			  thisApp(tok);          // if possible, apply cmd to its args.
+			  treeGate.enter();      // savers stay off the tree meanwhile.
+			  runCommand( thisApp, tok );  // if possible, apply cmd to its args.
+			  treeGate.leave();
 			  return;
 			} else { 
 			  cerr << "Instruction " << tok[0] << " not implemented.\n";
@@ -236,6 +226,8 @@ int doit( vector<string> tok ) {
 
 int main( int argc, char* argv[] ) {
 ///*
+  apps["save"] = backgroundSave;
+  apps["autosave"] = autosave;
   FSInit("info.txt");
   while ( ! cin.eof() ) {
     cout << "? " ;                                         // prompt.
@@ -0,0 +1,128 @@
+// Locks for commands that run side by side.  Each directory has an
+// RWLock: commands that only read its entries share it, one that
+// changes them holds it alone.  A command takes all the locks it needs
+// at once through a LockSet, which takes them in a fixed order, so two
+// commands never wait for each other.  Walks that go down the tree
+// lock each directory as they come to it; since they go from the top
+// down, they keep to the same order (see lockOrder() in filesystem.h).
+//
+// Metadata that readers look at without any lock (times, sizes, link
+// counts) is read and written through the relaxed atomics at the end.
+
+#ifndef FILESYSTEM_RWLOCK_H
+#define FILESYSTEM_RWLOCK_H
+
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+namespace filesystem {
+
+class RWLock {
+  pthread_rwlock_t l;
+public:
+  RWLock() { pthread_rwlock_init( &l, 0 ); }
+  ~RWLock() { pthread_rwlock_destroy( &l ); }
+  RWLock( const RWLock& ) = delete;
+  RWLock& operator=( const RWLock& ) = delete;
+
+  void lockShared() { pthread_rwlock_rdlock( &l ); }
+  void lock() { pthread_rwlock_wrlock( &l ); }
+  void unlock() { pthread_rwlock_unlock( &l ); }
+};
+
+// The directory locks this thread holds, so that a walk inside a
+// command that already holds a directory doesn't lock it again.
+vector<RWLock*>& heldLocks() {
+  static thread_local vector<RWLock*> held;
+  return held;
+}
+
+bool holds( RWLock& l ) {
+  vector<RWLock*>& held = heldLocks();
+  return std::find( held.begin(), held.end(), &l ) != held.end();
+}
+
+// Takes l shared unless this thread holds it already; returns whether
+// it did, and so has to let go of it with readUnlock().
+bool readLock( RWLock& l ) {
+  if ( holds( l ) ) return false;
+  l.lockShared();
+  heldLocks().push_back( &l );
+  return true;
+}
+
+void readUnlock( RWLock& l ) {
+  vector<RWLock*>& held = heldLocks();
+  held.erase( std::find( held.begin(), held.end(), &l ) );
+  l.unlock();
+}
+
+// Locks wanted together.  add() as many as needed, naming the same
+// lock more than once if need be (the strongest mode asked wins), then
+// acquire(); the destructor lets go of them.
+class LockSet {
+  struct Want {
+    RWLock* l;
+    uint64_t order;
+    bool exclusive;
+  };
+  vector<Want> want;
+  size_t taken = 0;
+public:
+  ~LockSet() { release(); }
+
+  void add( RWLock& l, uint64_t order, bool exclusive ) {
+    for ( auto& w : want )
+      if ( w.l == &l ) {
+        w.exclusive |= exclusive;
+        return;
+      }
+    want.push_back( Want{ &l, order, exclusive } );
+  }
+
+  // Whether every lock in o is here, in o's mode or a stronger one.
+  bool covers( const LockSet& o ) const {
+    for ( auto& x : o.want ) {
+      bool found = false;
+      for ( auto& w : want ) found |= w.l == x.l && ( w.exclusive || ! x.exclusive );
+      if ( ! found ) return false;
+    }
+    return true;
+  }
+
+  void acquire() {
+    sort( want.begin(), want.end(), []( const Want& a, const Want& b ) { return a.order < b.order; } );
+    vector<RWLock*>& held = heldLocks();
+    for ( taken = 0; taken < want.size(); ++taken ) {
+      Want& w = want[taken];
+      if ( w.exclusive ) w.l->lock();
+      else w.l->lockShared();
+      held.push_back( w.l );
+    }
+  }
+
+  void release() {
+    vector<RWLock*>& held = heldLocks();
+    while ( taken ) {
+      Want& w = want[--taken];
+      held.erase( std::find( held.begin(), held.end(), w.l ) );
+      w.l->unlock();
+    }
+  }
+
+  void clear() {
+    release();
+    want.clear();
+  }
+};
+
+template< typename T > T loadRelaxed( const T& x ) { return __atomic_load_n( &x, __ATOMIC_RELAXED ); }
+template< typename T > void storeRelaxed( T& x, T v ) { __atomic_store_n( &x, v, __ATOMIC_RELAXED ); }
+template< typename T > T addRelaxed( T& x, T v ) { return __atomic_add_fetch( &x, v, __ATOMIC_RELAXED ); }
+
+}
+
+#endif
@@ -0,0 +1,268 @@
+// Incremental saves.  The image is a set of records, one per
+// directory, each naming its entries and holding their times and, for
+// files, their contents.  A save writes the records of the directories
+// that changed since the last one into a new segment file, then a new
+// manifest saying where every directory's latest record is; records of
+// unchanged directories stay where they are.  So a save costs in
+// proportion to what changed, not to the size of the image.
+//
+// All of it lives in one directory:
+//   MANIFEST   magic "FSMANI", version, the caller's header, the next
+//              record id and segment number, then for each record its
+//              id, segment, offset and length; FNV-1a checksum last.
+//   <n>.seg    magic "FSSEGM", records back to back, checksum last.
+// Segments are written and synced before the manifest is renamed into
+// place, so a crash leaves the old manifest and everything it refers
+// to intact.  A segment is deleted once the manifest no longer refers
+// to any record in it.  The writing can be done by another thread; see
+// Batch.
+
+#ifndef FILESYSTEM_SEGMENTS_H
+#define FILESYSTEM_SEGMENTS_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <set>
+#include <cassert>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+using namespace std;
+namespace filesystem {
+
+const char MANIFEST_MAGIC[] = "FSMANI";
+const char SEGMENT_MAGIC[] = "FSSEGM";
+const uint64_t MANIFEST_VERSION = 1;
+
+class SegmentStore {
+public:
+  struct Extent { uint32_t seg; uint64_t off, len; };
+  typedef unordered_map<uint32_t, Extent> Index;
+
+  // One save: records for a new segment, and what the manifest will
+  // say.  prepare() takes a copy of the index as it stands, so that
+  // write(), which only reads the batch, can run in another thread
+  // while the store goes on being used; finish() then adopts it.
+  struct Batch {
+    uint32_t seg = 0, nextId = 0;
+    string header;
+    Index index;
+    SnapWriter buf;
+    vector< pair<uint32_t, Extent> > extents;
+    uint64_t written = 0;
+
+    void put( uint32_t id, const string& rec ) {
+      if ( buf.buf.empty() ) buf.bytes( SEGMENT_MAGIC, 6 );
+      Extent e = { seg, buf.buf.size(), rec.size() };
+      buf.bytes( rec.data(), rec.size() );
+      extents.push_back( make_pair( id, e ) );
+    }
+  };
+
+private:
+  Index where;                                      // record id -> extent.
+  set<uint32_t> onDisk;                             // segments written.
+  unordered_map<uint32_t, string> loaded;           // segments read by record().
+  uint32_t nextId = 1, nextSeg = 1;
+  bool inFlight = false;                            // between prepare and finish,
+  vector<uint32_t> droppedMeanwhile;                // records dropped.
+
+  string file( uint32_t seg ) const { return dir + "/" + to_string(seg) + ".seg"; }
+
+  static bool readFile( const string& path, string& data ) {
+    ifstream in( path, ios::binary );
+    if ( ! in ) return false;
+    data.assign( (istreambuf_iterator<char>(in)), istreambuf_iterator<char>() );
+    return true;
+  }
+
+  // Writes data and its checksum to path, synced, via a renamed .tmp.
+  static bool writeFile( const string& path, const string& data ) {
+    string tmp = path + ".tmp";
+    int fd = ::open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( fd < 0 ) return false;
+    uint64_t sum = fnv64( data.data(), data.size() );
+    char tail[8];
+    for ( int i = 0; i < 8; ++i ) tail[i] = char( sum >> ( 8 * i ) );
+    bool ok = ::write( fd, data.data(), data.size() ) == ssize_t( data.size() )
+           && ::write( fd, tail, 8 ) == 8 && fsync( fd ) == 0;
+    ok = ::close( fd ) == 0 && ok;
+    return ok && ::rename( tmp.c_str(), path.c_str() ) == 0;
+  }
+
+  // Strips and checks the magic and checksum; false if data is damaged.
+  static bool unwrap( string& data, const char* magic ) {
+    if ( data.size() < 6 + 8 || data.compare( 0, 6, magic ) != 0 ) return false;
+    uint64_t sum = 0;
+    for ( int i = 0; i < 8; ++i ) sum |= uint64_t( (unsigned char)data[ data.size() - 8 + i ] ) << ( 8 * i );
+    if ( sum != fnv64( data.data(), data.size() - 8 ) ) return false;
+    data.resize( data.size() - 8 );
+    return true;
+  }
+
+public:
+  string dir;
+  string header;                 // the caller's, kept in the manifest.
+  uint64_t written = 0;          // bytes written by the last save.
+
+  SegmentStore( const string& d ) : dir(d) {}
+
+  // Reads the manifest; false if there is none or it is damaged.
+  bool open() {
+    string data;
+    if ( ! readFile( dir + "/MANIFEST", data ) ) return false;
+    if ( ! unwrap( data, MANIFEST_MAGIC ) ) {
+      cerr << dir << "/MANIFEST is damaged (bad checksum)\n";
+      return false;
+    }
+    SnapReader r( data.data() + 6, data.size() - 6 );
+    if ( r.varint() != MANIFEST_VERSION ) return false;
+    header = r.str();
+    nextId = r.varint();
+    nextSeg = r.varint();
+    uint64_t n = r.varint();
+    where.clear();
+    onDisk.clear();
+    uint32_t id = 0;
+    for ( uint64_t i = 0; i < n && r.ok; ++i ) {
+      id += r.varint();                              // ids go up.
+      Extent e;
+      e.seg = r.varint();
+      e.off = r.varint();
+      e.len = r.varint();
+      where[id] = e;
+      onDisk.insert( e.seg );
+    }
+    return r.ok;
+  }
+
+  uint32_t newId() { return nextId++; }
+  bool has( uint32_t id ) const { return where.count(id); }
+  bool busy() const { return inFlight; }
+
+  // Record id's bytes, reading its segment on first use; 0 if it
+  // can't be had.  Segments stay in memory until release().
+  const char* record( uint32_t id, size_t& len ) {
+    auto it = where.find(id);
+    if ( it == where.end() ) return 0;
+    auto seg = loaded.find( it->second.seg );
+    if ( seg == loaded.end() ) {
+      string data;
+      if ( ! readFile( file( it->second.seg ), data ) || ! unwrap( data, SEGMENT_MAGIC ) ) {
+        cerr << file( it->second.seg ) << " is missing or damaged\n";
+        return 0;
+      }
+      seg = loaded.insert( make_pair( it->second.seg, data ) ).first;
+    }
+    if ( it->second.off + it->second.len > seg->second.size() ) return 0;
+    len = it->second.len;
+    return seg->second.data() + it->second.off;
+  }
+  void release() { loaded.clear(); }
+
+  // Forgets record id, whose directory is gone.
+  void drop( uint32_t id ) {
+    where.erase( id );
+    if ( inFlight ) droppedMeanwhile.push_back( id );
+  }
+
+  // Starts a save; the caller puts records into b and calls write()
+  // and finish().  Only one save may be in flight.
+  void prepare( Batch& b ) {
+    assert( ! inFlight );
+    inFlight = true;
+    b.seg = nextSeg++;
+    b.nextId = nextId;
+    b.header = header;
+    b.index = where;
+  }
+
+  // Writes b's segment, if it has records, then the manifest.  Reads
+  // nothing but b and dir.
+  bool write( Batch& b ) const {
+    b.written = 0;
+    if ( ::mkdir( dir.c_str(), 0755 ) != 0 && errno != EEXIST ) return false;
+    if ( b.extents.size() ) {
+      if ( ! writeFile( file( b.seg ), b.buf.buf ) ) return false;
+      b.written += b.buf.buf.size() + 8;
+    }
+    for ( auto& it : b.extents ) b.index[ it.first ] = it.second;
+    vector<uint32_t> ids;
+    for ( auto& it : b.index ) ids.push_back( it.first );
+    sort( ids.begin(), ids.end() );
+    SnapWriter m;
+    m.bytes( MANIFEST_MAGIC, 6 );
+    m.varint( MANIFEST_VERSION );
+    m.str( b.header );
+    m.varint( b.nextId );
+    m.varint( b.seg + 1 );
+    m.varint( ids.size() );
+    uint32_t last = 0;
+    for ( auto id : ids ) {
+      const Extent& e = b.index[id];
+      m.varint( id - last );
+      m.varint( e.seg );
+      m.varint( e.off );
+      m.varint( e.len );
+      last = id;
+    }
+    if ( ! writeFile( dir + "/MANIFEST", m.buf ) ) return false;
+    b.written += m.buf.size() + 8;
+    return true;
+  }
+
+  // Ends the save b.  If its manifest was written, takes in the new
+  // records, except for those dropped since prepare(), and deletes
+  // the segments that manifest no longer refers to.  If not, deletes
+  // b's segment, which no manifest will ever refer to.
+  void finish( Batch& b, bool ok ) {
+    inFlight = false;
+    written = ok ? b.written : 0;
+    if ( ! ok && b.extents.size() ) ::unlink( file( b.seg ).c_str() );
+    if ( ok ) {
+      header = b.header;
+      set<uint32_t> dropped( droppedMeanwhile.begin(), droppedMeanwhile.end() );
+      for ( auto& it : b.extents )
+        if ( ! dropped.count( it.first ) ) where[ it.first ] = it.second;
+      if ( b.extents.size() ) onDisk.insert( b.seg );
+      set<uint32_t> used;
+      for ( auto& it : b.index ) used.insert( it.second.seg );     // b.index is the manifest now.
+      for ( auto it = onDisk.begin(); it != onDisk.end(); )
+        if ( ! used.count( *it ) ) {
+          ::unlink( file( *it ).c_str() );
+          it = onDisk.erase( it );
+        }
+        else ++it;
+    }
+    droppedMeanwhile.clear();
+  }
+
+  // Bytes of records the manifest refers to, and bytes of segments
+  // kept on disk for them; the difference is what compaction frees.
+  uint64_t live() const {
+    uint64_t n = 0;
+    for ( auto& it : where ) n += it.second.len;
+    return n;
+  }
+  uint64_t stored() const {
+    uint64_t n = 0;
+    for ( auto seg : onDisk ) {
+      struct stat st;
+      if ( ::stat( file( seg ).c_str(), &st ) == 0 ) n += st.st_size;
+    }
+    return n;
+  }
+  size_t records() const { return where.size(); }
+  size_t segmentCount() const { return onDisk.size(); }
+};
+}
+
+#endif
@@ -0,0 +1,81 @@
+// Fixed-size allocation for inodes and their payloads.  Each class
+// that is created and destroyed in bulk (Inode<File>, File, and so on)
+// routes its operator new and delete to its own Slab, so objects of a
+// kind are packed together in pages instead of scattered across the
+// heap: the inodes of a directory made in one go sit next to each
+// other, and a freed slot is handed to the next object of that type.
+// Commands running side by side share the slabs, so each has a mutex.
+
+#ifndef FILESYSTEM_SLAB_H
+#define FILESYSTEM_SLAB_H
+
+#include <vector>
+#include <cstddef>
+#include <cassert>
+#include <type_traits>
+#include <mutex>
+
+using namespace std;
+namespace filesystem {
+
+template< typename T >
+class Slab {
+  // Pages hold PAGE_BYTES worth of slots and are never moved or
+  // returned.  A free slot's first bytes link it into the free list.
+  static const size_t PAGE_BYTES = 64 * 1024;
+  union Slot {
+    Slot* next;
+    typename aligned_storage< sizeof(T), alignof(T) >::type object;
+  };
+  static const size_t PER_PAGE = PAGE_BYTES / sizeof(Slot) ? PAGE_BYTES / sizeof(Slot) : 1;
+  vector<Slot*> pages;
+  Slot* freeList = 0;
+  size_t used = PER_PAGE;       // slots handed out from the last page.
+  mutex m;
+public:
+  size_t live = 0;                        // objects currently allocated.
+  size_t allocations = 0, releases = 0;
+
+  void* allocate() {
+    lock_guard<mutex> hold( m );
+    Slot* s;
+    if ( freeList ) {
+      s = freeList;
+      freeList = s->next;
+    } else {
+      if ( used == PER_PAGE ) {
+        pages.push_back( static_cast<Slot*>( ::operator new( PER_PAGE * sizeof(Slot) ) ) );
+        used = 0;
+      }
+      s = pages.back() + used++;
+    }
+    ++live;
+    ++allocations;
+    return s;
+  }
+
+  void release( void* p ) {
+    if ( ! p ) return;
+    lock_guard<mutex> hold( m );
+    assert( live > 0 );
+    Slot* s = static_cast<Slot*>(p);
+    s->next = freeList;
+    freeList = s;
+    --live;
+    ++releases;
+  }
+
+  size_t objectBytes() const { return sizeof(Slot); }
+  size_t liveBytes() const { return live * sizeof(Slot); }
+  size_t reservedBytes() const { return pages.size() * PER_PAGE * sizeof(Slot); }
+};
+
+// The slab for objects of type T; one per type for the whole program.
+template< typename T > Slab<T>& slab() {
+  static Slab<T> s;
+  return s;
+}
+
+}
+
+#endif
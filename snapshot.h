@@ -0,0 +1,104 @@
+// Byte-level encoding for binary snapshots of the tree.  Integers are
+// written as varints (7 bits per byte, low bits first, high bit set
+// on all but the last byte); signed values are zigzag-encoded first
+// so that small negative numbers stay short.  Strings and file
+// contents are a varint length followed by the bytes.  A SnapReader
+// never reads past its buffer: once anything is short or malformed
+// ok turns false and every later read returns zero.
+
+#ifndef FILESYSTEM_SNAPSHOT_H
+#define FILESYSTEM_SNAPSHOT_H
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+namespace filesystem {
+
+// 64-bit FNV-1a, used as the snapshot's trailing checksum.
+uint64_t fnv64( const char* p, size_t n, uint64_t h = 14695981039346656037ULL ) {
+  for ( size_t i = 0; i < n; ++i ) {
+    h ^= (unsigned char)p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+class SnapWriter {
+public:
+  string buf;
+
+  void byte( unsigned char b ) { buf.push_back( b ); }
+
+  void varint( uint64_t v ) {
+    char tmp[10];
+    int n = 0;
+    while ( v >= 0x80 ) {
+      tmp[n++] = char( v | 0x80 );
+      v >>= 7;
+    }
+    tmp[n++] = char(v);
+    buf.append( tmp, n );
+  }
+
+  void zigzag( int64_t v ) { varint( ( uint64_t(v) << 1 ) ^ uint64_t( v >> 63 ) ); }
+
+  void bytes( const char* p, size_t n ) { buf.append( p, n ); }
+
+  void str( const string& s ) {
+    varint( s.size() );
+    buf += s;
+  }
+};
+
+class SnapReader {
+  const char* p;
+  const char* end;
+public:
+  bool ok = true;
+
+  SnapReader( const char* p, size_t n ) : p(p), end(p + n) {}
+
+  size_t left() const { return end - p; }
+
+  unsigned char byte() {
+    if ( p == end ) { ok = false; return 0; }
+    return *p++;
+  }
+
+  uint64_t varint() {
+    uint64_t v = 0;
+    for ( int shift = 0; shift < 64; shift += 7 ) {
+      if ( p == end ) break;
+      unsigned char b = *p++;
+      v |= uint64_t( b & 0x7f ) << shift;
+      if ( ! ( b & 0x80 ) ) return v;
+    }
+    ok = false;
+    return 0;
+  }
+
+  int64_t zigzag() {
+    uint64_t v = varint();
+    return int64_t( v >> 1 ) ^ - int64_t( v & 1 );
+  }
+
+  // The next n bytes, or 0 if there aren't that many.
+  const char* bytes( size_t n ) {
+    if ( ! ok || n > left() ) { ok = false; return 0; }
+    const char* q = p;
+    p += n;
+    return q;
+  }
+
+  string str() {
+    size_t n = varint();
+    const char* q = bytes(n);
+    return q ? string( q, n ) : string();
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,252 @@
+// An inverted index over the contents of regular files, for grep.  It
+// maps each trigram (three consecutive bytes) and each word (a run of
+// letters, digits and _ of up to WORD_MAX bytes) to the ids of the
+// inodes whose contents hold it.  A string of three or more bytes can
+// only be in files listed under every one of its trigrams, and a word
+// only in files listed under it, so a search checks just those.
+//
+// Words are kept by a 64-bit hash rather than spelled out, and each
+// list as the differences between successive ids, in varints, most of
+// them a byte.
+//
+// Inodes report changes with changed(id), which costs a flag (under a
+// mutex, as commands on several threads may report at once); the
+// index catches up when it is next asked, indexing each changed file
+// again.  Lists are only ever appended to, so a file's old entries
+// stay behind, stale: candidates are always checked against the
+// contents, and a stale entry costs no more than a needless check.
+// Once stale entries outnumber live ones the index is rebuilt.
+
+#ifndef FILESYSTEM_TEXTINDEX_H
+#define FILESYSTEM_TEXTINDEX_H
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+
+using namespace std;
+namespace filesystem {
+
+// A list of ids, as zigzag varints of the difference from the id
+// before.
+struct Postings {
+  string bytes;
+  int32_t last = 0;
+
+  void push( int32_t id ) {
+    uint32_t d = uint32_t( id - last ) << 1 ^ uint32_t( ( id - last ) >> 31 );
+    for ( ; d >= 0x80; d >>= 7 ) bytes += char( d | 0x80 );
+    bytes += char( d );
+    last = id;
+  }
+  template< typename F > void each( F f ) const {
+    int32_t id = 0;
+    for ( size_t k = 0; k < bytes.size(); ) {
+      uint32_t d = 0;
+      for ( int shift = 0; ; shift += 7 ) {
+        unsigned char b = bytes[k++];
+        d |= uint32_t( b & 0x7f ) << shift;
+        if ( ! ( b & 0x80 ) ) break;
+      }
+      id += int32_t( d >> 1 ^ -( d & 1 ) );
+      f( id );
+    }
+  }
+};
+
+class TextIndex {
+  unordered_map<uint32_t, Postings> grams;
+  unordered_map<uint64_t, Postings> words;
+  vector<char> flagged;
+  vector<int32_t> pending;
+  mutex pendingLock;
+  vector<uint32_t> entries;            // live entries for each id.
+  vector<int32_t> mark;                // for intersecting lists.
+
+  // The file being indexed.
+  int32_t id = -1;
+  uint32_t last = 0;                   // the two bytes before, and
+  int have = 0;                        // how many of them there are.
+  uint64_t word = 0;                   // hash of the word so far,
+  size_t wordLen = 0;                  // and its length.
+  vector<uint64_t> seen;               // a bit per trigram, while in a file.
+  vector<uint32_t> fileGrams;
+  vector<uint64_t> fileWords;          // sorted and made unique at the end.
+
+  static uint64_t step( uint64_t h, unsigned char c ) { return ( h ^ c ) * 1099511628211ull; }
+  static const uint64_t START = 14695981039346656037ull;
+
+  static bool wordByte( unsigned char c ) {
+    return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || ( c >= '0' && c <= '9' ) || c == '_';
+  }
+
+  void endWord() {
+    if ( wordLen && wordLen <= WORD_MAX ) fileWords.push_back( word );
+    word = START;
+    wordLen = 0;
+  }
+
+public:
+  static const size_t WORD_MAX = 64;
+  uint64_t live = 0, stale = 0;        // list entries.
+  uint64_t bytes = 0;                  // indexed so far, all told.
+  long files = 0, rebuilds = 0;
+
+  void changed( int32_t i ) {
+    lock_guard<mutex> hold( pendingLock );
+    if ( size_t(i) >= flagged.size() ) flagged.resize( i + 1 + flagged.size() / 2 );
+    if ( flagged[i] ) return;
+    flagged[i] = 1;
+    pending.push_back( i );
+  }
+
+  // The ids changed since the last call, and clears their flags.
+  vector<int32_t> takePending() {
+    vector<int32_t> v;
+    lock_guard<mutex> hold( pendingLock );
+    v.swap( pending );
+    for ( auto i : v ) flagged[i] = 0;
+    return v;
+  }
+
+  // Marks i's entries stale.
+  void drop( int32_t i ) {
+    if ( size_t(i) >= entries.size() ) return;
+    stale += entries[i];
+    live -= entries[i];
+    entries[i] = 0;
+  }
+
+  bool wasteful() const { return stale > max( live, uint64_t( 1 << 16 ) ); }
+
+  // Empties the index, to be filled again from scratch.
+  void clear() {
+    grams.clear();
+    words.clear();
+    fill( entries.begin(), entries.end(), 0 );
+    live = stale = 0;
+    ++rebuilds;
+  }
+
+  // Indexes the contents of id i, fed in order with feed().
+  void begin( int32_t i ) {
+    id = i;
+    have = 0;
+    word = START;
+    wordLen = 0;
+    if ( seen.empty() ) seen.resize( ( 1 << 24 ) / 64 );
+    if ( size_t(i) >= entries.size() ) entries.resize( i + 1 + entries.size() / 2 );
+  }
+  void feed( const char* p, size_t n ) {
+    const unsigned char* u = (const unsigned char*)p;
+    for ( size_t k = 0; k < n; ++k ) {
+      unsigned char c = u[k];
+      last = ( last << 8 | c ) & 0xffffff;
+      if ( have < 2 ) ++have;
+      else if ( ! ( seen[last >> 6] >> ( last & 63 ) & 1 ) ) {
+        seen[last >> 6] |= uint64_t(1) << ( last & 63 );
+        fileGrams.push_back( last );
+      }
+      if ( ! wordByte( c ) ) {
+        if ( wordLen ) endWord();
+      }
+      else {
+        word = step( word, c );
+        ++wordLen;
+      }
+    }
+    bytes += n;
+  }
+  void end() {
+    endWord();
+    sort( fileWords.begin(), fileWords.end() );
+    fileWords.erase( unique( fileWords.begin(), fileWords.end() ), fileWords.end() );
+    for ( auto g : fileGrams ) {
+      grams[g].push( id );
+      seen[g >> 6] = 0;
+    }
+    for ( auto w : fileWords ) words[w].push( id );
+    entries[id] = fileGrams.size() + fileWords.size();
+    live += entries[id];
+    fileGrams.clear();
+    fileWords.clear();
+    ++files;
+  }
+
+  // The ids that may hold s, or, as a whole word, w; false if the
+  // index can't say (s is shorter than a trigram).  May hold ids whose
+  // contents have changed since, and ids no longer in use.
+  bool candidates( const string& s, bool w, vector<int32_t>& out ) {
+    vector<const Postings*> lists;
+    static const Postings none;
+    bool isWord = s.size() <= WORD_MAX && all_of( s.begin(), s.end(), []( char c ) { return wordByte( c ); } );
+    if ( w && isWord && s.size() ) {
+      uint64_t h = START;
+      for ( unsigned char c : s ) h = step( h, c );
+      auto it = words.find( h );
+      lists.push_back( it == words.end() ? &none : &it->second );
+    }
+    else if ( s.size() >= 3 ) {
+      vector<uint32_t> gs;
+      for ( size_t k = 0; k + 2 < s.size(); ++k )
+        gs.push_back( uint32_t( (unsigned char)s[k] ) << 16 | uint32_t( (unsigned char)s[k+1] ) << 8 | (unsigned char)s[k+2] );
+      sort( gs.begin(), gs.end() );
+      gs.erase( unique( gs.begin(), gs.end() ), gs.end() );
+      for ( auto g : gs ) {
+        auto it = grams.find( g );
+        lists.push_back( it == grams.end() ? &none : &it->second );
+      }
+    }
+    else return false;
+    sort( lists.begin(), lists.end(), []( const Postings* a, const Postings* b ) { return a->bytes.size() < b->bytes.size(); } );
+    // An id is in every list if it gets its mark raised by each in
+    // turn.  Past the first list only ids already marked matter, so
+    // once none are left the rest can be skipped.
+    if ( mark.size() < entries.size() ) mark.resize( entries.size() );
+    vector<int32_t> touched;
+    lists[0]->each( [&]( int32_t i ) {
+      if ( mark[i] == 0 ) {
+        mark[i] = 1;
+        touched.push_back( i );
+      }
+    } );
+    int32_t k = 1;
+    size_t alive = touched.size();              // ids marked by every list so far.
+    for ( size_t l = 1; l < lists.size() && alive; ++l, ++k ) {
+      alive = 0;
+      lists[l]->each( [&]( int32_t i ) {
+        if ( mark[i] == k ) {
+          mark[i] = k + 1;
+          ++alive;
+        }
+      } );
+    }
+    out.clear();
+    for ( auto i : touched ) {
+      if ( mark[i] == k ) out.push_back( i );
+      mark[i] = 0;
+    }
+    return true;
+  }
+
+  // Bytes held, roughly: the lists, and the hash tables' nodes.
+  size_t memory( size_t& gramCount, size_t& wordCount ) const {
+    size_t m = 0;
+    for ( auto& g : grams ) m += sizeof g + 2 * sizeof(void*) + g.second.bytes.capacity();
+    for ( auto& w : words ) m += sizeof w + 2 * sizeof(void*) + w.second.bytes.capacity();
+    m += ( grams.bucket_count() + words.bucket_count() ) * sizeof(void*);
+    m += seen.size() * sizeof(uint64_t) + ( entries.size() + mark.size() ) * sizeof(int32_t);
+    gramCount = grams.size();
+    wordCount = words.size();
+    return m;
+  }
+};
+
+TextIndex textIndex;
+
+}
+
+#endif